@@ -0,0 +1,231 @@
+#!/bin/bash
+
+#=============================================================================
+# flashblk 端到端基准测试
+#
+# 加载 flash_i2c_model (虚拟 I2C 总线上的 Flash 设备模型) 和 flashblk，
+# 在 flashblk 上创建 ext4 并运行几种负载，每种负载统计:
+#   - flashblk 侧: 擦除次数、编程页数、I2C 传输数 / 消息数 (/sys/block/<disk>/stats)
+#   - 设备模型侧: 总线字节数、子命令数、协议错误 (/sys/bus/i2c/devices/i2c-<bus>/flash_stats)
+#   - 吞吐量: 负载数据量 / 耗时 (含 sync)
+#
+# 用法: ./flashblk_bench.sh [flashblk 模块参数...]
+#   ./flashblk_bench.sh                       # 默认参数
+#   ./flashblk_bench.sh ftl=1 wb_blocks=32    # 对比 FTL + 写回缓存
+#
+# 环境变量:
+#   MODULE_DIR   .ko 所在目录 (默认脚本所在目录，即 build/output)
+#   BUS          虚拟 I2C 总线号 (默认 14，避开真实的 i2c-4)
+#   PROVIDER     i2c (设备模型，默认) 或 emul (flashblk 内置模拟器)
+#   SPLIT        1 (默认): 只在 512KB Flash 区域 (flashblk_nor) 上测试
+#                0: 整个 3.5MB 设备，ext4 从头分配，负载几乎全部落在 3MB RAM 区域
+#   WORK_KB      每种负载的数据量 (默认 128，SPLIT=0 时 256)
+#   MNT          挂载点 (默认 /mnt/flashblk_bench)
+#   MODEL_ARGS   flash_i2c_model 的额外参数，如 "byte_ns=0 erase_us=0"
+#=============================================================================
+
+MODULE_DIR=${MODULE_DIR:-$(cd "$(dirname "$0")" && pwd)}
+BUS=${BUS:-14}
+PROVIDER=${PROVIDER:-i2c}
+SPLIT=${SPLIT:-1}
+# 512KB 的 Flash 区域上要同时放下文件和小文件
+if [ "$SPLIT" = "1" ]; then
+    WORK_KB=${WORK_KB:-128}
+else
+    WORK_KB=${WORK_KB:-256}
+fi
+MNT=${MNT:-/mnt/flashblk_bench}
+MODEL_ARGS=${MODEL_ARGS:-}
+BLK_ARGS="$*"
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "需要 root 权限"
+    exit 1
+fi
+
+if [ "$SPLIT" = "1" ]; then
+    DISK=flashblk_nor
+    BLK_ARGS="split_regions=1 $BLK_ARGS"
+else
+    DISK=flashblk
+fi
+DEV=/dev/$DISK
+BLK_STATS=/sys/block/$DISK/stats
+MODEL_STATS=/sys/bus/i2c/devices/i2c-$BUS/flash_stats
+
+# 统计字段
+BLK_KEYS="erases pages_programmed i2c_transfers i2c_msgs read_bytes"
+# 任一变化说明负载到达了 Flash (emul 时没有 I2C 传输)
+FLASH_KEYS="erases pages_programmed i2c_transfers read_bytes"
+MODEL_KEYS="bus_bytes reads programs erases busy_errors protocol_errors"
+
+cleanup() {
+    cd /
+    mountpoint -q "$MNT" && umount "$MNT"
+    lsmod | grep -q "^block_driver" && rmmod block_driver
+    lsmod | grep -q "^flash_i2c_model" && rmmod flash_i2c_model
+}
+trap cleanup EXIT
+
+# 读取 "key: value" 格式统计中的一个字段
+stat_get() {
+    awk -v k="$2:" '$1 == k { print $2; exit }' "$1" 2>/dev/null
+}
+
+# 保存一组统计的快照到关联数组
+declare -A BEFORE
+snapshot_stats() {
+    local k
+    for k in $BLK_KEYS; do
+        BEFORE[blk_$k]=$(stat_get "$BLK_STATS" "$k")
+    done
+    if [ -r "$MODEL_STATS" ]; then
+        for k in $MODEL_KEYS; do
+            BEFORE[model_$k]=$(stat_get "$MODEL_STATS" "$k")
+        done
+    fi
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# 运行一种负载: run_workload <名称> <数据量KB> <命令...>
+# 命令失败时该行标记为失败，不输出吞吐量，之后的负载依赖其文件，全部跳过，脚本以非 0 退出
+FAILED=0
+run_workload() {
+    local name=$1 kb=$2 start end ms k line moved=0 d ok=1
+    shift 2
+
+    if [ "$FAILED" -eq 1 ]; then
+        printf "%-12s 跳过 (前面的负载失败)\n" "$name"
+        return
+    fi
+
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    snapshot_stats
+    start=$(now_ns)
+    "$@" || ok=0
+    sync
+    end=$(now_ns)
+    ms=$(( (end - start) / 1000000 ))
+    [ "$ms" -eq 0 ] && ms=1
+
+    if [ "$ok" -eq 1 ]; then
+        line=$(printf "%-12s %6d KB %8d ms %8d KB/s" "$name" "$kb" "$ms" $(( kb * 1000 / ms )))
+    else
+        line=$(printf "%-12s %6d KB %8d ms %8s" "$name" "$kb" "$ms" "FAILED")
+        FAILED=1
+    fi
+    for k in $BLK_KEYS; do
+        d=$(( $(stat_get "$BLK_STATS" "$k") - ${BEFORE[blk_$k]:-0} ))
+        line+=$(printf " %s=%d" "$k" "$d")
+        [[ " $FLASH_KEYS " == *" $k "* ]] && [ "$d" -ne 0 ] && moved=1
+    done
+    echo "$line"
+    if [ "$ok" -eq 0 ]; then
+        echo "  错误: [$name] 负载命令失败，本行不是有效测量"
+    elif [ "$kb" -gt 0 ] && [ "$moved" -eq 0 ]; then
+        echo "  警告: [$name] Flash 计数没有变化，负载没有到达 Flash (落在 RAM 区域、页缓存、写回缓存或镜像中)"
+    fi
+    if [ -r "$MODEL_STATS" ]; then
+        line=$(printf "%-12s" "  model")
+        for k in $MODEL_KEYS; do
+            line+=$(printf " %s=%d" "$k" $(( $(stat_get "$MODEL_STATS" "$k") - ${BEFORE[model_$k]:-0} )))
+        done
+        echo "$line"
+    fi
+}
+
+# ============ 负载 ============
+# 顺序写一个文件
+wl_seq_write() {
+    dd if=/dev/urandom of="$MNT/seq.bin" bs=4k count=$((WORK_KB / 4)) conv=fsync status=none
+}
+
+# 在已有文件内随机覆盖 4KB 块，每次 fsync
+wl_rand_write() {
+    local i blocks=$((WORK_KB / 4))
+    for ((i = 0; i < blocks; i++)); do
+        dd if=/dev/urandom of="$MNT/seq.bin" bs=4k count=1 seek=$((RANDOM % blocks)) \
+           conv=notrunc,fsync status=none || return 1
+    done
+}
+
+# 大量小文件 (1KB)，模拟配置和日志，第一次失败即停止
+wl_small_files() {
+    local i
+    mkdir -p "$MNT/small"
+    for ((i = 0; i < WORK_KB; i++)); do
+        head -c 1024 /dev/urandom > "$MNT/small/f$i" || return 1
+    done
+}
+
+# 冷读全部文件 (页缓存已清空)
+wl_read() {
+    cat "$MNT/seq.bin" "$MNT"/small/* > /dev/null
+}
+
+# 删除并 fstrim，DISCARD 下发给 flashblk
+wl_delete_trim() {
+    rm -rf "$MNT/seq.bin" "$MNT/small"
+    sync
+    fstrim "$MNT" 2>/dev/null || true
+}
+
+# ============ 加载模块 ============
+cleanup
+
+# 快照压缩需要 LZ4_compress_default，板上 CONFIG_LZ4_COMPRESS=m
+if ! modprobe lz4_compress; then
+    echo "无法加载 lz4_compress，block_driver.ko 会因 Unknown symbol 加载失败"
+    exit 1
+fi
+
+if [ "$PROVIDER" = "i2c" ]; then
+    insmod "$MODULE_DIR/flash_i2c_model.ko" bus=$BUS $MODEL_ARGS || exit 1
+    insmod "$MODULE_DIR/block_driver.ko" provider=i2c i2c_bus=$BUS $BLK_ARGS || exit 1
+else
+    insmod "$MODULE_DIR/block_driver.ko" provider=emul $BLK_ARGS || exit 1
+fi
+
+# 等待 udev 创建设备节点
+for i in 1 2 3 4 5; do
+    [ -b "$DEV" ] && break
+    sleep 1
+done
+if ! [ -b "$DEV" ]; then
+    echo "$DEV 不存在"
+    exit 1
+fi
+
+# 512KB 的 Flash 区域放不下日志，不使用 journal
+# 按小文件数指定 inode 数，默认比例在 512KB 上只有 64 个 (FTL 时可用的更少)
+MKFS_OPTS="-q -F -b 1024 -N $((WORK_KB + 64))"
+[ "$SPLIT" = "1" ] && MKFS_OPTS="$MKFS_OPTS -O ^has_journal"
+
+echo "=== flashblk 基准测试: $DEV provider=$PROVIDER $BLK_ARGS ==="
+snapshot_stats
+start=$(now_ns)
+mkfs.ext4 $MKFS_OPTS "$DEV" || exit 1
+echo "mkfs.ext4: $(( ($(now_ns) - start) / 1000000 )) ms, erases=$(( $(stat_get "$BLK_STATS" erases) - ${BEFORE[blk_erases]:-0} ))"
+
+mkdir -p "$MNT"
+mount -t ext4 "$DEV" "$MNT" || exit 1
+
+echo
+run_workload seq_write   "$WORK_KB" wl_seq_write
+run_workload rand_write  "$WORK_KB" wl_rand_write
+run_workload small_files "$WORK_KB" wl_small_files
+run_workload read        "$((WORK_KB * 2))" wl_read
+run_workload delete_trim 0          wl_delete_trim
+
+echo
+echo "=== /sys/block/$DISK/stats ==="
+cat "$BLK_STATS"
+if [ -r "$MODEL_STATS" ]; then
+    echo "=== $MODEL_STATS ==="
+    cat "$MODEL_STATS"
+fi
+exit $FAILED
@@ -1,8 +1,9 @@
 /*
  * Flash Reader Program
- * 
- * This program reads data from flash memory at specified addresses
- * using the sysfs interface provided by the block_driver module.
+ *
+ * This program reads raw flash contents at any address range through
+ * the /dev/flashblk_flash character device of the block_driver module
+ * and streams them as binary to stdout or a file.
  */
 
 #include <stdio.h>
@@ -11,147 +12,105 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
-#define SYSFS_FLASH_DATA "/sys/class/flashblk/flashblk/flash_data"
-#define SYSFS_FLASH_ADDR "/sys/class/flashblk/flashblk/flash_addr"
-#define SYSFS_FLASH_LEN "/sys/class/flashblk/flashblk/flash_len"
+#define FLASH_DEV "/dev/flashblk_flash"
+#define READ_CHUNK (1024 * 1024)  /* Bytes per pread, the whole 512KB region in one call */
 
 void print_usage(const char *prog) {
-    printf("Flash Reader - Read data from flash memory via sysfs\n");
-    printf("\nUsage: %s <address> <length>\n", prog);
+    printf("Flash Reader - Read raw flash contents via %s\n", FLASH_DEV);
+    printf("\nUsage: %s <address> <length> [output]\n", prog);
     printf("\nArguments:\n");
     printf("  address  - Flash address to read (hex: 0xXXXXXX or decimal)\n");
-    printf("  length   - Number of bytes to read (1-256)\n");
+    printf("  length   - Number of bytes to read, 0 reads to the end of the flash\n");
+    printf("  output   - Output file (default: stdout, binary)\n");
     printf("\nExamples:\n");
-    printf("  %s 0x0C0003 16    # Read 16 bytes from 0x0C0003\n", prog);
-    printf("  %s 0x000000 256   # Read 256 bytes from 0x000000\n", prog);
-    printf("  %s 786432 64      # Read 64 bytes from decimal address\n", prog);
+    printf("  %s 0x000000 0x80000 flash.bin   # Dump the 512KB flashblk region\n", prog);
+    printf("  %s 0x0C0003 16 | xxd            # Hex dump 16 bytes from 0x0C0003\n", prog);
+    printf("  %s 786432 64 > data.bin         # Decimal address\n", prog);
     printf("\nNote: The driver module must be loaded first:\n");
     printf("  sudo insmod block_driver.ko\n");
 }
 
-int check_sysfs() {
-    if (access(SYSFS_FLASH_DATA, R_OK | W_OK) != 0) {
-        fprintf(stderr, "Error: Cannot access %s\n", SYSFS_FLASH_DATA);
-        fprintf(stderr, "Make sure the block_driver module is loaded:\n");
-        fprintf(stderr, "  sudo insmod block_driver.ko\n");
-        return -1;
-    }
-    return 0;
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-int write_sysfs(const char *path, const char *data) {
-    int fd;
+/* Write all of buf, retrying short writes to pipes */
+static int write_all(int fd, const char *buf, size_t len) {
     ssize_t ret;
-    
-    fd = open(path, O_WRONLY);
-    if (fd < 0) {
-        fprintf(stderr, "Error: Cannot open %s: %s\n", path, strerror(errno));
-        return -1;
-    }
-    
-    ret = write(fd, data, strlen(data));
-    close(fd);
-    
-    if (ret < 0) {
-        fprintf(stderr, "Error: Failed to write to %s: %s\n", path, strerror(errno));
-        return -1;
-    }
-    
-    return 0;
-}
 
-int read_flash_data(unsigned int addr, unsigned int len) {
-    char cmd[128];
-    FILE *fp;
-    char buffer[4096];
-    
-    if (len < 1 || len > 256) {
-        fprintf(stderr, "Error: Length must be between 1 and 256 bytes\n");
-        return -1;
-    }
-    
-    // Method 1: Use flash_data file with "address length" format
-    snprintf(cmd, sizeof(cmd), "%u %u", addr, len);
-    
-    printf("Reading %u bytes from flash address 0x%06X...\n", len, addr);
-    
-    if (write_sysfs(SYSFS_FLASH_DATA, cmd) != 0) {
-        return -1;
-    }
-    
-    // Small delay to allow driver to process
-    usleep(100000); // 100ms
-    
-    // Read the result
-    fp = fopen(SYSFS_FLASH_DATA, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open %s for reading: %s\n", 
-                SYSFS_FLASH_DATA, strerror(errno));
-        return -1;
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
     }
-    
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        printf("%s", buffer);
-    }
-    
-    fclose(fp);
     return 0;
 }
 
-int read_flash_data_separate(unsigned int addr, unsigned int len) {
-    char cmd[128];
-    FILE *fp;
-    char buffer[4096];
-    
-    if (len < 1 || len > 256) {
-        fprintf(stderr, "Error: Length must be between 1 and 256 bytes\n");
-        return -1;
-    }
-    
-    printf("Reading %u bytes from flash address 0x%06X...\n", len, addr);
-    
-    // Method 2: Set address and length separately
-    snprintf(cmd, sizeof(cmd), "0x%X", addr);
-    if (write_sysfs(SYSFS_FLASH_ADDR, cmd) != 0) {
-        return -1;
-    }
-    
-    snprintf(cmd, sizeof(cmd), "%u", len);
-    if (write_sysfs(SYSFS_FLASH_LEN, cmd) != 0) {
-        return -1;
-    }
-    
-    // Trigger read by reading flash_data
-    usleep(100000); // 100ms
-    
-    fp = fopen(SYSFS_FLASH_DATA, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open %s for reading: %s\n", 
-                SYSFS_FLASH_DATA, strerror(errno));
+int read_flash_data(int fd, int out, unsigned long addr, unsigned long len) {
+    size_t bufsize = len < READ_CHUNK ? len : READ_CHUNK;
+    unsigned long done = 0;
+    double start, elapsed;
+    char *buf;
+    ssize_t ret;
+
+    buf = malloc(bufsize);
+    if (!buf) {
+        fprintf(stderr, "Error: Cannot allocate %zu bytes\n", bufsize);
         return -1;
     }
-    
-    printf("\n--- Flash Data ---\n");
-    while (fgets(buffer, sizeof(buffer), fp)) {
-        printf("%s", buffer);
-    }
-    printf("------------------\n");
-    
-    fclose(fp);
-    return 0;
+
+    start = now_sec();
+    while (done < len) {
+        size_t chunk = len - done < bufsize ? len - done : bufsize;
+
+        ret = pread(fd, buf, chunk, addr + done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Read at 0x%06lX failed: %s\n", addr + done, strerror(errno));
+            break;
+        }
+        if (ret == 0) {
+            fprintf(stderr, "Warning: End of flash at 0x%06lX\n", addr + done);
+            break;
+        }
+        if (write_all(out, buf, ret) != 0) {
+            fprintf(stderr, "Error: Write failed: %s\n", strerror(errno));
+            break;
+        }
+        done += ret;
+    }
+    elapsed = now_sec() - start;
+    free(buf);
+
+    fprintf(stderr, "Read %lu bytes from flash address 0x%06lX in %.3f s (%.1f KB/s)\n",
+            done, addr, elapsed, elapsed > 0 ? done / 1024.0 / elapsed : 0.0);
+    return done == len ? 0 : -1;
 }
 
 int main(int argc, char *argv[]) {
-    unsigned int address;
-    unsigned int length;
+    unsigned long address;
+    unsigned long length;
+    off_t size;
     char *endptr;
-    
-    if (argc != 3) {
+    int fd, out = STDOUT_FILENO;
+    int ret;
+
+    if (argc != 3 && argc != 4) {
         print_usage(argv[0]);
         return 1;
     }
-    
+
     // Parse address (supports both hex and decimal)
     errno = 0;
     address = strtoul(argv[1], &endptr, 0);
@@ -160,7 +119,7 @@ int main(int argc, char *argv[]) {
         print_usage(argv[0]);
         return 1;
     }
-    
+
     // Parse length
     errno = 0;
     length = strtoul(argv[2], &endptr, 0);
@@ -169,12 +128,43 @@ int main(int argc, char *argv[]) {
         print_usage(argv[0]);
         return 1;
     }
-    
-    // Check if sysfs interface is available
-    if (check_sysfs() != 0) {
+
+    fd = open(FLASH_DEV, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open %s: %s\n", FLASH_DEV, strerror(errno));
+        fprintf(stderr, "Make sure the block_driver module is loaded:\n");
+        fprintf(stderr, "  sudo insmod block_driver.ko\n");
+        return 1;
+    }
+
+    // The device size is the addressable flash of the current provider
+    size = lseek(fd, 0, SEEK_END);
+    if (size < 0 || address >= (unsigned long)size) {
+        fprintf(stderr, "Error: Address 0x%06lX beyond the flash (0x%06lX bytes)\n",
+                address, (unsigned long)size);
+        close(fd);
+        return 1;
+    }
+    if (length == 0 || length > size - address)
+        length = size - address;
+
+    if (argc == 4) {
+        out = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", argv[3], strerror(errno));
+            close(fd);
+            return 1;
+        }
+    } else if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Error: Binary output, redirect stdout or pipe it into xxd\n");
+        close(fd);
         return 1;
     }
-    
-    // Read flash data
-    return read_flash_data(address, length);
+
+    ret = read_flash_data(fd, out, address, length);
+
+    if (out != STDOUT_FILENO)
+        close(out);
+    close(fd);
+    return ret == 0 ? 0 : 1;
 }
@@ -0,0 +1,291 @@
+/*
+ * NBD Write Test
+ *
+ * Talks the standard NBD protocol to the NBD port of netblk_server, the
+ * way nbd.ko does, and checks that writes of various lengths are stored
+ * and read back intact. The lengths straddle the server's 64KB receive
+ * ring: a payload that the ring cannot hold in one piece while part of
+ * it is already buffered must not reset the connection.
+ * A second pass pipelines each write behind a small one so the payload
+ * arrives together with another request.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define NBD_MAGIC               0x4e42444d41474943ULL  /* "NBDMAGIC" */
+#define NBD_IHAVEOPT            0x49484156454f5054ULL  /* "IHAVEOPT" */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES    (1 << 1)
+#define NBD_OPT_EXPORT_NAME     1
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_REPLY_MAGIC         0x67446698
+#define NBD_CMD_READ            0
+#define NBD_CMD_WRITE           1
+#define NBD_CMD_DISC            2
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t handle;
+} __attribute__((packed));
+
+/* Lengths around the 64KB receive ring of the server */
+static const uint32_t test_lengths[] = {
+    4 * 1024, 40 * 1024, 64 * 1024 - 512, 64 * 1024, 64 * 1024 + 512,
+    72 * 1024, 80 * 1024, 88 * 1024, 96 * 1024, 120 * 1024, 1024 * 1024,
+};
+
+#define NR_TESTS (sizeof(test_lengths) / sizeof(test_lengths[0]))
+#define MAX_LEN (1024 * 1024)
+#define SMALL_LEN 512
+
+static int send_all(int sock, const void *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, (const uint8_t *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            perror("send");
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(sock, (uint8_t *)buf + received, len - received, 0);
+        if (n < 0) {
+            perror("recv");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Connection closed by server\n");
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+/* Fixed newstyle handshake with NBD_OPT_EXPORT_NAME, returns the export size */
+static int nbd_handshake(int sock, uint64_t *size) {
+    struct {
+        uint64_t magic;
+        uint64_t opt_magic;
+        uint16_t flags;
+    } __attribute__((packed)) greeting;
+    struct {
+        uint64_t magic;
+        uint32_t opt;
+        uint32_t len;
+    } __attribute__((packed)) opt_hdr;
+    struct {
+        uint64_t size;
+        uint16_t flags;
+    } __attribute__((packed)) export_info;
+    uint32_t client_flags = htobe32(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+
+    if (recv_all(sock, &greeting, sizeof(greeting)) < 0) {
+        return -1;
+    }
+    if (be64toh(greeting.magic) != NBD_MAGIC || be64toh(greeting.opt_magic) != NBD_IHAVEOPT ||
+        !(be16toh(greeting.flags) & NBD_FLAG_FIXED_NEWSTYLE)) {
+        fprintf(stderr, "Not a fixed newstyle NBD server\n");
+        return -1;
+    }
+
+    opt_hdr.magic = htobe64(NBD_IHAVEOPT);
+    opt_hdr.opt = htobe32(NBD_OPT_EXPORT_NAME);
+    opt_hdr.len = 0;
+    if (send_all(sock, &client_flags, sizeof(client_flags)) < 0 ||
+        send_all(sock, &opt_hdr, sizeof(opt_hdr)) < 0 ||
+        recv_all(sock, &export_info, sizeof(export_info)) < 0) {
+        return -1;
+    }
+    *size = be64toh(export_info.size);
+    return 0;
+}
+
+static int nbd_send_request(int sock, uint16_t type, uint64_t handle,
+                            uint64_t offset, uint32_t length, const void *data) {
+    struct nbd_request req;
+
+    req.magic = htobe32(NBD_REQUEST_MAGIC);
+    req.flags = 0;
+    req.type = htobe16(type);
+    req.handle = handle;
+    req.offset = htobe64(offset);
+    req.length = htobe32(length);
+    if (send_all(sock, &req, sizeof(req)) < 0) {
+        return -1;
+    }
+    return data ? send_all(sock, data, length) : 0;
+}
+
+/* Simple reply, followed by length bytes of data for reads */
+static int nbd_recv_reply(int sock, uint64_t handle, void *data, uint32_t length) {
+    struct nbd_reply reply;
+
+    if (recv_all(sock, &reply, sizeof(reply)) < 0) {
+        return -1;
+    }
+    if (be32toh(reply.magic) != NBD_REPLY_MAGIC || reply.handle != handle) {
+        fprintf(stderr, "Bad reply\n");
+        return -1;
+    }
+    if (reply.error) {
+        fprintf(stderr, "Server error %u\n", be32toh(reply.error));
+        return -1;
+    }
+    return data ? recv_all(sock, data, length) : 0;
+}
+
+static void fill_pattern(uint8_t *buf, uint32_t len, uint32_t seed) {
+    uint32_t i, x = seed * 2654435761u + 1;
+
+    for (i = 0; i < len; i++) {
+        x = x * 1103515245u + 12345u;
+        buf[i] = x >> 16;
+    }
+}
+
+/* Write len bytes at offset, optionally behind a pipelined small write, and read back */
+static int test_write(int sock, uint64_t offset, uint32_t len, int pipelined,
+                      uint8_t *wbuf, uint8_t *rbuf) {
+    static uint64_t handle;
+    static uint8_t small[SMALL_LEN];
+    uint64_t h_small = 0, h_write, h_read;
+
+    fill_pattern(wbuf, len, len + pipelined);
+    if (pipelined) {
+        fill_pattern(small, SMALL_LEN, ~len);
+        h_small = ++handle;
+        if (nbd_send_request(sock, NBD_CMD_WRITE, h_small, offset + MAX_LEN,
+                             SMALL_LEN, small) < 0) {
+            return -1;
+        }
+    }
+    h_write = ++handle;
+    if (nbd_send_request(sock, NBD_CMD_WRITE, h_write, offset, len, wbuf) < 0) {
+        return -1;
+    }
+    if (pipelined && nbd_recv_reply(sock, h_small, NULL, 0) < 0) {
+        return -1;
+    }
+    if (nbd_recv_reply(sock, h_write, NULL, 0) < 0) {
+        return -1;
+    }
+
+    h_read = ++handle;
+    memset(rbuf, 0, len);
+    if (nbd_send_request(sock, NBD_CMD_READ, h_read, offset, len, NULL) < 0 ||
+        nbd_recv_reply(sock, h_read, rbuf, len) < 0) {
+        return -1;
+    }
+    if (memcmp(wbuf, rbuf, len) != 0) {
+        fprintf(stderr, "Data mismatch\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    uint8_t *wbuf, *rbuf;
+    uint64_t size, offset = 0;
+    size_t i;
+    int sock, pass, failed = 0, one = 1;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <host> <nbd_port>\n", argv[0]);
+        fprintf(stderr, "Example: %s 127.0.0.1 10810\n", argv[0]);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", argv[1]);
+        return 1;
+    }
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sock);
+        return 1;
+    }
+    if (nbd_handshake(sock, &size) < 0) {
+        close(sock);
+        return 1;
+    }
+    if (size < 2 * MAX_LEN + SMALL_LEN) {
+        fprintf(stderr, "Export too small: %llu bytes\n", (unsigned long long)size);
+        close(sock);
+        return 1;
+    }
+
+    wbuf = malloc(MAX_LEN);
+    rbuf = malloc(MAX_LEN);
+    if (!wbuf || !rbuf) {
+        fprintf(stderr, "Out of memory\n");
+        close(sock);
+        return 1;
+    }
+
+    for (pass = 0; pass < 2 && !failed; pass++) {
+        for (i = 0; i < NR_TESTS; i++) {
+            uint32_t len = test_lengths[i];
+            int ret = test_write(sock, offset, len, pass, wbuf, rbuf);
+
+            printf("%-10s write %7u bytes at %8llu: %s\n", pass ? "pipelined" : "single",
+                   len, (unsigned long long)offset, ret == 0 ? "OK" : "FAILED");
+            if (ret < 0) {
+                /* The connection state is unknown after a failure */
+                failed = 1;
+                break;
+            }
+            offset = (offset + len + 4096) % (size - 2 * MAX_LEN - SMALL_LEN);
+            offset &= ~511ULL;
+        }
+    }
+
+    if (!failed) {
+        nbd_send_request(sock, NBD_CMD_DISC, 0, 0, 0, NULL);
+    }
+    free(wbuf);
+    free(rbuf);
+    close(sock);
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed;
+}
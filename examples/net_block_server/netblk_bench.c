@@ -0,0 +1,491 @@
+/*
+ * Network Block Device Benchmark
+ *
+ * Load generator that speaks the netblk protocol directly to netblk_server,
+ * without the kernel driver or the page cache in the path. Each connection
+ * keeps up to <queue depth> requests in flight: a sender thread issues
+ * requests while a receiver thread collects the in-order responses and
+ * records per-request latency. Results are printed as JSON.
+ * Requests go through the netblk client library, either over TCP or, with
+ * -U, over the shared-memory rings of a server on the same host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "netblk_client.h"
+
+/* Benchmark configuration */
+struct bench_config {
+    const char *host;
+    int port;
+    const char *shm_path;          /* Shared-memory transport when set */
+    int queue_depth;
+    uint32_t block_size;
+    int read_pct;
+    int sequential;
+    int connections;
+    int duration;
+    uint64_t span;
+    volatile int running;
+};
+
+/* Request in flight, indexed by client slot */
+struct inflight {
+    uint64_t start_ns;
+    uint8_t cmd;
+};
+
+/* Per-connection state */
+struct bench_conn {
+    int id;
+    struct netblk_client *client;
+    pthread_t sender;
+    pthread_t receiver;
+    sem_t credits;                 /* Free queue slots */
+    sem_t pending;                 /* Requests sent, not yet answered */
+    struct inflight *ring;         /* queue_depth entries */
+    unsigned int *free_slots;      /* Slots returned by the receiver */
+    uint64_t free_head;            /* Sender only */
+    uint64_t free_tail;            /* Receiver only, ordered by credits */
+    uint64_t sent;                 /* Written by sender only */
+    uint64_t received;             /* Written by receiver only */
+    volatile int sender_done;
+    uint64_t cursor;               /* Next offset for sequential pattern */
+    unsigned int seed;
+    /* Results */
+    uint64_t *lat;                 /* Latency samples in ns */
+    size_t nr_lat;
+    size_t cap_lat;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t errors;
+};
+
+static struct bench_config config;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Pick the next request offset in bytes */
+static uint64_t next_offset(struct bench_conn *conn) {
+    uint64_t blocks = config.span / config.block_size;
+    uint64_t off;
+
+    if (config.sequential) {
+        off = conn->cursor;
+        conn->cursor += config.block_size;
+        if (conn->cursor + config.block_size > config.span) {
+            conn->cursor = 0;
+        }
+        return off;
+    }
+
+    off = ((uint64_t)rand_r(&conn->seed) << 31) ^ (uint64_t)rand_r(&conn->seed);
+    return (off % blocks) * config.block_size;
+}
+
+/* Issue requests while queue slots are free */
+static void *sender_thread(void *arg) {
+    struct bench_conn *conn = arg;
+    struct timespec ts;
+
+    while (config.running) {
+        struct inflight *slot;
+        unsigned int idx;
+        uint64_t off;
+        int is_read;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 100 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (sem_timedwait(&conn->credits, &ts) < 0) {
+            continue;
+        }
+        if (!config.running) {
+            break;
+        }
+
+        is_read = (int)(rand_r(&conn->seed) % 100) < config.read_pct;
+        off = next_offset(conn);
+
+        idx = conn->free_slots[conn->free_head++ % config.queue_depth];
+        slot = &conn->ring[idx];
+        slot->cmd = is_read ? NET_CMD_READ : NET_CMD_WRITE;
+        slot->start_ns = now_ns();
+
+        if (netblk_client_submit(conn->client, idx, slot->cmd, off / SECTOR_SIZE,
+                                 config.block_size) < 0 ||
+            netblk_client_flush(conn->client) < 0) {
+            conn->errors++;
+            break;
+        }
+
+        __atomic_store_n(&conn->sent, conn->sent + 1, __ATOMIC_RELEASE);
+        sem_post(&conn->pending);
+    }
+
+    conn->sender_done = 1;
+    sem_post(&conn->pending);
+    return NULL;
+}
+
+/* Collect in-order responses and record latency */
+static void *receiver_thread(void *arg) {
+    struct bench_conn *conn = arg;
+
+    for (;;) {
+        struct inflight *slot;
+        unsigned int idx;
+        uint8_t status;
+        uint64_t lat;
+
+        sem_wait(&conn->pending);
+        if (conn->received == __atomic_load_n(&conn->sent, __ATOMIC_ACQUIRE)) {
+            if (conn->sender_done) {
+                break;
+            }
+            continue;
+        }
+
+        if (netblk_client_reap(conn->client, &idx, &status) < 0) {
+            conn->errors++;
+            break;
+        }
+        if (status != NET_STATUS_OK) {
+            fprintf(stderr, "Server returned error status\n");
+            conn->errors++;
+            break;
+        }
+        slot = &conn->ring[idx];
+        if (slot->cmd == NET_CMD_READ) {
+            conn->read_bytes += config.block_size;
+        } else {
+            conn->write_bytes += config.block_size;
+        }
+
+        lat = now_ns() - slot->start_ns;
+        if (conn->nr_lat == conn->cap_lat) {
+            size_t cap = conn->cap_lat ? conn->cap_lat * 2 : 65536;
+            uint64_t *p = realloc(conn->lat, cap * sizeof(*p));
+            if (!p) {
+                perror("realloc");
+                conn->errors++;
+                break;
+            }
+            conn->lat = p;
+            conn->cap_lat = cap;
+        }
+        conn->lat[conn->nr_lat++] = lat;
+        conn->received++;
+        conn->free_slots[conn->free_tail++ % config.queue_depth] = idx;
+
+        sem_post(&conn->credits);
+    }
+
+    /* Unblock a sender waiting for credits after a failure */
+    config.running = 0;
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double pct) {
+    size_t idx;
+    if (n == 0) {
+        return 0.0;
+    }
+    idx = (size_t)(pct / 100.0 * (double)(n - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+/* Parse a size with optional k/m/g suffix */
+static int parse_size(const char *s, uint64_t *out) {
+    char *end;
+    uint64_t v;
+
+    errno = 0;
+    v = strtoull(s, &end, 0);
+    if (errno != 0 || end == s) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <host> <port>\n", prog);
+    fprintf(stderr, "       %s [options] -U <socket_path>\n", prog);
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -q <depth>    Requests in flight per connection (default 1)\n");
+    fprintf(stderr, "  -b <size>     Block size, multiple of 512 (default 4k)\n");
+    fprintf(stderr, "  -r <pct>      Read percentage 0-100 (default 100)\n");
+    fprintf(stderr, "  -P <pattern>  rand or seq (default rand)\n");
+    fprintf(stderr, "  -c <conns>    Number of connections (default 1)\n");
+    fprintf(stderr, "  -t <seconds>  Duration (default 10)\n");
+    fprintf(stderr, "  -s <size>     Span of the device to touch (default 64m)\n");
+    fprintf(stderr, "  -U <path>     Use the shared-memory transport of a local server\n");
+    fprintf(stderr, "\nExample: %s -q 32 -b 4k -r 70 -P rand -c 4 -t 30 127.0.0.1 10809\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_conn *conns;
+    uint64_t start, elapsed_ns;
+    uint64_t total_ops = 0, read_bytes = 0, write_bytes = 0, errors = 0;
+    uint64_t *all_lat;
+    size_t nr_lat = 0;
+    double secs, lat_sum = 0.0;
+    uint64_t v;
+    int opt, i;
+
+    config.queue_depth = 1;
+    config.block_size = 4096;
+    config.read_pct = 100;
+    config.sequential = 0;
+    config.connections = 1;
+    config.duration = 10;
+    config.span = 64ULL * 1024 * 1024;
+
+    while ((opt = getopt(argc, argv, "q:b:r:P:c:t:s:U:h")) != -1) {
+        switch (opt) {
+        case 'q':
+            config.queue_depth = atoi(optarg);
+            break;
+        case 'b':
+            if (parse_size(optarg, &v) < 0 || v == 0 || v % SECTOR_SIZE || v > UINT32_MAX) {
+                fprintf(stderr, "Invalid block size '%s'\n", optarg);
+                return 1;
+            }
+            config.block_size = (uint32_t)v;
+            break;
+        case 'r':
+            config.read_pct = atoi(optarg);
+            break;
+        case 'P':
+            if (strcmp(optarg, "seq") == 0) {
+                config.sequential = 1;
+            } else if (strcmp(optarg, "rand") == 0) {
+                config.sequential = 0;
+            } else {
+                fprintf(stderr, "Invalid pattern '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 't':
+            config.duration = atoi(optarg);
+            break;
+        case 's':
+            if (parse_size(optarg, &config.span) < 0) {
+                fprintf(stderr, "Invalid span '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            config.shm_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.shm_path) {
+        if (argc - optind != 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    } else {
+        if (argc - optind != 2) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        config.host = argv[optind];
+        config.port = atoi(argv[optind + 1]);
+    }
+
+    if (config.queue_depth < 1 || config.connections < 1 || config.duration < 1 ||
+        config.read_pct < 0 || config.read_pct > 100 ||
+        config.queue_depth > NETBLK_SHM_MAX_ENTRIES ||
+        config.block_size > NETBLK_SHM_MAX_SLOT ||
+        config.span < config.block_size) {
+        fprintf(stderr, "Invalid parameters\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* A server disconnect fails the connection, the summary is still printed */
+    signal(SIGPIPE, SIG_IGN);
+
+    conns = calloc(config.connections, sizeof(*conns));
+    if (!conns) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* Connect and prepare buffers */
+    for (i = 0; i < config.connections; i++) {
+        struct bench_conn *conn = &conns[i];
+        uint32_t j;
+
+        conn->id = i;
+        conn->seed = (unsigned int)(now_ns() ^ (i * 2654435761u));
+        conn->cursor = (config.span / config.connections / config.block_size) *
+                       config.block_size * i;
+        conn->ring = calloc(config.queue_depth, sizeof(*conn->ring));
+        conn->free_slots = calloc(config.queue_depth, sizeof(*conn->free_slots));
+        if (!conn->ring || !conn->free_slots) {
+            perror("malloc");
+            return 1;
+        }
+        sem_init(&conn->credits, 0, config.queue_depth);
+        sem_init(&conn->pending, 0, 0);
+
+        if (config.shm_path) {
+            conn->client = netblk_client_open_shm(config.shm_path, config.queue_depth,
+                                                  config.block_size);
+        } else {
+            conn->client = netblk_client_open_tcp(config.host, config.port,
+                                                  config.queue_depth, config.block_size);
+        }
+        if (!conn->client) {
+            return 1;
+        }
+
+        /* Every slot starts free and carries random write data */
+        for (j = 0; j < (uint32_t)config.queue_depth; j++) {
+            uint8_t *buf = netblk_client_buf(conn->client, j);
+            uint32_t k;
+
+            conn->free_slots[j] = j;
+            for (k = 0; k < config.block_size; k++) {
+                buf[k] = (uint8_t)rand_r(&conn->seed);
+            }
+        }
+        conn->free_tail = config.queue_depth;
+    }
+
+    /* Run */
+    config.running = 1;
+    start = now_ns();
+    for (i = 0; i < config.connections; i++) {
+        if (pthread_create(&conns[i].receiver, NULL, receiver_thread, &conns[i]) != 0 ||
+            pthread_create(&conns[i].sender, NULL, sender_thread, &conns[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < config.duration * 10 && config.running; i++) {
+        usleep(100000);
+    }
+    config.running = 0;
+
+    for (i = 0; i < config.connections; i++) {
+        pthread_join(conns[i].sender, NULL);
+        pthread_join(conns[i].receiver, NULL);
+    }
+    elapsed_ns = now_ns() - start;
+
+    /* Aggregate */
+    for (i = 0; i < config.connections; i++) {
+        nr_lat += conns[i].nr_lat;
+        read_bytes += conns[i].read_bytes;
+        write_bytes += conns[i].write_bytes;
+        errors += conns[i].errors;
+
+        netblk_client_close(conns[i].client);
+    }
+    total_ops = nr_lat;
+
+    all_lat = malloc((nr_lat ? nr_lat : 1) * sizeof(*all_lat));
+    if (!all_lat) {
+        perror("malloc");
+        return 1;
+    }
+    nr_lat = 0;
+    for (i = 0; i < config.connections; i++) {
+        memcpy(all_lat + nr_lat, conns[i].lat, conns[i].nr_lat * sizeof(*all_lat));
+        nr_lat += conns[i].nr_lat;
+    }
+    qsort(all_lat, nr_lat, sizeof(*all_lat), cmp_u64);
+    for (size_t k = 0; k < nr_lat; k++) {
+        lat_sum += all_lat[k];
+    }
+
+    secs = elapsed_ns / 1e9;
+
+    /* Report */
+    printf("{\n");
+    if (config.shm_path) {
+        printf("  \"transport\": \"shm\",\n");
+        printf("  \"socket\": \"%s\",\n", config.shm_path);
+    } else {
+        printf("  \"transport\": \"tcp\",\n");
+        printf("  \"host\": \"%s\",\n", config.host);
+        printf("  \"port\": %d,\n", config.port);
+    }
+    printf("  \"connections\": %d,\n", config.connections);
+    printf("  \"queue_depth\": %d,\n", config.queue_depth);
+    printf("  \"block_size\": %u,\n", config.block_size);
+    printf("  \"read_pct\": %d,\n", config.read_pct);
+    printf("  \"pattern\": \"%s\",\n", config.sequential ? "seq" : "rand");
+    printf("  \"span\": %llu,\n", (unsigned long long)config.span);
+    printf("  \"elapsed_s\": %.3f,\n", secs);
+    printf("  \"ops\": %llu,\n", (unsigned long long)total_ops);
+    printf("  \"errors\": %llu,\n", (unsigned long long)errors);
+    printf("  \"iops\": %.1f,\n", total_ops / secs);
+    printf("  \"mb_per_s\": %.2f,\n", (read_bytes + write_bytes) / secs / 1e6);
+    printf("  \"read_mb_per_s\": %.2f,\n", read_bytes / secs / 1e6);
+    printf("  \"write_mb_per_s\": %.2f,\n", write_bytes / secs / 1e6);
+    printf("  \"latency_us\": {\n");
+    printf("    \"avg\": %.1f,\n", nr_lat ? lat_sum / nr_lat / 1000.0 : 0.0);
+    printf("    \"min\": %.1f,\n", nr_lat ? all_lat[0] / 1000.0 : 0.0);
+    printf("    \"p50\": %.1f,\n", percentile_us(all_lat, nr_lat, 50.0));
+    printf("    \"p99\": %.1f,\n", percentile_us(all_lat, nr_lat, 99.0));
+    printf("    \"p99.9\": %.1f,\n", percentile_us(all_lat, nr_lat, 99.9));
+    printf("    \"max\": %.1f\n", nr_lat ? all_lat[nr_lat - 1] / 1000.0 : 0.0);
+    printf("  }\n");
+    printf("}\n");
+
+    for (i = 0; i < config.connections; i++) {
+        sem_destroy(&conns[i].credits);
+        sem_destroy(&conns[i].pending);
+        free(conns[i].ring);
+        free(conns[i].free_slots);
+        free(conns[i].lat);
+    }
+    free(conns);
+    free(all_lat);
+
+    return errors ? 1 : 0;
+}
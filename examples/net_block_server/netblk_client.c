@@ -0,0 +1,535 @@
+/*
+ * Network Block Device Client Library
+ *
+ * TCP transport: submissions are collected into an iovec list and written
+ * with sendmsg on flush; responses arrive in submission order, so a FIFO of
+ * slots tells the reaper how much data follows each status byte.
+ *
+ * Shared-memory transport: submissions are written straight into the SQ,
+ * flush publishes the tail and rings the SQ eventfd once. The reaper
+ * drains the CQ and sleeps on the CQ eventfd when it is empty. Data never
+ * leaves the shared slots, so no socket or copy is involved per request.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "netblk_client.h"
+
+struct netblk_client {
+    int shm;                       /* Shared-memory transport */
+    unsigned int depth;
+    uint32_t max_io;
+
+    /* TCP transport */
+    int sock;
+    uint8_t *bufs;                 /* depth * max_io */
+    struct net_request_packet *hdrs;  /* Encoded header per slot */
+    uint8_t *slot_cmd;
+    uint32_t *slot_len;
+    struct iovec *iov;             /* Queued, not yet written */
+    unsigned int nr_iov;
+    unsigned int *fifo;            /* Slots in submission order */
+    uint32_t fifo_head;            /* Reaper only */
+    uint32_t fifo_tail;            /* Submitter only, read by reaper */
+
+    /* Shared-memory transport */
+    int unix_sock;
+    int sq_efd;
+    int cq_efd;
+    void *map;
+    size_t map_size;
+    struct netblk_shm_hdr *hdr;
+    struct netblk_sqe *sqes;
+    struct netblk_cqe *cqes;
+    uint32_t entries;
+    uint32_t slot_size;
+    uint32_t sq_tail;              /* Next SQE, published on flush */
+    uint32_t sq_published;
+};
+
+/*
+ * Write a whole iovec array, at most IOV_MAX entries per call.
+ * sendmsg with MSG_NOSIGNAL, so a closed connection fails the call
+ * instead of raising SIGPIPE in the embedding process.
+ */
+static int writev_all(int sock, struct iovec *iov, unsigned int nr) {
+    while (nr > 0) {
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = nr < IOV_MAX ? nr : IOV_MAX,
+        };
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        /* Advance the iovec past what was sent */
+        while (n > 0) {
+            if ((size_t)n >= iov->iov_len) {
+                n -= iov->iov_len;
+                iov++;
+                nr--;
+            } else {
+                iov->iov_base = (uint8_t *)iov->iov_base + n;
+                iov->iov_len -= n;
+                n = 0;
+            }
+        }
+        /* Skip entries that were completed exactly */
+        while (nr > 0 && iov->iov_len == 0) {
+            iov++;
+            nr--;
+        }
+    }
+    return 0;
+}
+
+/* Receive data */
+static int recv_all(int sock, void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(sock, (uint8_t *)buf + received, len - received, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Connection closed by server\n");
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+/* Connect to server */
+static int tcp_connect(const char *host, int port) {
+    struct addrinfo hints, *res, *ai;
+    char port_str[16];
+    int sock = -1;
+    int flag = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    if (getaddrinfo(host, port_str, &hints, &res) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", host);
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+
+    if (sock < 0) {
+        perror("connect");
+        return -1;
+    }
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return sock;
+}
+
+static struct netblk_client *client_alloc(unsigned int depth, uint32_t max_io) {
+    struct netblk_client *client;
+
+    if (depth == 0 || depth > NETBLK_SHM_MAX_ENTRIES ||
+        max_io == 0 || max_io > NETBLK_SHM_MAX_SLOT) {
+        fprintf(stderr, "Invalid client depth or I/O size\n");
+        return NULL;
+    }
+
+    client = calloc(1, sizeof(*client));
+    if (!client) {
+        perror("calloc");
+        return NULL;
+    }
+    client->depth = depth;
+    client->max_io = max_io;
+    client->sock = -1;
+    client->unix_sock = -1;
+    client->sq_efd = -1;
+    client->cq_efd = -1;
+    return client;
+}
+
+struct netblk_client *netblk_client_open_tcp(const char *host, int port,
+                                             unsigned int depth, uint32_t max_io) {
+    struct netblk_client *client = client_alloc(depth, max_io);
+
+    if (!client) {
+        return NULL;
+    }
+
+    client->bufs = malloc((size_t)depth * max_io);
+    client->hdrs = calloc(depth, sizeof(*client->hdrs));
+    client->slot_cmd = calloc(depth, sizeof(*client->slot_cmd));
+    client->slot_len = calloc(depth, sizeof(*client->slot_len));
+    client->iov = calloc(2 * depth, sizeof(*client->iov));
+    client->fifo = calloc(depth, sizeof(*client->fifo));
+    if (!client->bufs || !client->hdrs || !client->slot_cmd ||
+        !client->slot_len || !client->iov || !client->fifo) {
+        perror("malloc");
+        netblk_client_close(client);
+        return NULL;
+    }
+
+    client->sock = tcp_connect(host, port);
+    if (client->sock < 0) {
+        netblk_client_close(client);
+        return NULL;
+    }
+    return client;
+}
+
+/* Pass the memfd and both doorbells to the server */
+static int shm_send_setup(struct netblk_client *client, int memfd) {
+    struct netblk_shm_setup setup;
+    struct net_response_packet resp;
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[3] = { memfd, client->sq_efd, client->cq_efd };
+
+    setup.magic = NETBLK_SHM_MAGIC;
+    setup.version = NETBLK_SHM_VERSION;
+    setup.entries = client->entries;
+    setup.slot_size = client->slot_size;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &setup;
+    iov.iov_len = sizeof(setup);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(client->unix_sock, &msg, MSG_NOSIGNAL) != sizeof(setup)) {
+        perror("sendmsg");
+        return -1;
+    }
+    if (recv_all(client->unix_sock, &resp, sizeof(resp)) < 0) {
+        return -1;
+    }
+    if (resp.status != NET_STATUS_OK) {
+        fprintf(stderr, "Server rejected shared-memory setup\n");
+        return -1;
+    }
+    return 0;
+}
+
+struct netblk_client *netblk_client_open_shm(const char *path,
+                                             unsigned int depth, uint32_t max_io) {
+    struct netblk_client *client = client_alloc(depth, max_io);
+    struct sockaddr_un addr;
+    int memfd = -1;
+
+    if (!client) {
+        return NULL;
+    }
+    client->shm = 1;
+
+    /* SPSC ring indices are masked, so entries must be a power of two */
+    client->entries = 1;
+    while (client->entries < depth) {
+        client->entries <<= 1;
+    }
+    client->slot_size = (uint32_t)netblk_shm_align(max_io);
+    client->map_size = netblk_shm_size(client->entries, client->slot_size);
+
+    memfd = memfd_create("netblk", MFD_CLOEXEC);
+    if (memfd < 0) {
+        perror("memfd_create");
+        goto fail;
+    }
+    if (ftruncate(memfd, client->map_size) < 0) {
+        perror("ftruncate");
+        goto fail;
+    }
+    client->map = mmap(NULL, client->map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, memfd, 0);
+    if (client->map == MAP_FAILED) {
+        client->map = NULL;
+        perror("mmap");
+        goto fail;
+    }
+    client->hdr = client->map;
+    client->sqes = (struct netblk_sqe *)((uint8_t *)client->map + netblk_shm_sqes_offset());
+    client->cqes = (struct netblk_cqe *)((uint8_t *)client->map +
+                                         netblk_shm_cqes_offset(client->entries));
+
+    client->sq_efd = eventfd(0, EFD_CLOEXEC);
+    client->cq_efd = eventfd(0, EFD_CLOEXEC);
+    if (client->sq_efd < 0 || client->cq_efd < 0) {
+        perror("eventfd");
+        goto fail;
+    }
+
+    client->unix_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (client->unix_sock < 0) {
+        perror("socket");
+        goto fail;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        goto fail;
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(client->unix_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        goto fail;
+    }
+
+    if (shm_send_setup(client, memfd) < 0) {
+        goto fail;
+    }
+
+    /* The mapping keeps the memory alive */
+    close(memfd);
+    return client;
+
+fail:
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    netblk_client_close(client);
+    return NULL;
+}
+
+void *netblk_client_buf(struct netblk_client *client, unsigned int slot) {
+    if (client->shm) {
+        return (uint8_t *)client->map +
+               netblk_shm_slot_offset(client->entries, client->slot_size, slot);
+    }
+    return client->bufs + (size_t)slot * client->max_io;
+}
+
+int netblk_client_submit(struct netblk_client *client, unsigned int slot,
+                         uint8_t cmd, uint64_t sector, uint32_t length) {
+    struct net_request_packet *req;
+
+    if (slot >= client->depth || length > client->max_io ||
+        (cmd != NET_CMD_READ && cmd != NET_CMD_WRITE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (client->shm) {
+        struct netblk_sqe *sqe;
+
+        if (client->sq_tail - __atomic_load_n(&client->hdr->sq.head, __ATOMIC_ACQUIRE) >=
+            client->entries) {
+            errno = EBUSY;
+            return -1;
+        }
+        sqe = &client->sqes[client->sq_tail & (client->entries - 1)];
+        sqe->req.cmd = cmd;
+        sqe->req.sector = htobe64(sector);
+        sqe->req.length = htobe32(length);
+        sqe->slot = slot;
+        client->sq_tail++;
+        return 0;
+    }
+
+    req = &client->hdrs[slot];
+    req->cmd = cmd;
+    req->sector = htobe64(sector);
+    req->length = htobe32(length);
+    client->slot_cmd[slot] = cmd;
+    client->slot_len[slot] = length;
+
+    client->iov[client->nr_iov].iov_base = req;
+    client->iov[client->nr_iov].iov_len = sizeof(*req);
+    client->nr_iov++;
+    if (cmd == NET_CMD_WRITE && length) {
+        client->iov[client->nr_iov].iov_base = netblk_client_buf(client, slot);
+        client->iov[client->nr_iov].iov_len = length;
+        client->nr_iov++;
+    }
+
+    client->fifo[client->fifo_tail % client->depth] = slot;
+    __atomic_store_n(&client->fifo_tail, client->fifo_tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int netblk_client_flush(struct netblk_client *client) {
+    if (client->shm) {
+        uint64_t one = 1;
+
+        if (client->sq_tail == client->sq_published) {
+            return 0;
+        }
+        __atomic_store_n(&client->hdr->sq.tail, client->sq_tail, __ATOMIC_RELEASE);
+        client->sq_published = client->sq_tail;
+        if (write(client->sq_efd, &one, sizeof(one)) != sizeof(one)) {
+            perror("eventfd write");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (client->nr_iov == 0) {
+        return 0;
+    }
+    if (writev_all(client->sock, client->iov, client->nr_iov) < 0) {
+        return -1;
+    }
+    client->nr_iov = 0;
+    return 0;
+}
+
+/* Sleep until the CQ doorbell rings or the server goes away */
+static int shm_wait_cq(struct netblk_client *client) {
+    struct pollfd pfd[2];
+    uint64_t count;
+
+    pfd[0].fd = client->cq_efd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = client->unix_sock;
+    pfd[1].events = POLLIN;
+
+    if (poll(pfd, 2, -1) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("poll");
+        return -1;
+    }
+    if (pfd[0].revents & POLLIN) {
+        if (read(client->cq_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("eventfd read");
+            return -1;
+        }
+        return 0;
+    }
+    if (pfd[1].revents) {
+        fprintf(stderr, "Connection closed by server\n");
+        return -1;
+    }
+    return 0;
+}
+
+int netblk_client_reap(struct netblk_client *client, unsigned int *slot,
+                       uint8_t *status) {
+    struct net_response_packet resp;
+    unsigned int s;
+
+    if (client->shm) {
+        for (;;) {
+            uint32_t head = client->hdr->cq.head;
+
+            if (head != __atomic_load_n(&client->hdr->cq.tail, __ATOMIC_ACQUIRE)) {
+                struct netblk_cqe *cqe = &client->cqes[head & (client->entries - 1)];
+
+                *slot = cqe->slot;
+                *status = cqe->resp.status;
+                __atomic_store_n(&client->hdr->cq.head, head + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+            if (shm_wait_cq(client) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    if (client->fifo_head == __atomic_load_n(&client->fifo_tail, __ATOMIC_ACQUIRE)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    s = client->fifo[client->fifo_head % client->depth];
+
+    if (recv_all(client->sock, &resp, sizeof(resp)) < 0) {
+        return -1;
+    }
+    /* Read data only follows a successful response */
+    if (resp.status == NET_STATUS_OK && client->slot_cmd[s] == NET_CMD_READ &&
+        recv_all(client->sock, netblk_client_buf(client, s), client->slot_len[s]) < 0) {
+        return -1;
+    }
+
+    client->fifo_head++;
+    *slot = s;
+    *status = resp.status;
+    return 0;
+}
+
+void netblk_client_close(struct netblk_client *client) {
+    struct net_request_packet req;
+    int sock;
+
+    if (!client) {
+        return;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.cmd = NET_CMD_DISCONNECT;
+    sock = client->shm ? client->unix_sock : client->sock;
+    if (sock >= 0) {
+        send(sock, &req, sizeof(req), MSG_NOSIGNAL);
+        close(sock);
+    }
+
+    if (client->map) {
+        munmap(client->map, client->map_size);
+    }
+    if (client->sq_efd >= 0) {
+        close(client->sq_efd);
+    }
+    if (client->cq_efd >= 0) {
+        close(client->cq_efd);
+    }
+
+    free(client->bufs);
+    free(client->hdrs);
+    free(client->slot_cmd);
+    free(client->slot_len);
+    free(client->iov);
+    free(client->fifo);
+    free(client);
+}
@@ -0,0 +1,49 @@
+/*
+ * Network Block Device Client Library
+ *
+ * Userspace client for netblk_server with two interchangeable transports:
+ * TCP (the same stream the kernel driver uses) and, for clients on the
+ * server host, shared-memory submission/completion rings with eventfd
+ * doorbells set up over a Unix socket.
+ *
+ * A client owns <depth> data slots. The caller picks a free slot, fills
+ * netblk_client_buf() for writes, submits, and gets the slot back from
+ * netblk_client_reap() once the server answered; read data is then in the
+ * slot buffer. Submissions are only guaranteed to reach the server after
+ * netblk_client_flush(), so several requests can share one doorbell or
+ * one writev. One thread may submit/flush while another reaps.
+ */
+
+#ifndef NETBLK_CLIENT_H
+#define NETBLK_CLIENT_H
+
+#include "netblk_proto.h"
+
+struct netblk_client;
+
+/* Connect over TCP, host may be a name or an address */
+struct netblk_client *netblk_client_open_tcp(const char *host, int port,
+                                             unsigned int depth, uint32_t max_io);
+
+/* Connect to netblk_server -U <path> and set up the shared-memory rings */
+struct netblk_client *netblk_client_open_shm(const char *path,
+                                             unsigned int depth, uint32_t max_io);
+
+/* Data buffer of a slot, max_io bytes */
+void *netblk_client_buf(struct netblk_client *client, unsigned int slot);
+
+/* Queue a READ/WRITE of length bytes at sector using the slot's buffer */
+int netblk_client_submit(struct netblk_client *client, unsigned int slot,
+                         uint8_t cmd, uint64_t sector, uint32_t length);
+
+/* Hand all queued requests to the server */
+int netblk_client_flush(struct netblk_client *client);
+
+/* Wait for one completion, returns the slot and the response status */
+int netblk_client_reap(struct netblk_client *client, unsigned int *slot,
+                       uint8_t *status);
+
+/* Disconnect and free everything */
+void netblk_client_close(struct netblk_client *client);
+
+#endif /* NETBLK_CLIENT_H */
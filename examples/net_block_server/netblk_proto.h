@@ -0,0 +1,126 @@
+/*
+ * Network Block Device Protocol
+ *
+ * Wire format shared by netblk_server, the userspace client library and
+ * netblk_bench. The same request/response framing is used on TCP and,
+ * for co-located clients, inside the shared-memory rings: a TCP request
+ * is a net_request_packet followed by data, a ring request is the same
+ * packet inside a submission entry with the data in the entry's slot.
+ * Multi-byte fields are big-endian on both transports.
+ */
+
+#ifndef NETBLK_PROTO_H
+#define NETBLK_PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SECTOR_SIZE 512
+
+/* Protocol commands */
+#define NET_CMD_READ       0x01
+#define NET_CMD_WRITE      0x02
+#define NET_CMD_DISCONNECT 0x03
+#define NET_CMD_READV      0x04
+#define NET_CMD_WRITEV     0x05
+
+/* Protocol responses */
+#define NET_STATUS_OK      0x00
+#define NET_STATUS_ERROR   0x01
+
+/* Request packet structure */
+struct net_request_packet {
+    uint8_t cmd;
+    uint64_t sector;
+    uint32_t length;
+} __attribute__((packed));
+
+/* Extent descriptor of a vectored request */
+struct net_extent {
+    uint64_t sector;
+    uint32_t length;
+} __attribute__((packed));
+
+/* Response packet structure */
+struct net_response_packet {
+    uint8_t status;
+} __attribute__((packed));
+
+/*
+ * Shared-memory ring transport
+ *
+ * The client creates a memfd holding a submission ring (SQ), a completion
+ * ring (CQ) and one data slot per ring entry, plus two eventfd doorbells,
+ * and passes all three descriptors to the server over a Unix socket
+ * together with a netblk_shm_setup message. The server answers with a
+ * net_response_packet. Afterwards the Unix socket only signals hang-up.
+ *
+ * Both rings are single-producer/single-consumer: the producer fills
+ * entries and publishes them with a release store of tail, then writes
+ * the doorbell; the consumer loads tail with acquire and advances head.
+ * Data for entry slot N lives at netblk_shm_slot_offset(N).
+ */
+#define NETBLK_SHM_MAGIC        0x4e42534d  /* "NBSM" */
+#define NETBLK_SHM_VERSION      1
+#define NETBLK_SHM_MAX_ENTRIES  1024
+#define NETBLK_SHM_MAX_SLOT     (4 * 1024 * 1024)
+#define NETBLK_SHM_ALIGN        4096
+
+/* Setup message sent with the memfd, SQ doorbell and CQ doorbell */
+struct netblk_shm_setup {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entries;              /* Power of two */
+    uint32_t slot_size;            /* Multiple of NETBLK_SHM_ALIGN */
+};
+
+/* Ring indices, on separate cache lines to avoid false sharing */
+struct netblk_shm_ring {
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+/* Submission entry: a TCP request header plus the slot holding its data */
+struct netblk_sqe {
+    struct net_request_packet req;
+    uint8_t pad[3];
+    uint32_t slot;
+};
+
+/* Completion entry */
+struct netblk_cqe {
+    uint32_t slot;
+    struct net_response_packet resp;
+    uint8_t pad[3];
+};
+
+/* Layout of the shared region */
+struct netblk_shm_hdr {
+    struct netblk_shm_ring sq;
+    struct netblk_shm_ring cq;
+};
+
+static inline size_t netblk_shm_align(size_t len) {
+    return (len + NETBLK_SHM_ALIGN - 1) & ~(size_t)(NETBLK_SHM_ALIGN - 1);
+}
+
+static inline size_t netblk_shm_sqes_offset(void) {
+    return sizeof(struct netblk_shm_hdr);
+}
+
+static inline size_t netblk_shm_cqes_offset(uint32_t entries) {
+    return netblk_shm_sqes_offset() + entries * sizeof(struct netblk_sqe);
+}
+
+static inline size_t netblk_shm_slot_offset(uint32_t entries, uint32_t slot_size,
+                                            uint32_t slot) {
+    return netblk_shm_align(netblk_shm_cqes_offset(entries) +
+                            entries * sizeof(struct netblk_cqe)) +
+           (size_t)slot * slot_size;
+}
+
+static inline size_t netblk_shm_size(uint32_t entries, uint32_t slot_size) {
+    return netblk_shm_slot_offset(entries, slot_size, entries);
+}
+
+#endif /* NETBLK_PROTO_H */
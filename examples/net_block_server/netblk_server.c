@@ -3,8 +3,19 @@
  * 
  * This is a simple server implementation for the network block device driver.
  * It accepts TCP connections and handles READ/WRITE requests to a backing file.
+ * Each connection reads into a receive ring so that several pipelined
+ * request headers are parsed per recv(), and responses are corked with
+ * MSG_MORE while further requests are already buffered.
+ * READV/WRITEV carry a list of extents; file-contiguous extents are
+ * coalesced into a single positional read/write.
+ * 
+ * Optionally a second port speaks the standard NBD fixed-newstyle
+ * protocol (for the upstream nbd.ko client) on top of the same storage,
+ * and a Unix socket can accept co-located clients that exchange requests
+ * through shared-memory rings instead of TCP (see netblk_proto.h).
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,40 +29,106 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include <endian.h>
+#include <linux/falloc.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "netblk_proto.h"
 
-#define SECTOR_SIZE 512
 #define BUFFER_SIZE (1024 * 1024)  /* 1MB buffer */
+#define RX_RING_SIZE (64 * 1024)   /* Per-connection receive ring */
+#define NET_MAX_EXTENTS 64         /* Max extents per READV/WRITEV */
+#define NET_MAX_VEC_BYTES (64 * 1024 * 1024)  /* Max data per READV/WRITEV */
+
+/* NBD handshake (fixed newstyle) */
+#define NBD_MAGIC               0x4e42444d41474943ULL  /* "NBDMAGIC" */
+#define NBD_IHAVEOPT            0x49484156454f5054ULL  /* "IHAVEOPT" */
+#define NBD_REP_MAGIC           0x0003e889045565a9ULL
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+#define NBD_FLAG_C_NO_ZEROES    (1 << 1)
+#define NBD_MAX_OPT_LEN         4096
+
+/* NBD options and option replies */
+#define NBD_OPT_EXPORT_NAME     1
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_LIST            3
+#define NBD_OPT_INFO            6
+#define NBD_OPT_GO              7
+#define NBD_REP_ACK             1
+#define NBD_REP_SERVER          2
+#define NBD_REP_INFO            3
+#define NBD_REP_ERR_UNSUP       (0x80000000u | 1)
+#define NBD_INFO_EXPORT         0
 
-/* Protocol commands */
-#define NET_CMD_READ       0x01
-#define NET_CMD_WRITE      0x02
-#define NET_CMD_DISCONNECT 0x03
+/* NBD transmission */
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_REPLY_MAGIC         0x67446698
+#define NBD_FLAG_HAS_FLAGS      (1 << 0)
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)
+#define NBD_FLAG_SEND_FUA       (1 << 3)
+#define NBD_FLAG_SEND_TRIM      (1 << 5)
+#define NBD_CMD_READ            0
+#define NBD_CMD_WRITE           1
+#define NBD_CMD_DISC            2
+#define NBD_CMD_FLUSH           3
+#define NBD_CMD_TRIM            4
+#define NBD_CMD_FLAG_FUA        (1 << 0)
+#define NBD_MAX_IO              (32 * 1024 * 1024)
 
-/* Protocol responses */
-#define NET_STATUS_OK      0x00
-#define NET_STATUS_ERROR   0x01
+/* NBD error values (errno numbering on the wire) */
+#define NBD_EIO                 5
+#define NBD_ENOMEM              12
+#define NBD_EINVAL              22
+#define NBD_ENOSPC              28
 
-/* Request packet structure */
-struct net_request_packet {
-    uint8_t cmd;
-    uint64_t sector;
+#define NBD_EXPORT_NAME         "netblk"
+
+/* NBD transmission request */
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
     uint32_t length;
 } __attribute__((packed));
 
-/* Response packet structure */
-struct net_response_packet {
-    uint8_t status;
+/* NBD simple reply */
+struct nbd_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t handle;
 } __attribute__((packed));
 
 /* Server configuration */
 struct server_config {
     int port;
+    int nbd_port;                  /* 0 = NBD compatibility disabled */
+    char *shm_path;                /* NULL = shared-memory transport disabled */
     char *storage_file;
     size_t storage_size;
     int fd;
     volatile int running;
 };
 
+/* Per-connection receive ring, filled by recv() and drained by the parser */
+struct rx_ring {
+    uint8_t buf[RX_RING_SIZE];
+    size_t head;                   /* Next byte to consume (free-running) */
+    size_t tail;                   /* Next byte to fill (free-running) */
+};
+
+/* Client connection state */
+struct client_conn {
+    int sock;
+    struct rx_ring rx;
+};
+
 static struct server_config config;
 
 /* Convert big-endian to host byte order */
@@ -79,20 +156,6 @@ static uint32_t be32toh_manual(uint32_t value) {
     return result;
 }
 
-/* Send data */
-static int send_all(int sock, const void *buf, size_t len) {
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t n = send(sock, buf + sent, len - sent, 0);
-        if (n < 0) {
-            perror("send");
-            return -1;
-        }
-        sent += n;
-    }
-    return 0;
-}
-
 /* Receive data */
 static int recv_all(int sock, void *buf, size_t len) {
     size_t received = 0;
@@ -111,12 +174,182 @@ static int recv_all(int sock, void *buf, size_t len) {
     return 0;
 }
 
-/* Handle READ request */
-static int handle_read(int sock, uint64_t sector, uint32_t length) {
+/* Bytes buffered in the receive ring */
+static size_t rx_pending(const struct rx_ring *rx) {
+    return rx->tail - rx->head;
+}
+
+/* Fill the receive ring with whatever the socket has, one recv call */
+static int rx_fill(int sock, struct rx_ring *rx) {
+    size_t free_space = RX_RING_SIZE - rx_pending(rx);
+    size_t pos = rx->tail % RX_RING_SIZE;
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n;
+    
+    /* A zero-length recvmsg() returns 0 and would look like EOF */
+    if (free_space == 0) {
+        fprintf(stderr, "Receive ring full\n");
+        return -1;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = rx->buf + pos;
+    iov[0].iov_len = RX_RING_SIZE - pos;
+    if (iov[0].iov_len >= free_space) {
+        iov[0].iov_len = free_space;
+        msg.msg_iovlen = 1;
+    } else {
+        iov[1].iov_base = rx->buf;
+        iov[1].iov_len = free_space - iov[0].iov_len;
+        msg.msg_iovlen = 2;
+    }
+    msg.msg_iov = iov;
+    
+    n = recvmsg(sock, &msg, 0);
+    if (n < 0) {
+        perror("recv");
+        return -1;
+    }
+    if (n == 0) {
+        fprintf(stderr, "Connection closed by client\n");
+        return -1;
+    }
+    rx->tail += n;
+    return 0;
+}
+
+/* Copy bytes out of the receive ring */
+static void rx_copy(struct rx_ring *rx, void *buf, size_t len) {
+    size_t pos = rx->head % RX_RING_SIZE;
+    size_t first = RX_RING_SIZE - pos;
+    
+    if (first > len)
+        first = len;
+    memcpy(buf, rx->buf + pos, first);
+    memcpy((uint8_t *)buf + first, rx->buf, len - first);
+    rx->head += len;
+}
+
+/* Receive exactly len bytes through the ring */
+static int conn_recv(struct client_conn *conn, void *buf, size_t len) {
+    struct rx_ring *rx = &conn->rx;
+    size_t avail = rx_pending(rx);
+    
+    /*
+     * Large payloads bypass the ring once its contents are drained, and
+     * so does anything the ring cannot hold in one piece
+     */
+    if (avail < len && (len > RX_RING_SIZE || len - avail >= RX_RING_SIZE / 2)) {
+        rx_copy(rx, buf, avail);
+        return recv_all(conn->sock, (uint8_t *)buf + avail, len - avail);
+    }
+    
+    while (rx_pending(rx) < len) {
+        if (rx_fill(conn->sock, rx) < 0)
+            return -1;
+    }
+    rx_copy(rx, buf, len);
+    return 0;
+}
+
+/*
+ * Send a header plus optional data in one call. The segment is corked with
+ * MSG_MORE while another request of next_len bytes is already buffered,
+ * since its response will follow right away.
+ */
+static int conn_send(struct client_conn *conn, const void *hdr, size_t hdr_len,
+                     const void *data, size_t len, size_t next_len) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = hdr_len + len;
+    size_t sent = 0;
+    int flags = MSG_NOSIGNAL;
+    
+    if (rx_pending(&conn->rx) >= next_len)
+        flags |= MSG_MORE;
+    
+    while (sent < total) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if (sent < hdr_len) {
+            iov[0].iov_base = (uint8_t *)hdr + sent;
+            iov[0].iov_len = hdr_len - sent;
+            iov[1].iov_base = (void *)data;
+            iov[1].iov_len = len;
+            msg.msg_iovlen = len ? 2 : 1;
+        } else {
+            iov[0].iov_base = (uint8_t *)data + (sent - hdr_len);
+            iov[0].iov_len = total - sent;
+            msg.msg_iovlen = 1;
+        }
+        
+        ssize_t n = sendmsg(conn->sock, &msg, flags);
+        if (n < 0) {
+            perror("send");
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/* Send a netblk response status plus optional data */
+static int conn_send_resp(struct client_conn *conn, uint8_t status,
+                          const void *data, size_t len) {
     struct net_response_packet resp;
+    
+    resp.status = status;
+    return conn_send(conn, &resp, sizeof(resp), data, len,
+                     sizeof(struct net_request_packet));
+}
+
+/* Read from storage file, positional so connections don't share a file offset */
+static int storage_pread(void *buf, off_t offset, size_t len) {
+    ssize_t n = pread(config.fd, buf, len, offset);
+    if (n < 0 || (size_t)n != len) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+/* Write to storage file */
+static int storage_pwrite(const void *buf, off_t offset, size_t len) {
+    ssize_t n = pwrite(config.fd, buf, len, offset);
+    if (n < 0 || (size_t)n != len) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+/* Flush storage file to disk */
+static int storage_flush(void) {
+    if (fdatasync(config.fd) < 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+/* Discard a range, the file keeps its size */
+static int storage_trim(off_t offset, size_t len) {
+    if (fallocate(config.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset, len) < 0) {
+        /* Trim is advisory, filesystems without hole punching just keep the data */
+        if (errno == EOPNOTSUPP)
+            return 0;
+        perror("fallocate");
+        return -1;
+    }
+    return 0;
+}
+
+/* Handle READ request */
+static int handle_read(struct client_conn *conn, uint64_t sector, uint32_t length) {
     void *buffer;
     off_t offset;
-    ssize_t n;
     
     printf("READ: sector=%lu, length=%u\n", sector, length);
     
@@ -124,8 +357,7 @@ static int handle_read(int sock, uint64_t sector, uint32_t length) {
     offset = sector * SECTOR_SIZE;
     if ((size_t)(offset + length) > config.storage_size) {
         fprintf(stderr, "Read beyond storage size\n");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
         return -1;
     }
     
@@ -133,38 +365,19 @@ static int handle_read(int sock, uint64_t sector, uint32_t length) {
     buffer = malloc(length);
     if (!buffer) {
         perror("malloc");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
         return -1;
     }
     
     /* Read from storage file */
-    if (lseek(config.fd, offset, SEEK_SET) != offset) {
-        perror("lseek");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
-        free(buffer);
-        return -1;
-    }
-    
-    n = read(config.fd, buffer, length);
-    if (n != length) {
-        perror("read");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
+    if (storage_pread(buffer, offset, length) < 0) {
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
         free(buffer);
         return -1;
     }
     
-    /* Send response */
-    resp.status = NET_STATUS_OK;
-    if (send_all(sock, &resp, sizeof(resp)) < 0) {
-        free(buffer);
-        return -1;
-    }
-    
-    /* Send data */
-    if (send_all(sock, buffer, length) < 0) {
+    /* Send response and data */
+    if (conn_send_resp(conn, NET_STATUS_OK, buffer, length) < 0) {
         free(buffer);
         return -1;
     }
@@ -174,11 +387,9 @@ static int handle_read(int sock, uint64_t sector, uint32_t length) {
 }
 
 /* Handle WRITE request */
-static int handle_write(int sock, uint64_t sector, uint32_t length) {
-    struct net_response_packet resp;
+static int handle_write(struct client_conn *conn, uint64_t sector, uint32_t length) {
     void *buffer;
     off_t offset;
-    ssize_t n;
     
     printf("WRITE: sector=%lu, length=%u\n", sector, length);
     
@@ -186,12 +397,11 @@ static int handle_write(int sock, uint64_t sector, uint32_t length) {
     offset = sector * SECTOR_SIZE;
     if ((size_t)(offset + length) > config.storage_size) {
         fprintf(stderr, "Write beyond storage size\n");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
         /* Still need to receive data to keep protocol in sync */
         buffer = malloc(length);
         if (buffer) {
-            recv_all(sock, buffer, length);
+            conn_recv(conn, buffer, length);
             free(buffer);
         }
         return -1;
@@ -201,41 +411,126 @@ static int handle_write(int sock, uint64_t sector, uint32_t length) {
     buffer = malloc(length);
     if (!buffer) {
         perror("malloc");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
         return -1;
     }
     
     /* Receive data */
-    if (recv_all(sock, buffer, length) < 0) {
+    if (conn_recv(conn, buffer, length) < 0) {
         free(buffer);
         return -1;
     }
     
     /* Write to storage file */
-    if (lseek(config.fd, offset, SEEK_SET) != offset) {
-        perror("lseek");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
+    if (storage_pwrite(buffer, offset, length) < 0) {
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
         free(buffer);
         return -1;
     }
     
-    n = write(config.fd, buffer, length);
-    if (n != length) {
-        perror("write");
-        resp.status = NET_STATUS_ERROR;
-        send_all(sock, &resp, sizeof(resp));
+    /* Sync to disk */
+    fsync(config.fd);
+    
+    /* Send response */
+    if (conn_send_resp(conn, NET_STATUS_OK, NULL, 0) < 0) {
+        free(buffer);
+        return -1;
+    }
+    
+    free(buffer);
+    return 0;
+}
+
+/*
+ * Handle READV/WRITEV request
+ * nr extents follow the header; runs of file-contiguous extents are
+ * served with one pread/pwrite each, and a WRITEV is synced once.
+ */
+static int handle_vectored(struct client_conn *conn, uint8_t cmd,
+                           uint64_t nr, uint32_t length) {
+    struct net_extent ext[NET_MAX_EXTENTS];
+    int write_op = (cmd == NET_CMD_WRITEV);
+    uint64_t total = 0;
+    uint8_t *buffer;
+    size_t pos = 0;
+    uint64_t i, j;
+    int ok = 1;
+    
+    printf("%s: extents=%lu, length=%u\n",
+           write_op ? "WRITEV" : "READV", nr, length);
+    
+    /* Without a sane extent list the stream can't be resynchronized */
+    if (nr == 0 || nr > NET_MAX_EXTENTS || length > NET_MAX_VEC_BYTES) {
+        fprintf(stderr, "Invalid vectored request\n");
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
+        return -1;
+    }
+    
+    if (conn_recv(conn, ext, nr * sizeof(ext[0])) < 0) {
+        return -1;
+    }
+    
+    /* Validate parameters */
+    for (i = 0; i < nr; i++) {
+        ext[i].sector = be64toh_manual(ext[i].sector);
+        ext[i].length = be32toh_manual(ext[i].length);
+        total += ext[i].length;
+        if (ext[i].sector * SECTOR_SIZE + ext[i].length > config.storage_size) {
+            ok = 0;
+        }
+    }
+    if (!ok || total != length) {
+        fprintf(stderr, "Vectored request beyond storage size\n");
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
+        return -1;
+    }
+    
+    /* Allocate buffer */
+    buffer = malloc(length);
+    if (!buffer) {
+        perror("malloc");
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
+        return -1;
+    }
+    
+    /* Receive data */
+    if (write_op && conn_recv(conn, buffer, length) < 0) {
+        free(buffer);
+        return -1;
+    }
+    
+    /* Coalesce file-contiguous extents into one positional I/O */
+    for (i = 0; i < nr && ok; i = j) {
+        off_t offset = ext[i].sector * SECTOR_SIZE;
+        size_t len = ext[i].length;
+        
+        for (j = i + 1; j < nr &&
+             ext[j].sector * SECTOR_SIZE == (uint64_t)offset + len; j++) {
+            len += ext[j].length;
+        }
+        
+        if (write_op) {
+            ok = storage_pwrite(buffer + pos, offset, len) == 0;
+        } else {
+            ok = storage_pread(buffer + pos, offset, len) == 0;
+        }
+        pos += len;
+    }
+    
+    if (!ok) {
+        conn_send_resp(conn, NET_STATUS_ERROR, NULL, 0);
         free(buffer);
         return -1;
     }
     
     /* Sync to disk */
-    fsync(config.fd);
+    if (write_op) {
+        fsync(config.fd);
+    }
     
-    /* Send response */
-    resp.status = NET_STATUS_OK;
-    if (send_all(sock, &resp, sizeof(resp)) < 0) {
+    /* Send response (and data) */
+    if (conn_send_resp(conn, NET_STATUS_OK, write_op ? NULL : buffer,
+                       write_op ? 0 : length) < 0) {
         free(buffer);
         return -1;
     }
@@ -248,6 +543,7 @@ static int handle_write(int sock, uint64_t sector, uint32_t length) {
 static void *handle_client(void *arg) {
     int client_sock = *(int *)arg;
     free(arg);
+    struct client_conn *conn;
     struct net_request_packet req;
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
@@ -260,10 +556,18 @@ static void *handle_client(void *arg) {
     int flag = 1;
     setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
     
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        perror("calloc");
+        close(client_sock);
+        return NULL;
+    }
+    conn->sock = client_sock;
+    
     /* Handle requests */
     while (config.running) {
-        /* Receive request header */
-        if (recv_all(client_sock, &req, sizeof(req)) < 0) {
+        /* Receive request header, usually already buffered in the ring */
+        if (conn_recv(conn, &req, sizeof(req)) < 0) {
             break;
         }
         
@@ -274,13 +578,20 @@ static void *handle_client(void *arg) {
         /* Handle command */
         switch (req.cmd) {
         case NET_CMD_READ:
-            if (handle_read(client_sock, sector, length) < 0) {
+            if (handle_read(conn, sector, length) < 0) {
                 goto disconnect;
             }
             break;
             
         case NET_CMD_WRITE:
-            if (handle_write(client_sock, sector, length) < 0) {
+            if (handle_write(conn, sector, length) < 0) {
+                goto disconnect;
+            }
+            break;
+            
+        case NET_CMD_READV:
+        case NET_CMD_WRITEV:
+            if (handle_vectored(conn, req.cmd, sector, length) < 0) {
                 goto disconnect;
             }
             break;
@@ -299,6 +610,532 @@ disconnect:
     printf("Client disconnected: %s:%d\n",
            inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
     close(client_sock);
+    free(conn);
+    return NULL;
+}
+
+/*
+ * NBD compatibility mode
+ * 
+ * Fixed-newstyle handshake followed by the simple-reply transmission
+ * phase. Requests are answered in order through the same receive ring and
+ * storage helpers as the netblk protocol.
+ */
+
+/* Send an option reply during the handshake */
+static int nbd_send_opt_reply(struct client_conn *conn, uint32_t opt,
+                              uint32_t type, const void *data, uint32_t len) {
+    struct {
+        uint64_t magic;
+        uint32_t opt;
+        uint32_t type;
+        uint32_t len;
+    } __attribute__((packed)) rep;
+    
+    rep.magic = htobe64(NBD_REP_MAGIC);
+    rep.opt = htobe32(opt);
+    rep.type = htobe32(type);
+    rep.len = htobe32(len);
+    return conn_send(conn, &rep, sizeof(rep), data, len, SIZE_MAX);
+}
+
+/* Reply to NBD_OPT_INFO / NBD_OPT_GO with the export size and flags */
+static int nbd_send_export_info(struct client_conn *conn, uint32_t opt,
+                                uint16_t tx_flags) {
+    struct {
+        uint16_t type;
+        uint64_t size;
+        uint16_t flags;
+    } __attribute__((packed)) info;
+    
+    info.type = htobe16(NBD_INFO_EXPORT);
+    info.size = htobe64(config.storage_size);
+    info.flags = htobe16(tx_flags);
+    if (nbd_send_opt_reply(conn, opt, NBD_REP_INFO, &info, sizeof(info)) < 0) {
+        return -1;
+    }
+    return nbd_send_opt_reply(conn, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/* Option haggling, returns 0 when the client enters transmission */
+static int nbd_handshake(struct client_conn *conn, uint16_t tx_flags) {
+    struct {
+        uint64_t magic;
+        uint64_t opt_magic;
+        uint16_t flags;
+    } __attribute__((packed)) greeting;
+    struct {
+        uint64_t magic;
+        uint32_t opt;
+        uint32_t len;
+    } __attribute__((packed)) opt_hdr;
+    uint8_t data[NBD_MAX_OPT_LEN];
+    uint32_t client_flags;
+    
+    greeting.magic = htobe64(NBD_MAGIC);
+    greeting.opt_magic = htobe64(NBD_IHAVEOPT);
+    greeting.flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    if (conn_send(conn, &greeting, sizeof(greeting), NULL, 0, SIZE_MAX) < 0) {
+        return -1;
+    }
+    
+    if (conn_recv(conn, &client_flags, sizeof(client_flags)) < 0) {
+        return -1;
+    }
+    client_flags = be32toh(client_flags);
+    
+    for (;;) {
+        uint32_t opt, len;
+        
+        if (conn_recv(conn, &opt_hdr, sizeof(opt_hdr)) < 0) {
+            return -1;
+        }
+        opt = be32toh(opt_hdr.opt);
+        len = be32toh(opt_hdr.len);
+        if (be64toh(opt_hdr.magic) != NBD_IHAVEOPT || len > NBD_MAX_OPT_LEN) {
+            fprintf(stderr, "NBD: bad option header\n");
+            return -1;
+        }
+        if (len && conn_recv(conn, data, len) < 0) {
+            return -1;
+        }
+        
+        switch (opt) {
+        case NBD_OPT_EXPORT_NAME: {
+            /* Any export name maps to the single backing store */
+            struct {
+                uint64_t size;
+                uint16_t flags;
+                uint8_t zeroes[124];
+            } __attribute__((packed)) reply;
+            size_t reply_len = sizeof(reply);
+            
+            memset(&reply, 0, sizeof(reply));
+            reply.size = htobe64(config.storage_size);
+            reply.flags = htobe16(tx_flags);
+            if (client_flags & NBD_FLAG_C_NO_ZEROES) {
+                reply_len -= sizeof(reply.zeroes);
+            }
+            return conn_send(conn, &reply, reply_len, NULL, 0, SIZE_MAX);
+        }
+        
+        case NBD_OPT_ABORT:
+            nbd_send_opt_reply(conn, opt, NBD_REP_ACK, NULL, 0);
+            return -1;
+        
+        case NBD_OPT_LIST: {
+            uint8_t entry[4 + sizeof(NBD_EXPORT_NAME) - 1];
+            uint32_t name_len = htobe32(sizeof(NBD_EXPORT_NAME) - 1);
+            
+            memcpy(entry, &name_len, 4);
+            memcpy(entry + 4, NBD_EXPORT_NAME, sizeof(NBD_EXPORT_NAME) - 1);
+            if (nbd_send_opt_reply(conn, opt, NBD_REP_SERVER, entry, sizeof(entry)) < 0 ||
+                nbd_send_opt_reply(conn, opt, NBD_REP_ACK, NULL, 0) < 0) {
+                return -1;
+            }
+            break;
+        }
+        
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            if (nbd_send_export_info(conn, opt, tx_flags) < 0) {
+                return -1;
+            }
+            if (opt == NBD_OPT_GO) {
+                return 0;
+            }
+            break;
+        
+        default:
+            if (nbd_send_opt_reply(conn, opt, NBD_REP_ERR_UNSUP, NULL, 0) < 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+}
+
+/* Send a simple reply, data only for successful reads */
+static int nbd_send_reply(struct client_conn *conn, uint64_t handle,
+                          uint32_t error, const void *data, size_t len) {
+    struct nbd_reply reply;
+    
+    reply.magic = htobe32(NBD_REPLY_MAGIC);
+    reply.error = htobe32(error);
+    reply.handle = handle;  /* Opaque, echoed back unchanged */
+    return conn_send(conn, &reply, sizeof(reply), data, len,
+                     sizeof(struct nbd_request));
+}
+
+/* Transmission phase */
+static void nbd_serve(struct client_conn *conn) {
+    struct nbd_request req;
+    void *buffer;
+    
+    while (config.running) {
+        uint16_t flags, type;
+        uint64_t offset;
+        uint32_t length, error = 0;
+        int in_range;
+        
+        if (conn_recv(conn, &req, sizeof(req)) < 0) {
+            return;
+        }
+        if (be32toh(req.magic) != NBD_REQUEST_MAGIC) {
+            fprintf(stderr, "NBD: bad request magic\n");
+            return;
+        }
+        
+        flags = be16toh(req.flags);
+        type = be16toh(req.type);
+        offset = be64toh(req.offset);
+        length = be32toh(req.length);
+        in_range = offset <= config.storage_size &&
+                   length <= config.storage_size - offset;
+        
+        switch (type) {
+        case NBD_CMD_READ:
+            if (!in_range || length > NBD_MAX_IO) {
+                error = NBD_EINVAL;
+                break;
+            }
+            buffer = malloc(length ? length : 1);
+            if (!buffer) {
+                error = NBD_ENOMEM;
+                break;
+            }
+            if (storage_pread(buffer, offset, length) < 0) {
+                free(buffer);
+                error = NBD_EIO;
+                break;
+            }
+            if (nbd_send_reply(conn, req.handle, 0, buffer, length) < 0) {
+                free(buffer);
+                return;
+            }
+            free(buffer);
+            continue;
+        
+        case NBD_CMD_WRITE:
+            /* The payload must be consumed even when the request is rejected */
+            if (length > NBD_MAX_IO) {
+                fprintf(stderr, "NBD: write too large\n");
+                return;
+            }
+            buffer = malloc(length ? length : 1);
+            if (!buffer) {
+                return;
+            }
+            if (conn_recv(conn, buffer, length) < 0) {
+                free(buffer);
+                return;
+            }
+            if (!in_range) {
+                error = NBD_ENOSPC;
+            } else if (storage_pwrite(buffer, offset, length) < 0 ||
+                       ((flags & NBD_CMD_FLAG_FUA) && storage_flush() < 0)) {
+                error = NBD_EIO;
+            }
+            free(buffer);
+            break;
+        
+        case NBD_CMD_FLUSH:
+            if (storage_flush() < 0) {
+                error = NBD_EIO;
+            }
+            break;
+        
+        case NBD_CMD_TRIM:
+            if (!in_range) {
+                error = NBD_EINVAL;
+            } else if (storage_trim(offset, length) < 0) {
+                error = NBD_EIO;
+            }
+            break;
+        
+        case NBD_CMD_DISC:
+            printf("NBD: disconnect requested by client\n");
+            return;
+        
+        default:
+            error = NBD_EINVAL;
+            break;
+        }
+        
+        if (nbd_send_reply(conn, req.handle, error, NULL, 0) < 0) {
+            return;
+        }
+    }
+}
+
+/* Handle NBD client connection */
+static void *handle_nbd_client(void *arg) {
+    int client_sock = *(int *)arg;
+    free(arg);
+    struct client_conn *conn;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int flag = 1;
+    
+    getpeername(client_sock, (struct sockaddr *)&addr, &addr_len);
+    printf("NBD client connected: %s:%d\n",
+           inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    
+    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        perror("calloc");
+        close(client_sock);
+        return NULL;
+    }
+    conn->sock = client_sock;
+    
+    if (nbd_handshake(conn, NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM) == 0) {
+        nbd_serve(conn);
+    }
+    
+    printf("NBD client disconnected: %s:%d\n",
+           inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    close(client_sock);
+    free(conn);
+    return NULL;
+}
+
+/*
+ * Shared-memory ring transport
+ * 
+ * A co-located client hands over a memfd with SQ/CQ rings and data slots
+ * plus two eventfd doorbells on a Unix socket. Requests use the TCP
+ * framing inside the ring entries; data is read/written directly in the
+ * shared slots, so the request path involves no socket at all.
+ */
+struct shm_conn {
+    int sock;                      /* Unix socket, only watched for hang-up */
+    int sq_efd;
+    int cq_efd;
+    void *map;
+    size_t map_size;
+    struct netblk_shm_hdr *hdr;
+    struct netblk_sqe *sqes;
+    struct netblk_cqe *cqes;
+    uint32_t entries;
+    uint32_t slot_size;
+};
+
+/* Receive the setup message with memfd, SQ doorbell and CQ doorbell, and map the rings */
+static int shm_recv_setup(struct shm_conn *sc) {
+    struct netblk_shm_setup setup;
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    int fds[3] = { -1, -1, -1 };
+    int ret = -1;
+    ssize_t n;
+    
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &setup;
+    iov.iov_len = sizeof(setup);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    
+    n = recvmsg(sc->sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        perror("recvmsg");
+        return -1;
+    }
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    
+    if (n != sizeof(setup) || fds[0] < 0 || (msg.msg_flags & MSG_CTRUNC) ||
+        setup.magic != NETBLK_SHM_MAGIC || setup.version != NETBLK_SHM_VERSION ||
+        setup.entries == 0 || setup.entries > NETBLK_SHM_MAX_ENTRIES ||
+        (setup.entries & (setup.entries - 1)) ||
+        setup.slot_size == 0 || setup.slot_size > NETBLK_SHM_MAX_SLOT ||
+        setup.slot_size % NETBLK_SHM_ALIGN) {
+        fprintf(stderr, "SHM: invalid setup message\n");
+        goto out;
+    }
+    
+    sc->entries = setup.entries;
+    sc->slot_size = setup.slot_size;
+    sc->map_size = netblk_shm_size(sc->entries, sc->slot_size);
+    if (fstat(fds[0], &st) < 0 || (size_t)st.st_size < sc->map_size) {
+        fprintf(stderr, "SHM: shared region too small\n");
+        goto out;
+    }
+    
+    sc->map = mmap(NULL, sc->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (sc->map == MAP_FAILED) {
+        sc->map = NULL;
+        perror("mmap");
+        goto out;
+    }
+    sc->hdr = sc->map;
+    sc->sqes = (struct netblk_sqe *)((uint8_t *)sc->map + netblk_shm_sqes_offset());
+    sc->cqes = (struct netblk_cqe *)((uint8_t *)sc->map + netblk_shm_cqes_offset(sc->entries));
+    sc->sq_efd = fds[1];
+    sc->cq_efd = fds[2];
+    fds[1] = fds[2] = -1;
+    ret = 0;
+    
+out:
+    /* The mapping keeps the memory alive */
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return ret;
+}
+
+/* Execute one ring request against its data slot */
+static uint8_t shm_do_request(struct shm_conn *sc, const struct netblk_sqe *sqe) {
+    uint64_t sector = be64toh_manual(sqe->req.sector);
+    uint32_t length = be32toh_manual(sqe->req.length);
+    off_t offset = sector * SECTOR_SIZE;
+    void *buf;
+    
+    if (sqe->slot >= sc->entries || length > sc->slot_size ||
+        sector > config.storage_size / SECTOR_SIZE ||
+        length > config.storage_size - offset) {
+        fprintf(stderr, "SHM: invalid request\n");
+        return NET_STATUS_ERROR;
+    }
+    buf = (uint8_t *)sc->map + netblk_shm_slot_offset(sc->entries, sc->slot_size, sqe->slot);
+    
+    switch (sqe->req.cmd) {
+    case NET_CMD_READ:
+        if (storage_pread(buf, offset, length) < 0) {
+            return NET_STATUS_ERROR;
+        }
+        return NET_STATUS_OK;
+    
+    case NET_CMD_WRITE:
+        /* Same durability as a TCP WRITE */
+        if (storage_pwrite(buf, offset, length) < 0) {
+            return NET_STATUS_ERROR;
+        }
+        fsync(config.fd);
+        return NET_STATUS_OK;
+    
+    default:
+        fprintf(stderr, "SHM: unsupported command: 0x%02x\n", sqe->req.cmd);
+        return NET_STATUS_ERROR;
+    }
+}
+
+/* Drain the SQ, post completions, ring the CQ doorbell once per pass */
+static int shm_drain(struct shm_conn *sc) {
+    uint32_t mask = sc->entries - 1;
+    uint32_t head = sc->hdr->sq.head;
+    uint32_t tail = __atomic_load_n(&sc->hdr->sq.tail, __ATOMIC_ACQUIRE);
+    uint64_t one = 1;
+    
+    while (head != tail) {
+        uint32_t cq_tail = sc->hdr->cq.tail;
+        struct netblk_sqe sqe;
+        struct netblk_cqe *cqe;
+        
+        if (tail - head > sc->entries ||
+            cq_tail - __atomic_load_n(&sc->hdr->cq.head, __ATOMIC_ACQUIRE) >= sc->entries) {
+            fprintf(stderr, "SHM: ring overflow\n");
+            return -1;
+        }
+        
+        /* Snapshot the entry, the client can rewrite shared memory any time */
+        sqe = sc->sqes[head & mask];
+        cqe = &sc->cqes[cq_tail & mask];
+        cqe->slot = sqe.slot;
+        cqe->resp.status = shm_do_request(sc, &sqe);
+        
+        __atomic_store_n(&sc->hdr->sq.head, ++head, __ATOMIC_RELEASE);
+        __atomic_store_n(&sc->hdr->cq.tail, cq_tail + 1, __ATOMIC_RELEASE);
+        
+        if (head == tail) {
+            if (write(sc->cq_efd, &one, sizeof(one)) != sizeof(one)) {
+                perror("eventfd write");
+                return -1;
+            }
+            tail = __atomic_load_n(&sc->hdr->sq.tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    return 0;
+}
+
+/* Handle shared-memory client connection */
+static void *handle_shm_client(void *arg) {
+    struct shm_conn sc;
+    struct net_response_packet resp;
+    struct pollfd pfd[2];
+    uint64_t count;
+    
+    memset(&sc, 0, sizeof(sc));
+    sc.sock = *(int *)arg;
+    sc.sq_efd = -1;
+    sc.cq_efd = -1;
+    free(arg);
+    
+    printf("SHM client connected\n");
+    
+    resp.status = shm_recv_setup(&sc) < 0 ? NET_STATUS_ERROR : NET_STATUS_OK;
+    if (send(sc.sock, &resp, sizeof(resp), MSG_NOSIGNAL) != sizeof(resp) ||
+        resp.status != NET_STATUS_OK) {
+        goto out;
+    }
+    printf("SHM: %u entries, %u byte slots\n", sc.entries, sc.slot_size);
+    
+    pfd[0].fd = sc.sq_efd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sc.sock;
+    pfd[1].events = POLLIN;
+    
+    while (config.running) {
+        if (shm_drain(&sc) < 0) {
+            break;
+        }
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        /* DISCONNECT or hang-up on the control socket */
+        if (pfd[1].revents) {
+            break;
+        }
+        if ((pfd[0].revents & POLLIN) &&
+            read(sc.sq_efd, &count, sizeof(count)) < 0) {
+            perror("eventfd read");
+            break;
+        }
+    }
+    
+out:
+    printf("SHM client disconnected\n");
+    if (sc.map) {
+        munmap(sc.map, sc.map_size);
+    }
+    if (sc.sq_efd >= 0) {
+        close(sc.sq_efd);
+    }
+    if (sc.cq_efd >= 0) {
+        close(sc.cq_efd);
+    }
+    close(sc.sock);
     return NULL;
 }
 
@@ -330,81 +1167,90 @@ static int init_storage(const char *path, size_t size) {
     return fd;
 }
 
-int main(int argc, char *argv[]) {
-    int server_sock, *client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len;
-    pthread_t thread;
+/* Create a listening TCP socket on port */
+static int create_listener(int port) {
+    struct sockaddr_in server_addr;
+    int sock;
     int opt = 1;
     
-    /* Parse command line */
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <port> <storage_file> <size_mb>\n", argv[0]);
-        fprintf(stderr, "Example: %s 10809 /tmp/netblk.img 100\n", argv[0]);
-        return 1;
-    }
-    
-    config.port = atoi(argv[1]);
-    config.storage_file = argv[2];
-    config.storage_size = atoi(argv[3]) * 1024 * 1024;
-    config.running = 1;
-    
-    /* Initialize storage */
-    config.fd = init_storage(config.storage_file, config.storage_size);
-    if (config.fd < 0) {
-        return 1;
-    }
-    
-    /* Setup signal handlers */
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    
-    /* Create server socket */
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0) {
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
         perror("socket");
-        close(config.fd);
-        return 1;
+        return -1;
     }
     
     /* Set socket options */
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR,
-                   &opt, sizeof(opt)) < 0) {
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         perror("setsockopt");
-        close(server_sock);
-        close(config.fd);
-        return 1;
+        close(sock);
+        return -1;
     }
     
     /* Bind */
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(config.port);
+    server_addr.sin_port = htons(port);
     
-    if (bind(server_sock, (struct sockaddr *)&server_addr,
-             sizeof(server_addr)) < 0) {
+    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind");
-        close(server_sock);
-        close(config.fd);
-        return 1;
+        close(sock);
+        return -1;
     }
     
     /* Listen */
-    if (listen(server_sock, 5) < 0) {
+    if (listen(sock, 5) < 0) {
         perror("listen");
-        close(server_sock);
-        close(config.fd);
-        return 1;
+        close(sock);
+        return -1;
     }
     
-    printf("Network Block Device Server\n");
-    printf("Listening on port %d\n", config.port);
-    printf("Storage: %s (%zu MB)\n",
-           config.storage_file, config.storage_size / (1024 * 1024));
-    printf("Press Ctrl+C to stop\n\n");
+    return sock;
+}
+
+/* Create a listening Unix socket at path, replacing a stale one */
+static int create_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    int sock;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+    
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+    
+    if (listen(sock, 5) < 0) {
+        perror("listen");
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+    
+    return sock;
+}
+
+/* Accept connections, one thread per client */
+static void accept_loop(int server_sock, void *(*handler)(void *)) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_len;
+    pthread_t thread;
+    int *client_sock;
     
-    /* Accept connections */
     while (config.running) {
         client_len = sizeof(client_addr);
         client_sock = malloc(sizeof(int));
@@ -424,7 +1270,7 @@ int main(int argc, char *argv[]) {
         }
         
         /* Create thread to handle client */
-        if (pthread_create(&thread, NULL, handle_client, client_sock) != 0) {
+        if (pthread_create(&thread, NULL, handler, client_sock) != 0) {
             perror("pthread_create");
             close(*client_sock);
             free(client_sock);
@@ -433,9 +1279,136 @@ int main(int argc, char *argv[]) {
         
         pthread_detach(thread);
     }
+}
+
+/* Accept thread for the NBD port */
+static void *nbd_accept_thread(void *arg) {
+    accept_loop(*(int *)arg, handle_nbd_client);
+    return NULL;
+}
+
+/* Accept thread for the shared-memory Unix socket */
+static void *shm_accept_thread(void *arg) {
+    accept_loop(*(int *)arg, handle_shm_client);
+    return NULL;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n nbd_port] [-U socket_path] <port> <storage_file> <size_mb>\n", prog);
+    fprintf(stderr, "  -n nbd_port     Also serve the standard NBD protocol on this port\n");
+    fprintf(stderr, "  -U socket_path  Also accept shared-memory ring clients on this Unix socket\n");
+    fprintf(stderr, "Example: %s -n 10810 10809 /tmp/netblk.img 100\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int server_sock, nbd_sock = -1, shm_sock = -1;
+    pthread_t nbd_thread, shm_thread;
+    int opt;
+    
+    /* Parse command line */
+    while ((opt = getopt(argc, argv, "n:U:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            config.nbd_port = atoi(optarg);
+            break;
+        case 'U':
+            config.shm_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (argc - optind != 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    config.port = atoi(argv[optind]);
+    config.storage_file = argv[optind + 1];
+    config.storage_size = (size_t)atoi(argv[optind + 2]) * 1024 * 1024;
+    config.running = 1;
+    
+    /* Initialize storage */
+    config.fd = init_storage(config.storage_file, config.storage_size);
+    if (config.fd < 0) {
+        return 1;
+    }
+    
+    /* Setup signal handlers */
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+    
+    /* Create server sockets */
+    server_sock = create_listener(config.port);
+    if (server_sock < 0) {
+        close(config.fd);
+        return 1;
+    }
+    
+    if (config.nbd_port) {
+        nbd_sock = create_listener(config.nbd_port);
+        if (nbd_sock < 0) {
+            close(server_sock);
+            close(config.fd);
+            return 1;
+        }
+        if (pthread_create(&nbd_thread, NULL, nbd_accept_thread, &nbd_sock) != 0) {
+            perror("pthread_create");
+            close(nbd_sock);
+            close(server_sock);
+            close(config.fd);
+            return 1;
+        }
+        pthread_detach(nbd_thread);
+    }
+    
+    if (config.shm_path) {
+        shm_sock = create_unix_listener(config.shm_path);
+        if (shm_sock < 0 ||
+            pthread_create(&shm_thread, NULL, shm_accept_thread, &shm_sock) != 0) {
+            fprintf(stderr, "Cannot start shared-memory transport\n");
+            if (shm_sock >= 0) {
+                close(shm_sock);
+                unlink(config.shm_path);
+            }
+            if (nbd_sock >= 0) {
+                close(nbd_sock);
+            }
+            close(server_sock);
+            close(config.fd);
+            return 1;
+        }
+        pthread_detach(shm_thread);
+    }
+    
+    printf("Network Block Device Server\n");
+    printf("Listening on port %d\n", config.port);
+    if (config.nbd_port) {
+        printf("NBD protocol on port %d (export \"%s\")\n",
+               config.nbd_port, NBD_EXPORT_NAME);
+    }
+    if (config.shm_path) {
+        printf("Shared-memory rings on %s\n", config.shm_path);
+    }
+    printf("Storage: %s (%zu MB)\n",
+           config.storage_file, config.storage_size / (1024 * 1024));
+    printf("Press Ctrl+C to stop\n\n");
+    
+    /* Accept connections */
+    accept_loop(server_sock, handle_client);
     
     /* Cleanup */
     close(server_sock);
+    if (nbd_sock >= 0) {
+        close(nbd_sock);
+    }
+    if (shm_sock >= 0) {
+        close(shm_sock);
+        unlink(config.shm_path);
+    }
     close(config.fd);
     
     printf("Server stopped\n");
@@ -19,6 +19,15 @@
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/bitmap.h>
+#include <linux/workqueue.h>
+#include <linux/dax.h>
+#include <linux/pfn_t.h>
+#include <linux/lz4.h>
+#include <linux/crc32.h>
+#include <linux/cdev.h>
+#include <linux/uaccess.h>
 
 #define DEVICE_NAME "flashblk"
 #define KERNEL_SECTOR_SIZE 512
@@ -26,18 +35,184 @@
 /* Device parameters */
 #define MYBLK_SECTOR_SIZE 512
 #define MYBLK_MINORS 1
+#define MYBLK_MAX_DISKS 2  /* Hybrid disk, or RAM and NOR disks with split_regions */
 #define RAM_DATA_SIZE (3 * 1024 * 1024)  /* 3MB RAM (read-write, at offset 0) */
+#define RAM_PAGES (RAM_DATA_SIZE / PAGE_SIZE)
 #define FLASH_DATA_SIZE (512 * 1024)  /* 512KB Flash = 128 sectors × 4KB (read-write, at offset RAM_DATA_SIZE) */
 #define FLASH_START_ADDR 0x000000  /* Flash physical address */
 #define FLASH_SECTOR_SIZE 4096  /* Flash sector size for erase (4KB) */
 #define FLASH_MAX_SECTORS 128  /* Maximum sector ID (0-127) */
+#define FLASH_PAGE_SIZE 256  /* Flash program page / buffer window size */
+#define FLASH_CHIP_SIZE (16 * 1024 * 1024)  /* Readable through the flash device, 24-bit sector addresses */
+#define FLASH_DEV_CHUNK (4 * FLASH_PAGE_SIZE)  /* Bytes read per dev->lock hold by the flash device, ~30ms on I2C */
 #define MYBLK_TOTAL_SIZE (RAM_DATA_SIZE + FLASH_DATA_SIZE)  /* Total: 3.5MB = RAM + Flash */
 
+/*
+ * Flash translation layer (optional, see the ftl module parameter)
+ * Every 4KB sector holds a header page followed by 7 slots of 512 bytes:
+ * [hdr 256B][slot0 512B]...[slot6 512B][unused 256B]
+ * The header records magic/erase count (programmed right after erase),
+ * the open sequence number and the logical block of each written slot.
+ * Since NOR programming only clears bits, these fields are programmed
+ * one by one into the erased header without another erase.
+ */
+#define FTL_MAGIC 0x314c5446  /* "FTL1" */
+#define FTL_SLOT_SIZE 512
+#define FTL_SLOTS_PER_SECTOR 7
+#define FTL_SPARE_SECTORS 8  /* Over-provisioning for garbage collection */
+#define FTL_NR_SLOTS (FLASH_MAX_SECTORS * FTL_SLOTS_PER_SECTOR)
+#define FTL_NR_LBAS ((FLASH_MAX_SECTORS - FTL_SPARE_SECTORS) * FTL_SLOTS_PER_SECTOR)
+#define FTL_DATA_SIZE (FTL_NR_LBAS * FTL_SLOT_SIZE)  /* 420KB exported with FTL */
+#define FTL_GC_FREE_SECTORS 2  /* Collect garbage below this many free sectors */
+#define FTL_WEAR_DELTA 32  /* Erase count spread that triggers static wear leveling */
+#define FTL_UNMAPPED 0xFFFF
+#define FTL_LBA_NONE 0xFFFFFFFF
+#define FTL_ENTRY_LIVE 0xFFFF0000  /* Header entry bits left erased, cleared by a discard */
+
+/*
+ * Write-back cache of flash erase blocks (see the wb_* module parameters)
+ * Partial and repeated writes are merged in RAM and every dirty block is
+ * written back with a single erase when the device goes idle, when it has
+ * been dirty for too long, on FLUSH/FUA and on unload.
+ */
+#define WB_BLOCK_SIZE FLASH_SECTOR_SIZE
+#define WB_CHUNKS (WB_BLOCK_SIZE / MYBLK_SECTOR_SIZE)  /* Valid mask granularity */
+#define WB_ALL_VALID ((1U << WB_CHUNKS) - 1)
+#define WB_POLL_MS 100  /* Flusher wake-up interval */
+
+/*
+ * RAM mirror of the flash (see the mirror module parameter)
+ * Filled page by page on first read and kept in sync by erase/program,
+ * so repeated reads of the flash are served at memcpy speed.
+ */
+#define MIRROR_PAGES (FLASH_DATA_SIZE / FLASH_PAGE_SIZE)
+
+/* Pre-erase pool */
+#define POOL_POLL_MS 200  /* Eraser wake-up interval */
+
+/*
+ * RAM region snapshots (see the snapshot module parameter)
+ * The backing file holds a log: a full image of the RAM region followed
+ * by delta records with only the blocks written since the checkpoint
+ * before, LZ4 compressed. Once the deltas outgrow SNAP_LOG_MAX the next
+ * checkpoint writes a new image instead.
+ */
+#define SNAP_BLOCK_SIZE 4096  /* Dirty tracking and restore granularity */
+#define SNAP_BLOCKS (RAM_DATA_SIZE / SNAP_BLOCK_SIZE)
+#define SNAP_MAGIC 0x4e534246  /* "FBSN" */
+#define SNAP_REC_MAGIC 0x43524246  /* "FBRC" */
+#define SNAP_VERSION 1
+#define SNAP_HDR_SIZE 4096  /* Header block, records follow */
+#define SNAP_REC_FULL 0x1  /* Starts an image, blocks not in it are zero */
+#define SNAP_BATCH 32  /* Blocks per record */
+#define SNAP_REC_MAX (sizeof(struct snap_record) + \
+                      SNAP_BATCH * (sizeof(struct snap_entry) + SNAP_BLOCK_SIZE))
+#define SNAP_IMAGE_MAX ((SNAP_BLOCKS / SNAP_BATCH + 1) * SNAP_REC_MAX)
+#define SNAP_LOG_MAX (2 * RAM_DATA_SIZE)  /* Log bytes that trigger a new image */
+#define SNAP_POLL_MS 200  /* Snapshot thread wake-up interval */
+
 /* Flash I2C parameters - modify these based on your hardware */
 #define FLASH_I2C_BUS 4
 #define FLASH_I2C_ADDR 0x11  /* Adjust to your sensor address */
-#define I2C_SMBUS_BLOCK_MAX 32
 #define FLASH_READ_RETRY 3
+#define FLASH_FILL_CHUNK 16  /* Bytes per buffer window write */
+#define FLASH_FILL_MSGS (FLASH_PAGE_SIZE / FLASH_FILL_CHUNK)
+/* Page fill messages plus the program subcommand, each with a 2-byte register */
+#define FLASH_XFER_BUF_SIZE (FLASH_FILL_MSGS * (2 + FLASH_FILL_CHUNK) + 2 + 6)
+
+/*
+ * Subcommand completion: the execute byte (0x5a) written at 0x8005
+ * reads back as another value once the controller has finished
+ */
+#define FLASH_EXEC_REG 0x8005
+#define FLASH_EXEC_BUSY 0x5a
+#define FLASH_POLL_MIN_US 100  /* First poll interval, doubled while busy */
+#define FLASH_POLL_MAX_US 2000
+#define FLASH_HIST_BUCKETS 20  /* log2 microsecond buckets, last one open-ended */
+
+static bool ftl;
+module_param(ftl, bool, 0444);
+MODULE_PARM_DESC(ftl, "Log-structured FTL for the flash region (own on-flash format, 420KB)");
+
+static unsigned int i2c_max_xfer;
+module_param(i2c_max_xfer, uint, 0644);
+MODULE_PARM_DESC(i2c_max_xfer, "Max bytes per I2C read transfer (0 = adapter limit, up to 256)");
+
+static bool status_poll = true;
+module_param(status_poll, bool, 0644);
+MODULE_PARM_DESC(status_poll, "Poll the flash status for completion instead of fixed delays");
+
+static unsigned int session_idle_ms = 50;
+module_param(session_idle_ms, uint, 0644);
+MODULE_PARM_DESC(session_idle_ms, "Keep the flash unlocked this long after the last operation (0 = lock after each)");
+
+static bool mirror = true;
+module_param(mirror, bool, 0444);
+MODULE_PARM_DESC(mirror, "Keep a 512KB RAM mirror of the flash for reads");
+
+static bool warmup;
+module_param(warmup, bool, 0444);
+MODULE_PARM_DESC(warmup, "Load the whole flash into the mirror in the background at load");
+
+static unsigned int wb_blocks = 16;
+module_param(wb_blocks, uint, 0444);
+MODULE_PARM_DESC(wb_blocks, "4KB erase blocks held in the write-back cache (0 = write through)");
+
+static unsigned int wb_idle_ms = 200;
+module_param(wb_idle_ms, uint, 0644);
+MODULE_PARM_DESC(wb_idle_ms, "Write back dirty blocks after this much flash idle time");
+
+static unsigned int wb_expire_ms = 3000;
+module_param(wb_expire_ms, uint, 0644);
+MODULE_PARM_DESC(wb_expire_ms, "Write back a block at the latest this long after it got dirty");
+
+static bool pre_erase = true;
+module_param(pre_erase, bool, 0444);
+MODULE_PARM_DESC(pre_erase, "Erase discarded flash sectors in the background");
+
+static unsigned int pre_erase_idle_ms = 1000;
+module_param(pre_erase_idle_ms, uint, 0644);
+MODULE_PARM_DESC(pre_erase_idle_ms, "Start pre-erasing after this much flash idle time");
+
+static bool split_regions;
+module_param(split_regions, bool, 0444);
+MODULE_PARM_DESC(split_regions, "Export the RAM and flash regions as flashblk_ram and flashblk_nor");
+
+static char *provider = "i2c";
+module_param(provider, charp, 0444);
+MODULE_PARM_DESC(provider, "Flash provider: i2c (NOR on I2C bus 4) or emul (RAM-backed NOR emulator)");
+
+static int i2c_bus = FLASH_I2C_BUS;
+module_param(i2c_bus, int, 0444);
+MODULE_PARM_DESC(i2c_bus, "I2C bus of the flash for provider=i2c, e.g. the bus of flash_i2c_model");
+
+static unsigned int emul_byte_ns = 22500;
+module_param(emul_byte_ns, uint, 0644);
+MODULE_PARM_DESC(emul_byte_ns, "Emulator: bus time per byte in ns (22500 = 400kHz I2C)");
+
+static unsigned int emul_read_us = 1800;
+module_param(emul_read_us, uint, 0644);
+MODULE_PARM_DESC(emul_read_us, "Emulator: buffer window load time");
+
+static unsigned int emul_program_us = 700;
+module_param(emul_program_us, uint, 0644);
+MODULE_PARM_DESC(emul_program_us, "Emulator: page program time");
+
+static unsigned int emul_erase_us = 31000;
+module_param(emul_erase_us, uint, 0644);
+MODULE_PARM_DESC(emul_erase_us, "Emulator: sector erase time");
+
+static unsigned int emul_mode_us = 2000;
+module_param(emul_mode_us, uint, 0644);
+MODULE_PARM_DESC(emul_mode_us, "Emulator: settle time after each unlock/lock mode command");
+
+static char *snapshot;
+module_param(snapshot, charp, 0444);
+MODULE_PARM_DESC(snapshot, "Backing file for RAM region checkpoints (unset = RAM region is volatile)");
+
+static unsigned int snapshot_interval_ms = 5000;
+module_param(snapshot_interval_ms, uint, 0644);
+MODULE_PARM_DESC(snapshot_interval_ms, "Checkpoint changed RAM blocks this often (0 = only on unload and on request)");
 
 /* Flash sensor info structure - adapt to your sensor_info_t */
 struct flash_sensor_info {
@@ -46,23 +221,293 @@ struct flash_sensor_info {
     /* Add other fields from your sensor_info_t as needed */
 };
 
+/* On-flash sector header, little-endian */
+struct ftl_header {
+    __le32 magic;
+    __le32 erase_count;
+    __le32 seq;                          /* Programmed when the sector is opened */
+    __le32 lba[FTL_SLOTS_PER_SECTOR];    /* FTL_ENTRY_LIVE | lba after each slot's data, 0 once discarded */
+} __packed;
+
+enum ftl_sector_state {
+    FTL_SEC_FREE,                        /* Erased, usable */
+    FTL_SEC_DIRTY,                       /* Unknown contents, erase before use */
+    FTL_SEC_OPEN,                        /* Receiving writes */
+    FTL_SEC_CLOSED,                      /* Full or recovered, read-only until GC */
+};
+
+struct ftl_sector {
+    u8 state;
+    u8 next_slot;                        /* Next free slot while open */
+    u8 valid;                            /* Slots still mapped */
+    u32 erase_count;
+    u32 seq;
+};
+
+/* In-RAM FTL state, rebuilt from the sector headers at load */
+struct flash_ftl {
+    u16 l2p[FTL_NR_LBAS];                /* Logical block -> physical slot */
+    u16 p2l[FTL_NR_SLOTS];               /* Physical slot -> logical block */
+    u16 owner[FTL_NR_SLOTS];             /* Live header entry of each slot, stale copies too */
+    struct ftl_sector sectors[FLASH_MAX_SECTORS];
+    int active;                          /* Open sector, -1 if none */
+    u32 next_seq;
+    u32 nr_free;                         /* FREE + DIRTY sectors */
+    bool in_gc;
+    u8 gc_buf[FTL_SLOT_SIZE];
+    /* Statistics */
+    u64 host_writes;                     /* Slots written by the host */
+    u64 slot_programs;                   /* Slots programmed incl. GC copies */
+    u64 erases;
+    u64 gc_runs;
+    u64 wear_moves;                      /* GC runs chosen for wear leveling */
+    u64 discards;                        /* Header entries cleared by discards */
+};
+
+/* Flash operations with a completion wait */
+enum flash_op {
+    FLASH_OP_READ,                       /* Loading the buffer window */
+    FLASH_OP_PROGRAM,
+    FLASH_OP_ERASE,
+    FLASH_OP_NR,
+};
+
+/* Fixed delays used without polling, and the polling timeouts */
+static const struct flash_op_timing {
+    const char *name;
+    u32 sleep_min_us;
+    u32 sleep_max_us;
+    u32 timeout_us;
+} flash_op_timing[FLASH_OP_NR] = {
+    [FLASH_OP_READ]    = { "read",    10000, 11000, 100000 },
+    [FLASH_OP_PROGRAM] = { "program",  3000,  4000, 100000 },
+    [FLASH_OP_ERASE]   = { "erase",   50000, 52000, 1000000 },
+};
+
+/* Measured durations of one operation type */
+struct flash_op_stats {
+    u64 count;
+    u64 total_us;
+    u32 max_us;
+    u32 avg_us;                          /* Moving average, seeds the first sleep */
+    u32 timeouts;
+    u64 hist[FLASH_HIST_BUCKETS];        /* Bucket b: [2^(b-1), 2^b) us */
+};
+
+/* Raw flash access statistics, protected by the device mutex */
+struct flash_stats {
+    u64 read_sessions;                   /* flash_read_raw() calls */
+    u64 read_bytes;
+    u64 read_xfers;                      /* I2C buffer window reads */
+    u64 read_ns;                         /* Time spent in flash_read_raw() */
+    struct flash_op_stats ops[FLASH_OP_NR];
+    bool poll_seen;                      /* Status register went idle at least once */
+    bool poll_broken;                    /* Never went idle, fixed delays from now on */
+    u64 sessions;                        /* Unlock/lock pairs */
+    u64 session_ops;                     /* Operations run inside sessions */
+    u64 i2c_transfers;                   /* i2c_transfer() calls */
+    u64 i2c_msgs;                        /* Messages in successful transfers */
+    u64 erases_skipped;                  /* Sector writes done without erase */
+    u64 pages_programmed;
+    u64 pages_skipped;                   /* Pages already holding the data */
+};
+
+/* RAM mirror of the physical flash, protected by the device mutex */
+struct flash_mirror {
+    u8 *data;                            /* FLASH_DATA_SIZE bytes */
+    DECLARE_BITMAP(valid, MIRROR_PAGES); /* Pages matching the flash */
+    /* Statistics */
+    u64 hits;                            /* Pages served from RAM */
+    u64 fills;                           /* Pages read from flash */
+    /* Background warm-up */
+    struct task_struct *warmup;
+    ktime_t warm_start;
+    s64 warm_ms;                         /* Duration once finished, else -1 */
+    u32 warm_errors;
+};
+
+/*
+ * Discarded and pre-erased sectors, protected by the device mutex.
+ * Without the FTL, discard marks whole sectors free and the eraser
+ * thread erases them while the flash is idle. With the FTL, discard
+ * unmaps slots and the eraser recycles sectors left without live data.
+ */
+struct flash_pool {
+    DECLARE_BITMAP(free, FLASH_MAX_SECTORS);   /* Contents no longer needed */
+    DECLARE_BITMAP(erased, FLASH_MAX_SECTORS); /* Known to read all 0xFF */
+    struct task_struct *eraser;
+    unsigned long last_io;               /* jiffies of the last flash region access */
+    /* Statistics */
+    u64 discards;                        /* Discard requests reaching the flash region */
+    u64 pre_erases;                      /* Sectors erased by the eraser thread */
+    u64 hits;                            /* Sector writes landing on a pre-erased sector */
+};
+
+/* One cached erase block of the flash region */
+struct wb_entry {
+    int block;                           /* Erase block index, -1 if unused */
+    u8 valid;                            /* 512-byte chunks holding current data */
+    unsigned long dirty_since;           /* jiffies of the first unflushed write */
+    unsigned long last_used;             /* jiffies of the last access, for LRU */
+    u8 *data;
+};
+
+/* Write-back cache state, protected by the device mutex */
+struct flash_wb {
+    struct wb_entry *entries;
+    unsigned int nr;
+    unsigned long *dirty;                /* One bit per entry */
+    u8 *blocks;                          /* nr * WB_BLOCK_SIZE of cached data */
+    u8 *fill_buf;                        /* Flash contents under a partial block */
+    struct task_struct *flusher;
+    unsigned long last_io;               /* jiffies of the last flash region access */
+    /* Statistics */
+    u64 read_hits;
+    u64 write_hits;                      /* Writes merged into a cached block */
+    u64 write_misses;
+    u64 block_writes;                    /* Erase blocks touched by host writes */
+    u64 writebacks;                      /* Erase blocks written to flash */
+    u64 evictions;
+};
+
+/* Snapshot file header at offset 0, little-endian */
+struct snap_header {
+    __le32 magic;                        /* SNAP_MAGIC */
+    __le32 version;
+    __le32 block_size;                   /* SNAP_BLOCK_SIZE */
+    __le32 nr_blocks;                    /* SNAP_BLOCKS */
+    __le64 start;                        /* First record of the current image */
+    __le32 seq;                          /* Its sequence number */
+    __le32 crc;                          /* crc32 of the fields above */
+};
+
+/* Log record, followed by nr entries each followed by its data */
+struct snap_record {
+    __le32 magic;                        /* SNAP_REC_MAGIC */
+    __le32 seq;                          /* Previous record + 1 */
+    __le32 flags;                        /* SNAP_REC_FULL */
+    __le32 nr;
+    __le32 bytes;                        /* Entries and data after this header */
+    __le32 crc;                          /* crc32 of those bytes */
+};
+
+struct snap_entry {
+    __le32 block;
+    __le32 len;                          /* 0: zero, SNAP_BLOCK_SIZE: raw, else LZ4 */
+};                                       /* Data padded to 4 bytes */
+
+/*
+ * RAM region snapshot state. The bitmaps use atomic bit operations: the
+ * RAM path sets dirty bits and tests pending bits without taking the lock.
+ */
+struct ram_snap {
+    struct file *file;
+    struct mutex lock;                   /* File, index, buffers and statistics */
+    DECLARE_BITMAP(dirty, SNAP_BLOCKS);  /* Written since the last checkpoint */
+    DECLARE_BITMAP(mapped, SNAP_BLOCKS); /* Handed out by DAX, saved every time */
+    DECLARE_BITMAP(pending, SNAP_BLOCKS); /* Still only in the file */
+    loff_t off[SNAP_BLOCKS];             /* File offset of a pending block */
+    u32 len[SNAP_BLOCKS];                /* Its stored length */
+    loff_t start;                        /* Current image */
+    loff_t end;                          /* Next record goes here */
+    u32 seq;                             /* Last record written */
+    void *lz4_wrk;
+    u8 *rec_buf;                         /* SNAP_REC_MAX bytes */
+    u8 *block_buf;                       /* Stable copy of a block, header I/O */
+    struct task_struct *thread;
+    struct workqueue_struct *wq;         /* RAM requests waiting for a restore */
+    unsigned long last_checkpoint;       /* jiffies */
+    /* Statistics */
+    u64 checkpoints;
+    u64 blocks_saved;
+    u64 bytes_saved;                     /* Record bytes written to the file */
+    u64 compactions;
+    u64 restored;                        /* Blocks read back from the file */
+    u32 errors;
+    s64 last_ms;                         /* Duration of the last checkpoint */
+};
+
+/* RAM-backed NOR emulator state, protected by the device mutex */
+struct flash_emul {
+    u8 *data;                            /* FLASH_MAX_SECTORS sectors */
+    u32 erase_count[FLASH_MAX_SECTORS];
+    bool unlocked;
+    /* Statistics */
+    u64 bus_bytes;                       /* Bytes the I2C protocol would move */
+    u64 busy_us;                         /* Simulated bus and operation time */
+    u64 bit_conflicts;                   /* Programs that needed an erase first */
+    u64 protocol_errors;                 /* Access while locked, out of range, page overrun */
+};
+
+struct myblk_device;
+
+/*
+ * Flash provider: the transport below the flash layer. Sessions,
+ * mirror, pool and statistics stay in the flash layer. All calls are
+ * made with dev->lock held, addresses are absolute flash addresses.
+ */
+struct flash_provider {
+    const char *name;
+    uint32_t size;                   /* Addressable bytes */
+    int (*bind)(struct myblk_device *dev);
+    void (*unbind)(struct myblk_device *dev);
+    int (*unlock)(struct myblk_device *dev);
+    void (*lock)(struct myblk_device *dev);
+    /* Any length, streamed in FLASH_PAGE_SIZE windows */
+    int (*read)(struct myblk_device *dev, uint32_t addr, uint8_t *data, uint32_t bytes);
+    /* At most up to the end of the page holding addr */
+    int (*program)(struct myblk_device *dev, uint32_t addr, const uint8_t *data, uint32_t bytes);
+    int (*erase)(struct myblk_device *dev, uint32_t sector_id);
+};
+
+/* Per-request driver data */
+struct myblk_cmd {
+    struct work_struct work;         /* Queued on flash_wq or snap->wq */
+};
+
+/* One exported disk: the hybrid disk, or a single region when split */
+struct myblk_disk {
+    struct myblk_device *dev;
+    loff_t base;                     /* Device offset of the first sector */
+    unsigned long size;              /* Disk size in bytes */
+    struct gendisk *gd;
+    struct blk_mq_tag_set tag_set;   /* Own queues, limits and scheduler */
+    struct dax_device *dax;          /* RAM-only disk with CONFIG_DAX, else NULL */
+};
+
 /* Device structure */
 struct myblk_device {
     unsigned long size;              /* Device size in bytes */
+    unsigned long flash_size;        /* Exported size of the flash region */
+    struct flash_ftl *ftl;           /* NULL when the flash is mapped 1:1 */
+    struct flash_wb *wb;             /* NULL when writing through */
+    struct flash_mirror *mirror;     /* NULL when reads go to the flash */
+    struct flash_pool pool;          /* Discarded and pre-erased sectors */
+    struct flash_stats stats;        /* Raw flash access counters */
     u8 *cache;                       /* Cache buffer for read/write */
-    u8 *ram_buf;                     /* RAM区缓冲区 */
-    struct mutex lock;               /* Mutex for flash I/O (can sleep) */
-    struct gendisk *gd;              /* Generic disk structure */
-    struct blk_mq_tag_set tag_set;   /* blk-mq tag set */
-    struct request_queue *queue;     /* Request queue */
+    u8 *ram_buf;                     /* RAM区缓冲区, vmap of ram_pages */
+    struct page **ram_pages;         /* Backing pages, handed out by DAX */
+    struct ram_snap *snap;           /* NULL when the RAM region is volatile */
+    struct mutex lock;               /* Serializes flash access, the RAM region needs none */
+    atomic_t io_waiting;             /* Requests waiting for the mutex */
+    struct workqueue_struct *flash_wq; /* Ordered, runs requests touching the flash */
+    bool session_open;               /* Flash unlocked, see flash_session_begin() */
+    unsigned long session_last;      /* jiffies of the last flash operation */
+    struct delayed_work session_work; /* Locks the flash after session_idle_ms */
+    struct myblk_disk disks[MYBLK_MAX_DISKS]; /* Unused entries have gd == NULL */
+    const struct flash_provider *prov; /* Transport for the flash layer */
+    struct flash_emul *emul;         /* provider=emul only */
     struct flash_sensor_info flash_info; /* Flash hardware info */
-    struct i2c_client *i2c_client;   /* I2C client for flash access */
-    /* Sysfs interface for direct flash access */
-    struct class *flash_class;       /* Device class for sysfs */
-    struct device *flash_device;     /* Device for sysfs */
-    uint32_t debug_addr;             /* Flash address for debug read */
-    uint32_t debug_len;              /* Length for debug read */
-    u8 *debug_buf;                   /* Buffer for debug read data */
+    struct i2c_adapter *i2c_adapter; /* Held from load to unload */
+    struct i2c_client *i2c_client;   /* Claims the flash address, NULL if shared */
+    u8 *xfer_buf;                    /* DMA-safe write payloads */
+    u8 *page_buf;                    /* DMA-safe buffer window reads */
+    u8 *sector_buf;                  /* Old and new contents of a sector being written */
+    /* Character device for raw flash reads, /dev/flashblk_flash */
+    struct class *flash_class;
+    struct device *flash_device;
+    struct cdev flash_cdev;
+    dev_t flash_devt;
 };
 
 static struct myblk_device *myblk_dev = NULL;
@@ -70,233 +515,296 @@ static int myblk_major = 0;
 
 /*
  * Flash I2C helper functions
- * These are simplified versions - integrate with your actual I2C functions
+ * The adapter and the i2c_client are bound once at load. Payloads go
+ * through buffers preallocated with kmalloc (DMA-safe), and sequences
+ * that belong together are sent as one multi-message i2c_transfer().
  */
-static int flash_i2c_read_retry(int bus_num, uint8_t addr,
-    uint8_t *reg_addr, uint8_t reg_size, uint8_t *buf, uint8_t buf_size)
+static int flash_i2c_transfer(struct myblk_device *dev, struct i2c_msg *msgs, int num)
 {
-    struct i2c_adapter *adapter;
-    struct i2c_msg msgs[2];
-    int ret, retry;
-
-    adapter = i2c_get_adapter(bus_num);
-    if (!adapter) {
-        printk(KERN_ERR "flashblk: Failed to get I2C adapter %d\n", bus_num);
-        return -ENODEV;
+    const struct i2c_adapter_quirks *q = dev->i2c_adapter->quirks;
+    int batch = num, done = 0, n, ret = 0, retry;
+
+    /* Respect the adapter's message count limit */
+    if (q && q->max_num_msgs)
+        batch = max(q->max_num_msgs, 1);
+
+    while (done < num) {
+        n = min(num - done, batch);
+        for (retry = 0; retry < FLASH_READ_RETRY; retry++) {
+            ret = i2c_transfer(dev->i2c_adapter, msgs + done, n);
+            dev->stats.i2c_transfers++;
+            if (ret == n)
+                break;
+            usleep_range(1000, 2000);
+        }
+        if (ret != n)
+            return -EIO;
+        dev->stats.i2c_msgs += n;
+        done += n;
     }
+    return 0;
+}
+
+static int flash_i2c_read_retry(struct myblk_device *dev,
+    uint8_t *reg_addr, uint8_t reg_size, uint8_t *buf, uint16_t buf_size)
+{
+    struct i2c_msg msgs[2];
 
     /* Write register address */
-    msgs[0].addr = addr;
+    msgs[0].addr = dev->flash_info.sensor_addr;
     msgs[0].flags = 0;
     msgs[0].len = reg_size;
     msgs[0].buf = reg_addr;
 
     /* Read data */
-    msgs[1].addr = addr;
+    msgs[1].addr = dev->flash_info.sensor_addr;
     msgs[1].flags = I2C_M_RD;
     msgs[1].len = buf_size;
     msgs[1].buf = buf;
+    if (buf >= dev->page_buf && buf < dev->page_buf + FLASH_PAGE_SIZE)
+        msgs[1].flags |= I2C_M_DMA_SAFE;
 
-    for (retry = 0; retry < FLASH_READ_RETRY; retry++) {
-        ret = i2c_transfer(adapter, msgs, 2);
-        if (ret == 2) {
-            i2c_put_adapter(adapter);
-            return 0;
-        }
-        usleep_range(1000, 2000);
-    }
+    return flash_i2c_transfer(dev, msgs, 2);
+}
+
+/* Fill one message with register address plus data in the transfer buffer */
+static void flash_i2c_prep_write(struct myblk_device *dev, struct i2c_msg *msg,
+    uint8_t *tx, const uint8_t *reg_addr, uint8_t reg_size,
+    const uint8_t *buf, uint16_t buf_size)
+{
+    memcpy(tx, reg_addr, reg_size);
+    memcpy(tx + reg_size, buf, buf_size);
 
-    i2c_put_adapter(adapter);
-    return -EIO;
+    msg->addr = dev->flash_info.sensor_addr;
+    msg->flags = I2C_M_DMA_SAFE;
+    msg->len = reg_size + buf_size;
+    msg->buf = tx;
 }
 
-static int flash_i2c_write_retry(int bus_num, uint8_t addr,
-    uint8_t *reg_addr, uint8_t reg_size, uint8_t *buf, uint8_t buf_size)
+static int flash_i2c_write_retry(struct myblk_device *dev,
+    uint8_t *reg_addr, uint8_t reg_size, uint8_t *buf, uint16_t buf_size)
 {
-    struct i2c_adapter *adapter;
     struct i2c_msg msg;
-    uint8_t *write_buf;
-    int ret, retry;
 
-    adapter = i2c_get_adapter(bus_num);
-    if (!adapter) {
-        printk(KERN_ERR "flashblk: Failed to get I2C adapter %d\n", bus_num);
+    if (reg_size + buf_size > FLASH_XFER_BUF_SIZE)
+        return -EINVAL;
+    flash_i2c_prep_write(dev, &msg, dev->xfer_buf, reg_addr, reg_size, buf, buf_size);
+    return flash_i2c_transfer(dev, &msg, 1);
+}
+
+static int hb_vin_i2c_write_reg16_data8(struct myblk_device *dev,
+    uint16_t reg, uint8_t data)
+{
+    uint8_t reg_addr[2];
+
+    reg_addr[0] = (reg >> 8) & 0xFF;
+    reg_addr[1] = reg & 0xFF;
+
+    return flash_i2c_write_retry(dev, reg_addr, sizeof(reg_addr), &data, 1);
+}
+
+/* Bind the flash's I2C adapter and address for the lifetime of the module */
+static int flash_i2c_bind(struct myblk_device *dev)
+{
+    struct flash_sensor_info *sensor_info = &dev->flash_info;
+    struct i2c_client *client;
+
+    dev->i2c_adapter = i2c_get_adapter(sensor_info->bus_num);
+    if (!dev->i2c_adapter) {
+        printk(KERN_ERR "flashblk: Failed to get I2C adapter %d\n", sensor_info->bus_num);
         return -ENODEV;
     }
 
-    write_buf = kmalloc(reg_size + buf_size, GFP_KERNEL);
-    if (!write_buf) {
-        i2c_put_adapter(adapter);
+    dev->xfer_buf = kmalloc(FLASH_XFER_BUF_SIZE, GFP_KERNEL);
+    dev->page_buf = kmalloc(FLASH_PAGE_SIZE, GFP_KERNEL);
+    if (!dev->xfer_buf || !dev->page_buf) {
+        kfree(dev->xfer_buf);
+        kfree(dev->page_buf);
+        i2c_put_adapter(dev->i2c_adapter);
+        dev->i2c_adapter = NULL;
         return -ENOMEM;
     }
 
-    memcpy(write_buf, reg_addr, reg_size);
-    memcpy(write_buf + reg_size, buf, buf_size);
+    /*
+     * Claim the address. When the sensor driver already owns it the
+     * transfers still work through the adapter, only the claim is skipped.
+     */
+    client = i2c_new_dummy_device(dev->i2c_adapter, sensor_info->sensor_addr);
+    if (IS_ERR(client))
+        printk(KERN_INFO "flashblk: I2C address 0x%02x in use (%ld), sharing it\n",
+               sensor_info->sensor_addr, PTR_ERR(client));
+    else
+        dev->i2c_client = client;
+    return 0;
+}
 
-    msg.addr = addr;
-    msg.flags = 0;
-    msg.len = reg_size + buf_size;
-    msg.buf = write_buf;
+static void flash_i2c_unbind(struct myblk_device *dev)
+{
+    if (dev->i2c_client)
+        i2c_unregister_device(dev->i2c_client);
+    dev->i2c_client = NULL;
+    kfree(dev->xfer_buf);
+    kfree(dev->page_buf);
+    if (dev->i2c_adapter)
+        i2c_put_adapter(dev->i2c_adapter);
+    dev->i2c_adapter = NULL;
+}
 
-    for (retry = 0; retry < FLASH_READ_RETRY; retry++) {
-        ret = i2c_transfer(adapter, &msg, 1);
-        if (ret == 1) {
-            kfree(write_buf);
-            i2c_put_adapter(adapter);
-            return 0;
-        }
-        usleep_range(1000, 2000);
-    }
+static void flash_op_account(struct flash_op_stats *st, s64 us)
+{
+    u32 d = clamp_t(s64, us, 0, U32_MAX);
 
-    kfree(write_buf);
-    i2c_put_adapter(adapter);
-    return -EIO;
+    st->count++;
+    st->total_us += d;
+    st->max_us = max(st->max_us, d);
+    st->avg_us = st->avg_us ? (st->avg_us * 7 + d) / 8 : d;
+    st->hist[min(fls(d), FLASH_HIST_BUCKETS - 1)]++;
 }
 
-static int hb_vin_i2c_write_reg16_data8(int bus_num, uint8_t addr,
-    uint16_t reg, uint8_t data)
+/*
+ * Wait for a subcommand to complete
+ * Sleeps through most of the usual duration of the operation, then polls
+ * the execute byte with an exponentially growing interval. Controllers
+ * that never clear it are detected on the first timeout and get the old
+ * fixed delays from then on.
+ */
+static int flash_wait_op(struct myblk_device *dev, enum flash_op op)
 {
-    struct i2c_adapter *adapter;
-    struct i2c_msg msg;
-    uint8_t buf[3];
+    const struct flash_op_timing *t = &flash_op_timing[op];
+    struct flash_op_stats *st = &dev->stats.ops[op];
+    uint8_t reg_addr[2] = { FLASH_EXEC_REG >> 8, FLASH_EXEC_REG & 0xFF };
+    uint8_t status;
+    ktime_t start = ktime_get();
+    u32 delay_us, interval_us = FLASH_POLL_MIN_US;
+    s64 elapsed;
     int ret;
 
-    adapter = i2c_get_adapter(bus_num);
-    if (!adapter)
-        return -ENODEV;
+    if (!status_poll || dev->stats.poll_broken) {
+        usleep_range(t->sleep_min_us, t->sleep_max_us);
+        flash_op_account(st, ktime_us_delta(ktime_get(), start));
+        return 0;
+    }
 
-    buf[0] = (reg >> 8) & 0xFF;
-    buf[1] = reg & 0xFF;
-    buf[2] = data;
+    delay_us = st->avg_us ? st->avg_us * 3 / 4 : FLASH_POLL_MIN_US;
+    for (;;) {
+        usleep_range(delay_us, delay_us + delay_us / 4);
 
-    msg.addr = addr;
-    msg.flags = 0;
-    msg.len = 3;
-    msg.buf = buf;
+        ret = flash_i2c_read_retry(dev, reg_addr, sizeof(reg_addr), &status, 1);
+        elapsed = ktime_us_delta(ktime_get(), start);
+        if (ret == 0 && status != FLASH_EXEC_BUSY) {
+            dev->stats.poll_seen = true;
+            flash_op_account(st, elapsed);
+            return 0;
+        }
 
-    ret = i2c_transfer(adapter, &msg, 1);
-    i2c_put_adapter(adapter);
+        if (elapsed > t->timeout_us) {
+            st->timeouts++;
+            if (!dev->stats.poll_seen) {
+                /* Waited longer than the fixed delay, the operation is done */
+                printk(KERN_WARNING "flashblk: Flash status not pollable, using fixed delays\n");
+                dev->stats.poll_broken = true;
+                return 0;
+            }
+            printk(KERN_ERR "flashblk: Flash %s timed out after %lld us\n",
+                   t->name, elapsed);
+            return -ETIMEDOUT;
+        }
 
-    return (ret == 1) ? 0 : -EIO;
+        delay_us = interval_us;
+        interval_us = min(interval_us * 2, FLASH_POLL_MAX_US);
+    }
 }
 
 /*
- * Raw flash read operation - reads from absolute flash address
- * This is used by the sysfs interface for debug access
+ * Flash access sessions
+ * The provider unlocks the flash when the first operation of a batch
+ * starts. The flash then stays unlocked for the following erases,
+ * programs and reads, and is locked again session_idle_ms after the
+ * last one by a delayed work, or right away after a failed operation.
+ * All callers hold dev->lock.
  */
-static int flash_read_raw(struct myblk_device *dev, uint32_t flash_addr,
-    uint8_t *data, uint32_t bytes)
+static int flash_session_begin(struct myblk_device *dev)
 {
-    int ret = 0;
-    uint8_t reg_addr[4] = {0};
-    uint8_t reg_size = 0;
-    uint8_t buf[I2C_SMBUS_BLOCK_MAX] = {0};
-    uint8_t buf_size = 0;
-    uint8_t flash_offset = 0;
-    struct flash_sensor_info *sensor_info = &dev->flash_info;
+    int ret;
 
-    printk(KERN_DEBUG "flashblk: Reading %u bytes from flash addr 0x%06X\n",
-           bytes, flash_addr);
+    dev->stats.session_ops++;
+    dev->session_last = jiffies;
+    if (dev->session_open)
+        return 0;
 
-    /* Serial NOR Flash access unlock request */
-    ret = hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF4);
-    if (ret < 0) {
-        printk(KERN_ERR "flashblk: Flash unlock failed\n");
+    ret = dev->prov->unlock(dev);
+    if (ret < 0)
         return ret;
-    }
-    usleep_range(2000, 3000);
-
-    /* Serial NOR Flash read request */
-    ret = hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF7);
-    if (ret < 0) {
-        printk(KERN_ERR "flashblk: Flash read request failed\n");
-        goto lock_flash;
-    }
-    usleep_range(2000, 3000);
-
-    /* Serial NOR Flash Read Subcommand */
-    reg_addr[0] = 0x80;
-    reg_addr[1] = 0x00;
-    reg_addr[2] = 0x01;
-    reg_size = 3;
-
-    /* Address settings - use absolute flash address */
-    buf[0] = (flash_addr >> 24) & 0xFF;
-    buf[1] = (flash_addr >> 16) & 0xFF;
-    buf[2] = (flash_addr >> 8) & 0xFF;
-    buf[3] = flash_addr & 0xFF;
-    buf[4] = 0x5a; /* Execute subcommand */
-    buf_size = 5;
-
-    ret = flash_i2c_write_retry(sensor_info->bus_num, sensor_info->sensor_addr,
-        reg_addr, reg_size, buf, buf_size);
-    if (ret < 0) {
-        printk(KERN_ERR "flashblk: Flash read subcommand failed\n");
-        goto lock_flash;
-    }
-    usleep_range(10000, 11000);
 
-    /* Buffer read request */
-    while (bytes > 0) {
-        memset(buf, 0, I2C_SMBUS_BLOCK_MAX);
-        reg_size = 2;
-        memset(reg_addr, 0, reg_size);
-        reg_addr[0] = 0x00;
-        reg_addr[1] = flash_offset;
+    dev->session_open = true;
+    dev->stats.sessions++;
+    return 0;
+}
 
-        if (bytes > I2C_SMBUS_BLOCK_MAX - reg_size) {
-            buf_size = I2C_SMBUS_BLOCK_MAX - reg_size;
-        } else {
-            buf_size = bytes;
-        }
+/* Lock the flash now if a session is open */
+static void flash_session_lock(struct myblk_device *dev)
+{
+    if (!dev->session_open)
+        return;
 
-        ret = flash_i2c_read_retry(sensor_info->bus_num, sensor_info->sensor_addr,
-            reg_addr, reg_size, buf, buf_size);
-        if (ret < 0) {
-            printk(KERN_ERR "flashblk: Read failed at flash_offset 0x%x\n", flash_offset);
-            goto lock_flash;
-        }
+    dev->prov->lock(dev);
+    dev->session_open = false;
+}
 
-        memcpy(data + flash_offset, buf, buf_size);
-        bytes -= buf_size;
-        flash_offset += buf_size;
+/* Finish one operation, the lock follows once the flash has been idle */
+static void flash_session_end(struct myblk_device *dev, int result)
+{
+    if (result < 0 || !session_idle_ms) {
+        flash_session_lock(dev);
+        return;
     }
-    usleep_range(10000, 11000);
+    dev->session_last = jiffies;
+    mod_delayed_work(system_wq, &dev->session_work,
+                     msecs_to_jiffies(session_idle_ms));
+}
 
-lock_flash:
-    /* Serial NOR Flash access lock request */
-    hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF5);
-    usleep_range(2000, 3000);
+static void flash_session_idle_work(struct work_struct *work)
+{
+    struct myblk_device *dev = container_of(to_delayed_work(work),
+                                            struct myblk_device, session_work);
 
-    return ret;
+    mutex_lock(&dev->lock);
+    /* Re-armed while waiting for the mutex, a later run will lock */
+    if (!time_before(jiffies, dev->session_last + msecs_to_jiffies(session_idle_ms)))
+        flash_session_lock(dev);
+    mutex_unlock(&dev->lock);
 }
 
-/*
- * Flash erase sector operation - based on sensor_flash_sector implementation
- * sector_id: sector number to erase (0-127)
- */
-static int flash_erase_sector(struct myblk_device *dev, uint32_t sector_id)
+/* Stop the idle timer and lock the flash, used at teardown */
+static void flash_session_close(struct myblk_device *dev)
 {
-    int ret = 0;
-    uint8_t reg_addr[2] = {0};
-    uint8_t reg_size = 0;
-    uint8_t buf[6] = {0};
-    uint8_t buf_size = 0;
-    struct flash_sensor_info *sensor_info = &dev->flash_info;
+    cancel_delayed_work_sync(&dev->session_work);
+    mutex_lock(&dev->lock);
+    flash_session_lock(dev);
+    mutex_unlock(&dev->lock);
+}
 
-    if (sector_id >= FLASH_MAX_SECTORS) {
-        printk(KERN_ERR "flashblk: Invalid sector_id %u (must be 0-%d)\n", sector_id, FLASH_MAX_SECTORS - 1);
-        return -EINVAL;
-    }
+/* Largest read payload per I2C transfer: module parameter and adapter quirks */
+static uint32_t flash_i2c_max_read(struct myblk_device *dev)
+{
+    const struct i2c_adapter_quirks *q = dev->i2c_adapter->quirks;
+    uint32_t max = i2c_max_xfer ? i2c_max_xfer : FLASH_PAGE_SIZE;
+
+    /* Register address write plus data read, as a combined transfer */
+    if (q && q->max_read_len)
+        max = min_t(uint32_t, max, q->max_read_len);
+    if (q && q->max_comb_2nd_msg_len)
+        max = min_t(uint32_t, max, q->max_comb_2nd_msg_len);
+    return clamp_t(uint32_t, max, 1, FLASH_PAGE_SIZE);
+}
 
-    printk(KERN_DEBUG "flashblk: Erasing flash sector %u\n", sector_id);
+/* Unlock (0xF4) and access (0xF7) mode commands */
+static int flash_i2c_unlock(struct myblk_device *dev)
+{
+    int ret;
 
     /* Serial NOR Flash access unlock request */
-    ret = hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF4);
+    ret = hb_vin_i2c_write_reg16_data8(dev, 0xFFFF, 0xF4);
     if (ret < 0) {
         printk(KERN_ERR "flashblk: Flash unlock failed\n");
         return ret;
@@ -304,338 +812,2326 @@ static int flash_erase_sector(struct myblk_device *dev, uint32_t sector_id)
     usleep_range(2000, 3000);
 
     /* Serial NOR Flash access request */
-    ret = hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF7);
+    ret = hb_vin_i2c_write_reg16_data8(dev, 0xFFFF, 0xF7);
     if (ret < 0) {
         printk(KERN_ERR "flashblk: Flash access request failed\n");
-        goto lock_flash;
+        hb_vin_i2c_write_reg16_data8(dev, 0xFFFF, 0xF5);
+        usleep_range(2000, 3000);
+        return ret;
     }
     usleep_range(2000, 3000);
+    return 0;
+}
 
-    /* Erase sector command */
-    reg_addr[0] = 0x80;
-    reg_addr[1] = 0x00;
-    reg_size = 2;
-
-    buf[0] = 0x03;  /* Erase command */
-    buf[1] = 0x00;
-    buf[2] = sector_id >> 4;
-    buf[3] = (sector_id & 0xf) << 4;
-    buf[4] = 0x00;
-    buf[5] = 0x5a;  /* Execute subcommand */
-    buf_size = 6;
-
-    ret = flash_i2c_write_retry(sensor_info->bus_num, sensor_info->sensor_addr,
-        reg_addr, reg_size, buf, buf_size);
-    if (ret < 0) {
-        printk(KERN_ERR "flashblk: Flash erase command failed\n");
-        goto lock_flash;
-    }
-    usleep_range(50000, 52000);  /* Wait for erase to complete */
-
-lock_flash:
+static void flash_i2c_lock(struct myblk_device *dev)
+{
     /* Serial NOR Flash access lock request */
-    hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF5);
+    hb_vin_i2c_write_reg16_data8(dev, 0xFFFF, 0xF5);
     usleep_range(2000, 3000);
-
-    return ret;
 }
 
 /*
- * Flash write operation - based on sensor_flash_sector implementation
- * offset is relative to block device start (within FLASH region)
- * This implementation writes data to flash using sector-based operations
+ * Stream a range of any length: each read subcommand loads up to
+ * FLASH_PAGE_SIZE bytes into the buffer window, which is then drained
+ * with the largest transfers the adapter accepts
  */
-static int flash_write(struct myblk_device *dev, loff_t offset, const uint8_t *data, uint32_t bytes)
+static int flash_i2c_read(struct myblk_device *dev, uint32_t flash_addr,
+    uint8_t *data, uint32_t bytes)
 {
     int ret = 0;
-    uint32_t flash_addr = FLASH_START_ADDR + offset;
     uint8_t reg_addr[4] = {0};
     uint8_t reg_size = 0;
-    uint8_t buf[I2C_SMBUS_BLOCK_MAX] = {0};
-    uint8_t buf_size = 0;
-    uint8_t flash_offset = 0;
-    uint32_t remaining = bytes;
-    uint32_t data_offset = 0;
-    struct flash_sensor_info *sensor_info = &dev->flash_info;
+    uint8_t cmd[5];
+    uint8_t *page_buf = dev->page_buf;
+    uint32_t max_xfer, done = 0, chunk, pos, xfer;
 
-    printk(KERN_DEBUG "flashblk: Writing %u bytes to flash offset 0x%llx (addr 0x%06X)\n",
-           bytes, offset, flash_addr);
+    max_xfer = flash_i2c_max_read(dev);
 
-    /* Serial NOR Flash access unlock request */
-    ret = hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF4);
-    if (ret < 0) {
-        printk(KERN_ERR "flashblk: Flash unlock failed\n");
-        return ret;
-    }
-    usleep_range(2000, 3000);
+    while (done < bytes) {
+        uint32_t addr = flash_addr + done;
 
-    /* Serial NOR Flash write access request */
-    ret = hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF7);
-    if (ret < 0) {
-        printk(KERN_ERR "flashblk: Flash write access request failed\n");
-        goto lock_flash;
-    }
-    usleep_range(2000, 3000);
+        chunk = min_t(uint32_t, bytes - done, FLASH_PAGE_SIZE);
 
-    /* Write data in chunks to buffer, then program to flash */
-    while (remaining > 0) {
-        uint32_t chunk_size = (remaining > 16) ? 16 : remaining;
-        
-        /* Write data to buffer */
-        reg_size = 2;
-        reg_addr[0] = 0x00;
-        reg_addr[1] = flash_offset;
+        /* Serial NOR Flash Read Subcommand, loads the buffer window */
+        reg_addr[0] = 0x80;
+        reg_addr[1] = 0x00;
+        reg_addr[2] = 0x01;
+        reg_size = 3;
+
+        cmd[0] = (addr >> 24) & 0xFF;
+        cmd[1] = (addr >> 16) & 0xFF;
+        cmd[2] = (addr >> 8) & 0xFF;
+        cmd[3] = addr & 0xFF;
+        cmd[4] = 0x5a; /* Execute subcommand */
 
-        ret = flash_i2c_write_retry(sensor_info->bus_num, sensor_info->sensor_addr,
-            reg_addr, reg_size, (uint8_t *)(data + data_offset), chunk_size);
+        ret = flash_i2c_write_retry(dev, reg_addr, reg_size, cmd, sizeof(cmd));
         if (ret < 0) {
-            printk(KERN_ERR "flashblk: Write to buffer failed at offset 0x%x\n", flash_offset);
-            goto lock_flash;
+            printk(KERN_ERR "flashblk: Flash read subcommand failed at 0x%06X\n", addr);
+            return ret;
         }
+        ret = flash_wait_op(dev, FLASH_OP_READ);
+        if (ret < 0)
+            return ret;
 
-        data_offset += chunk_size;
-        flash_offset += chunk_size;
-        remaining -= chunk_size;
-
-        /* If buffer is full (256 bytes) or no more data, program to flash */
-        if (flash_offset >= 256 || remaining == 0) {
-            /* Serial NOR Flash Write Subcommand */
-            reg_addr[0] = 0x80;
-            reg_addr[1] = 0x00;
+        /* Buffer read request */
+        for (pos = 0; pos < chunk; pos += xfer) {
+            xfer = min(chunk - pos, max_xfer);
             reg_size = 2;
+            reg_addr[0] = 0x00;
+            reg_addr[1] = pos;
 
-            buf[0] = 0x02;  /* Write command */
-            buf[1] = 0x00;
-            buf[2] = (flash_addr >> 16) & 0xFF;
-            buf[3] = (flash_addr >> 8) & 0xFF;
-            buf[4] = flash_addr & 0xFF;
-            buf[5] = 0x5a;  /* Execute subcommand */
-            buf_size = 6;
-
-            ret = flash_i2c_write_retry(sensor_info->bus_num, sensor_info->sensor_addr,
-                reg_addr, reg_size, buf, buf_size);
+            ret = flash_i2c_read_retry(dev, reg_addr, reg_size, page_buf + pos, xfer);
             if (ret < 0) {
-                printk(KERN_ERR "flashblk: Flash write subcommand failed\n");
-                goto lock_flash;
+                printk(KERN_ERR "flashblk: Read failed at flash_offset 0x%x\n", pos);
+                return ret;
             }
-            usleep_range(3000, 4000);
-
-            /* Move to next page */
-            flash_addr += flash_offset;
-            flash_offset = 0;
+            dev->stats.read_xfers++;
         }
-    }
-
-lock_flash:
-    /* Serial NOR Flash access lock request */
-    hb_vin_i2c_write_reg16_data8(sensor_info->bus_num,
-        sensor_info->sensor_addr, 0xFFFF, 0xF5);
-    usleep_range(2000, 3000);
 
-    return ret;
+        memcpy(data + done, page_buf, chunk);
+        done += chunk;
+    }
+    /* Settle time before locking, not needed when completion is polled */
+    if (!status_poll || dev->stats.poll_broken)
+        usleep_range(10000, 11000);
+    return 0;
 }
 
 /*
- * Flash write with automatic sector erase
- * This function erases the necessary sectors before writing
- * offset: offset within Flash region (relative to FLASH_START_ADDR)
+ * Program up to one page: fill the buffer window in FLASH_FILL_CHUNK
+ * byte pieces and issue the program subcommand, all in one
+ * multi-message transfer
  */
-static int flash_write_with_erase(struct myblk_device *dev, loff_t offset, 
+static int flash_i2c_program(struct myblk_device *dev, uint32_t flash_addr,
     const uint8_t *data, uint32_t bytes)
 {
-    int ret = 0;
-    uint32_t start_sector = offset / FLASH_SECTOR_SIZE;
-    uint32_t end_sector = (offset + bytes - 1) / FLASH_SECTOR_SIZE;
+    uint8_t reg_addr[2] = {0};
+    uint8_t buf[6] = {0};
+    struct i2c_msg msgs[FLASH_FILL_MSGS + 1];
+    uint8_t *tx = dev->xfer_buf;
+    uint32_t flash_offset;      /* Bytes filled into the page buffer */
+    uint32_t chunk_size;
+    int n = 0, ret;
+
+    for (flash_offset = 0; flash_offset < bytes; flash_offset += chunk_size) {
+        chunk_size = min_t(uint32_t, bytes - flash_offset, FLASH_FILL_CHUNK);
+        reg_addr[0] = 0x00;
+        reg_addr[1] = flash_offset & 0xFF;
+        flash_i2c_prep_write(dev, &msgs[n++], tx, reg_addr, sizeof(reg_addr),
+                             data + flash_offset, chunk_size);
+        tx += sizeof(reg_addr) + chunk_size;
+    }
+
+    /* Serial NOR Flash Write Subcommand */
+    reg_addr[0] = 0x80;
+    reg_addr[1] = 0x00;
+
+    buf[0] = 0x02;  /* Write command */
+    buf[1] = 0x00;
+    buf[2] = (flash_addr >> 16) & 0xFF;
+    buf[3] = (flash_addr >> 8) & 0xFF;
+    buf[4] = flash_addr & 0xFF;
+    buf[5] = 0x5a;  /* Execute subcommand */
+    flash_i2c_prep_write(dev, &msgs[n++], tx, reg_addr, sizeof(reg_addr),
+                         buf, sizeof(buf));
+
+    ret = flash_i2c_transfer(dev, msgs, n);
+    if (ret < 0) {
+        printk(KERN_ERR "flashblk: Flash page program at 0x%06X failed\n", flash_addr);
+        return ret;
+    }
+    return flash_wait_op(dev, FLASH_OP_PROGRAM);
+}
+
+/* Erase one sector - based on sensor_flash_sector implementation */
+static int flash_i2c_erase(struct myblk_device *dev, uint32_t sector_id)
+{
+    int ret;
+    uint8_t reg_addr[2] = {0};
+    uint8_t reg_size = 0;
+    uint8_t buf[6] = {0};
+    uint8_t buf_size = 0;
+
+    /* Erase sector command */
+    reg_addr[0] = 0x80;
+    reg_addr[1] = 0x00;
+    reg_size = 2;
+
+    buf[0] = 0x03;  /* Erase command */
+    buf[1] = 0x00;
+    buf[2] = sector_id >> 4;
+    buf[3] = (sector_id & 0xf) << 4;
+    buf[4] = 0x00;
+    buf[5] = 0x5a;  /* Execute subcommand */
+    buf_size = 6;
+
+    ret = flash_i2c_write_retry(dev, reg_addr, reg_size, buf, buf_size);
+    if (ret < 0) {
+        printk(KERN_ERR "flashblk: Flash erase command failed\n");
+        return ret;
+    }
+    return flash_wait_op(dev, FLASH_OP_ERASE);  /* Wait for erase to complete */
+}
+
+/*
+ * Flash emulator (provider=emul)
+ * A RAM-backed NOR with the semantics of the real part: erase sets a
+ * sector to 0xFF, programming can only clear bits and stays within one
+ * page, nothing works while the flash is locked. Every operation sleeps
+ * for the bus time of the bytes the I2C protocol would move plus the
+ * operation latency, both taken from the emul_* parameters, so the flash
+ * path can be measured without the hardware. All zero runs untimed.
+ */
+#define FLASH_EMUL_SIZE (FLASH_MAX_SECTORS * FLASH_SECTOR_SIZE)
+
+/* Spend the simulated time of one operation, op FLASH_OP_NR for mode commands */
+static void flash_emul_wait(struct myblk_device *dev, uint32_t bus_bytes,
+    enum flash_op op, uint32_t op_us)
+{
+    struct flash_emul *e = dev->emul;
+    u64 bus_us = div_u64((u64)bus_bytes * emul_byte_ns, 1000);
+    ktime_t start;
+
+    e->bus_bytes += bus_bytes;
+    if (bus_us)
+        fsleep(bus_us);
+    start = ktime_get();
+    if (op_us)
+        fsleep(op_us);
+    e->busy_us += bus_us + op_us;
+    if (op < FLASH_OP_NR)
+        flash_op_account(&dev->stats.ops[op], ktime_us_delta(ktime_get(), start));
+}
+
+static int flash_emul_check(struct myblk_device *dev, uint32_t addr, uint32_t bytes)
+{
+    struct flash_emul *e = dev->emul;
+
+    if (!e->unlocked) {
+        e->protocol_errors++;
+        printk(KERN_ERR "flashblk: emul: Access at 0x%06X while locked\n", addr);
+        return -EIO;
+    }
+    if (addr >= FLASH_EMUL_SIZE || bytes > FLASH_EMUL_SIZE - addr) {
+        e->protocol_errors++;
+        printk(KERN_ERR "flashblk: emul: Access at 0x%06X+%u out of range\n", addr, bytes);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int flash_emul_unlock(struct myblk_device *dev)
+{
+    /* Two mode commands, each a 16-bit register and one data byte */
+    flash_emul_wait(dev, 2 * 3, FLASH_OP_NR, 2 * emul_mode_us);
+    dev->emul->unlocked = true;
+    return 0;
+}
+
+static void flash_emul_lock(struct myblk_device *dev)
+{
+    flash_emul_wait(dev, 3, FLASH_OP_NR, emul_mode_us);
+    dev->emul->unlocked = false;
+}
+
+static int flash_emul_read(struct myblk_device *dev, uint32_t flash_addr,
+    uint8_t *data, uint32_t bytes)
+{
+    uint32_t done, chunk;
+    int ret;
+
+    ret = flash_emul_check(dev, flash_addr, bytes);
+    if (ret < 0)
+        return ret;
+    for (done = 0; done < bytes; done += chunk) {
+        chunk = min_t(uint32_t, bytes - done, FLASH_PAGE_SIZE);
+        /* Read subcommand, then the buffer window in one transfer */
+        flash_emul_wait(dev, 3 + 5 + 2 + chunk, FLASH_OP_READ, emul_read_us);
+        memcpy(data + done, dev->emul->data + flash_addr + done, chunk);
+        dev->stats.read_xfers++;
+    }
+    return 0;
+}
+
+static int flash_emul_program(struct myblk_device *dev, uint32_t flash_addr,
+    const uint8_t *data, uint32_t bytes)
+{
+    struct flash_emul *e = dev->emul;
+    u8 *p = e->data + flash_addr;
+    bool conflict = false;
+    uint32_t i;
+    int ret;
+
+    ret = flash_emul_check(dev, flash_addr, bytes);
+    if (ret < 0)
+        return ret;
+    if (flash_addr % FLASH_PAGE_SIZE + bytes > FLASH_PAGE_SIZE) {
+        e->protocol_errors++;
+        printk(KERN_ERR "flashblk: emul: Program at 0x%06X+%u crosses a page\n",
+               flash_addr, bytes);
+        return -EIO;
+    }
+
+    /* Programming only clears bits, setting one needs an erase first */
+    for (i = 0; i < bytes; i++) {
+        if (data[i] & ~p[i])
+            conflict = true;
+        p[i] &= data[i];
+    }
+    if (conflict)
+        e->bit_conflicts++;
+
+    /* Buffer window fill messages plus the program subcommand */
+    flash_emul_wait(dev, bytes + 2 * DIV_ROUND_UP(bytes, FLASH_FILL_CHUNK) + 2 + 6,
+                    FLASH_OP_PROGRAM, emul_program_us);
+    return 0;
+}
+
+static int flash_emul_erase(struct myblk_device *dev, uint32_t sector_id)
+{
+    struct flash_emul *e = dev->emul;
+    int ret;
+
+    ret = flash_emul_check(dev, sector_id * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+    if (ret < 0)
+        return ret;
+    memset(e->data + sector_id * FLASH_SECTOR_SIZE, 0xff, FLASH_SECTOR_SIZE);
+    e->erase_count[sector_id]++;
+    flash_emul_wait(dev, 2 + 6, FLASH_OP_ERASE, emul_erase_us);
+    return 0;
+}
+
+static int flash_emul_bind(struct myblk_device *dev)
+{
+    struct flash_emul *e;
+
+    e = kzalloc(sizeof(*e), GFP_KERNEL);
+    if (!e)
+        return -ENOMEM;
+    e->data = vmalloc(FLASH_EMUL_SIZE);
+    if (!e->data) {
+        kfree(e);
+        return -ENOMEM;
+    }
+    /* A new part comes erased */
+    memset(e->data, 0xff, FLASH_EMUL_SIZE);
+    dev->emul = e;
+    return 0;
+}
+
+static void flash_emul_unbind(struct myblk_device *dev)
+{
+    if (!dev->emul)
+        return;
+    vfree(dev->emul->data);
+    kfree(dev->emul);
+    dev->emul = NULL;
+}
+
+static const struct flash_provider flash_providers[] = {
+    {
+        .name = "i2c",
+        .size = FLASH_CHIP_SIZE,
+        .bind = flash_i2c_bind,
+        .unbind = flash_i2c_unbind,
+        .unlock = flash_i2c_unlock,
+        .lock = flash_i2c_lock,
+        .read = flash_i2c_read,
+        .program = flash_i2c_program,
+        .erase = flash_i2c_erase,
+    },
+    {
+        .name = "emul",
+        .size = FLASH_EMUL_SIZE,
+        .bind = flash_emul_bind,
+        .unbind = flash_emul_unbind,
+        .unlock = flash_emul_unlock,
+        .lock = flash_emul_lock,
+        .read = flash_emul_read,
+        .program = flash_emul_program,
+        .erase = flash_emul_erase,
+    },
+};
+
+/* Select and bind the provider named by the provider parameter */
+static int flash_bind(struct myblk_device *dev)
+{
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(flash_providers); i++)
+        if (sysfs_streq(provider, flash_providers[i].name))
+            dev->prov = &flash_providers[i];
+    if (!dev->prov) {
+        printk(KERN_ERR "flashblk: Unknown flash provider '%s'\n", provider);
+        return -EINVAL;
+    }
+
+    dev->sector_buf = kmalloc(2 * FLASH_SECTOR_SIZE, GFP_KERNEL);
+    if (!dev->sector_buf)
+        return -ENOMEM;
+    ret = dev->prov->bind(dev);
+    if (ret < 0) {
+        kfree(dev->sector_buf);
+        dev->sector_buf = NULL;
+        return ret;
+    }
+    printk(KERN_INFO "flashblk: Flash provider: %s\n", dev->prov->name);
+    return 0;
+}
+
+static void flash_unbind(struct myblk_device *dev)
+{
+    if (dev->prov)
+        dev->prov->unbind(dev);
+    kfree(dev->sector_buf);
+    dev->sector_buf = NULL;
+}
+
+/*
+ * Raw flash read operation - reads from absolute flash address
+ * in one session of the provider
+ */
+static int flash_read_raw(struct myblk_device *dev, uint32_t flash_addr,
+    uint8_t *data, uint32_t bytes)
+{
+    u64 start = ktime_get_ns();
+    int ret;
+
+    printk(KERN_DEBUG "flashblk: Reading %u bytes from flash addr 0x%06X\n",
+           bytes, flash_addr);
+
+    ret = flash_session_begin(dev);
+    if (ret < 0)
+        return ret;
+    ret = dev->prov->read(dev, flash_addr, data, bytes);
+    flash_session_end(dev, ret);
+
+    dev->stats.read_sessions++;
+    if (ret == 0)
+        dev->stats.read_bytes += bytes;
+    dev->stats.read_ns += ktime_get_ns() - start;
+    return ret;
+}
+
+/*
+ * Flash mirror
+ * Reads fill whole FLASH_PAGE_SIZE pages; erase and program apply the
+ * same NOR semantics to the mirrored copy (erase sets 0xFF, programming
+ * can only clear bits) so valid pages never need to be read again.
+ * Pages touched by a failed operation are dropped from the mirror.
+ */
+
+/* Load the pages of [offset, offset + bytes) that are not mirrored yet */
+static int mirror_fill(struct myblk_device *dev, uint32_t offset, uint32_t bytes)
+{
+    struct flash_mirror *m = dev->mirror;
+    uint32_t page = offset / FLASH_PAGE_SIZE;
+    uint32_t last = (offset + bytes - 1) / FLASH_PAGE_SIZE;
+    uint32_t end;
+    int ret;
+
+    while (page <= last) {
+        if (test_bit(page, m->valid)) {
+            page++;
+            continue;
+        }
+        /* Read each run of missing pages as one sequential stream */
+        for (end = page + 1; end <= last && !test_bit(end, m->valid); end++)
+            ;
+        ret = flash_read_raw(dev, FLASH_START_ADDR + page * FLASH_PAGE_SIZE,
+                             m->data + page * FLASH_PAGE_SIZE,
+                             (end - page) * FLASH_PAGE_SIZE);
+        if (ret < 0)
+            return ret;
+        bitmap_set(m->valid, page, end - page);
+        m->fills += end - page;
+        page = end;
+    }
+    return 0;
+}
+
+static int flash_cached_read(struct myblk_device *dev, uint32_t flash_addr,
+    uint8_t *data, uint32_t bytes)
+{
+    struct flash_mirror *m = dev->mirror;
+    uint32_t offset = flash_addr - FLASH_START_ADDR;
+    uint32_t pages;
+    u64 fills;
+    int ret;
+
+    if (!m || offset + bytes > FLASH_DATA_SIZE)
+        return flash_read_raw(dev, flash_addr, data, bytes);
+    if (!bytes)
+        return 0;
+
+    pages = (offset + bytes - 1) / FLASH_PAGE_SIZE - offset / FLASH_PAGE_SIZE + 1;
+    fills = m->fills;
+    ret = mirror_fill(dev, offset, bytes);
+    if (ret < 0)
+        return ret;
+    m->hits += pages - (m->fills - fills);
+
+    memcpy(data, m->data + offset, bytes);
+    return 0;
+}
+
+/* Drop pages overlapping [offset, offset + bytes) from the mirror */
+static void mirror_invalidate(struct flash_mirror *m, uint32_t offset, uint32_t bytes)
+{
+    uint32_t first = offset / FLASH_PAGE_SIZE;
+    uint32_t last = (offset + bytes - 1) / FLASH_PAGE_SIZE;
+
+    bitmap_clear(m->valid, first, last - first + 1);
+}
+
+static void mirror_erase(struct myblk_device *dev, uint32_t sector_id, int result)
+{
+    struct flash_mirror *m = dev->mirror;
+    uint32_t offset = sector_id * FLASH_SECTOR_SIZE;
+
+    if (!m)
+        return;
+    if (result < 0) {
+        mirror_invalidate(m, offset, FLASH_SECTOR_SIZE);
+        return;
+    }
+    memset(m->data + offset, 0xff, FLASH_SECTOR_SIZE);
+    bitmap_set(m->valid, offset / FLASH_PAGE_SIZE, FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE);
+}
+
+static void mirror_program(struct myblk_device *dev, uint32_t offset,
+    const uint8_t *data, uint32_t bytes, int result)
+{
+    struct flash_mirror *m = dev->mirror;
+    uint32_t i;
+
+    if (!m || !bytes || offset + bytes > FLASH_DATA_SIZE)
+        return;
+    if (result < 0) {
+        mirror_invalidate(m, offset, bytes);
+        return;
+    }
+    /* Invalid pages are left alone, they get filled on the next read */
+    for (i = 0; i < bytes; i++)
+        m->data[offset + i] &= data[i];
+}
+
+/*
+ * Warm-up thread: streams the flash into the mirror one erase sector per
+ * lock hold at load. Requests for pages not loaded yet fill them on
+ * demand; the thread steps aside while any request waits for the lock.
+ */
+static int mirror_warmup_thread(void *arg)
+{
+    struct myblk_device *dev = arg;
+    struct flash_mirror *m = dev->mirror;
     uint32_t sector;
+    int ret;
 
-    printk(KERN_INFO "flashblk: Writing %u bytes to flash offset 0x%llx (sectors %u-%u)\n", 
-           bytes, offset, start_sector, end_sector);
+    for (sector = 0; sector < FLASH_MAX_SECTORS && !kthread_should_stop(); sector++) {
+        while (atomic_read(&dev->io_waiting) && !kthread_should_stop())
+            usleep_range(1000, 2000);
 
-    /* Erase affected sectors first */
-    for (sector = start_sector; sector <= end_sector; sector++) {
-        ret = flash_erase_sector(dev, sector);
+        mutex_lock(&dev->lock);
+        ret = mirror_fill(dev, sector * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+        mutex_unlock(&dev->lock);
         if (ret < 0) {
-            printk(KERN_ERR "flashblk: Failed to erase sector %u\n", sector);
-            return ret;
+            printk(KERN_WARNING "flashblk: Warm-up of sector %u failed: %d\n",
+                   sector, ret);
+            m->warm_errors++;
         }
     }
 
-    /* Now write the data using the existing flash_write function */
-    ret = flash_write(dev, offset, data, bytes);
-    
+    m->warm_ms = ktime_ms_delta(ktime_get(), m->warm_start);
+    printk(KERN_INFO "flashblk: Flash mirror warm-up finished in %lld ms (%u errors)\n",
+           m->warm_ms, m->warm_errors);
+
+    /* Stay around until kthread_stop() at unload */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/*
+ * Flash erase sector operation
+ * sector_id: sector number to erase (0-127)
+ */
+static int flash_erase_sector(struct myblk_device *dev, uint32_t sector_id)
+{
+    int ret = 0;
+
+    if (sector_id >= FLASH_MAX_SECTORS) {
+        printk(KERN_ERR "flashblk: Invalid sector_id %u (must be 0-%d)\n", sector_id, FLASH_MAX_SECTORS - 1);
+        return -EINVAL;
+    }
+
+    printk(KERN_DEBUG "flashblk: Erasing flash sector %u\n", sector_id);
+
+    ret = flash_session_begin(dev);
+    if (ret < 0)
+        goto out;
+    ret = dev->prov->erase(dev, sector_id);
+    flash_session_end(dev, ret);
+out:
+    mirror_erase(dev, sector_id, ret);
+    if (ret < 0)
+        clear_bit(sector_id, dev->pool.erased);
+    else
+        set_bit(sector_id, dev->pool.erased);
     return ret;
 }
 
 /*
- * Hybrid read operation with new layout: RAM first, then Flash
- * Device layout: [RAM: 0 - RAM_DATA_SIZE] [Flash: RAM_DATA_SIZE - MYBLK_TOTAL_SIZE]
+ * Flash write operation
+ * offset is relative to block device start (within FLASH region)
+ * Programs the range page by page, the flash must have been erased
  */
-static int hybrid_read(struct myblk_device *dev, loff_t offset,
-    uint8_t *data, uint32_t bytes)
+static int flash_write(struct myblk_device *dev, loff_t offset, const uint8_t *data, uint32_t bytes)
 {
     int ret = 0;
-    
-    if (offset < RAM_DATA_SIZE) {
-        /* Read from RAM region */
-        uint32_t ram_bytes = bytes;
-        if (offset + bytes > RAM_DATA_SIZE) {
-            ram_bytes = RAM_DATA_SIZE - offset;
-        }
-        memcpy(data, dev->ram_buf + offset, ram_bytes);
-        
-        /* If read spans into Flash region, read Flash part too */
-        if (ram_bytes < bytes) {
-            uint32_t flash_offset = 0;
-            uint32_t flash_bytes = bytes - ram_bytes;
-            uint32_t flash_addr = FLASH_START_ADDR + flash_offset;
-            
-            ret = flash_read_raw(dev, flash_addr, data + ram_bytes, flash_bytes);
-            if (ret < 0) return ret;
-        }
-    } else {
-        /* Read from Flash region */
-        uint32_t flash_offset = offset - RAM_DATA_SIZE;
-        uint32_t flash_addr = FLASH_START_ADDR + flash_offset;
-        
-        if (flash_offset + bytes > FLASH_DATA_SIZE) {
-            bytes = FLASH_DATA_SIZE - flash_offset;
-        }
-        ret = flash_read_raw(dev, flash_addr, data, bytes);
+    uint32_t flash_addr = FLASH_START_ADDR + offset;
+    uint32_t page_room;         /* Bytes up to the end of the current page */
+    uint32_t page_bytes;
+    uint32_t remaining = bytes;
+    uint32_t data_offset = 0;
+
+    printk(KERN_DEBUG "flashblk: Writing %u bytes to flash offset 0x%llx (addr 0x%06X)\n",
+           bytes, offset, flash_addr);
+
+    ret = flash_session_begin(dev);
+    if (ret < 0)
+        goto out;
+
+    page_room = FLASH_PAGE_SIZE - (flash_addr % FLASH_PAGE_SIZE);
+    while (remaining > 0) {
+        page_bytes = min(remaining, page_room);
+        ret = dev->prov->program(dev, flash_addr, data + data_offset, page_bytes);
+        if (ret < 0)
+            break;
+
+        /* Move to next page */
+        flash_addr += page_bytes;
+        data_offset += page_bytes;
+        remaining -= page_bytes;
+        page_room = FLASH_PAGE_SIZE;
     }
+
+    flash_session_end(dev, ret);
+out:
+    mirror_program(dev, offset, data, bytes, ret);
+    if (bytes)
+        bitmap_clear(dev->pool.erased, offset / FLASH_SECTOR_SIZE,
+                     (offset + bytes - 1) / FLASH_SECTOR_SIZE - offset / FLASH_SECTOR_SIZE + 1);
     return ret;
 }
 
 /*
- * Hybrid write operation with new layout: RAM first (writable), then Flash (writable with erase)
- * Device layout: [RAM: 0 - RAM_DATA_SIZE] [Flash: RAM_DATA_SIZE - MYBLK_TOTAL_SIZE]
+ * Flash write with automatic sector erase
+ * offset: offset within Flash region (relative to FLASH_START_ADDR)
+ * Every affected sector is merged with its current contents and only
+ * gets the work NOR semantics require: nothing when the data is
+ * unchanged, a program without erase when the update only clears bits,
+ * otherwise an erase. Only the 256-byte pages that differ from what the
+ * flash holds afterwards are programmed. The current contents come from
+ * the pre-erase pool or the mirror; without either a whole-sector write
+ * skips the comparison.
  */
-static int hybrid_write(struct myblk_device *dev, loff_t offset,
+static int flash_write_with_erase(struct myblk_device *dev, loff_t offset,
     const uint8_t *data, uint32_t bytes)
 {
-    int ret = 0;
-    
-    if (offset < RAM_DATA_SIZE) {
-        /* Write to RAM region */
-        uint32_t ram_bytes = bytes;
-        if (offset + bytes > RAM_DATA_SIZE) {
-            /* Write spans both RAM and Flash regions */
-            ram_bytes = RAM_DATA_SIZE - offset;
-            printk(KERN_DEBUG "flashblk: Write spans RAM and Flash regions\n");
-        }
-        memcpy(dev->ram_buf + offset, data, ram_bytes);
-        
-        /* If write continues into Flash region */
-        if (ram_bytes < bytes) {
-            uint32_t flash_offset = 0;
-            uint32_t flash_bytes = bytes - ram_bytes;
-            ret = flash_write_with_erase(dev, flash_offset, data + ram_bytes, flash_bytes);
+    uint8_t *old = dev->sector_buf;
+    uint8_t *new = dev->sector_buf + FLASH_SECTOR_SIZE;
+    uint32_t sector, soff, len, page, i;
+    bool known, erase;
+    int ret;
+
+    printk(KERN_INFO "flashblk: Writing %u bytes to flash offset 0x%llx (sectors %u-%u)\n",
+           bytes, offset, (uint32_t)(offset / FLASH_SECTOR_SIZE),
+           (uint32_t)((offset + bytes - 1) / FLASH_SECTOR_SIZE));
+
+    while (bytes > 0) {
+        sector = offset / FLASH_SECTOR_SIZE;
+        soff = offset % FLASH_SECTOR_SIZE;
+        len = min_t(uint32_t, bytes, FLASH_SECTOR_SIZE - soff);
+
+        /* Partial writes always need the rest of the sector */
+        known = dev->mirror || len < FLASH_SECTOR_SIZE;
+        if (test_bit(sector, dev->pool.erased)) {
+            memset(old, 0xff, FLASH_SECTOR_SIZE);
+            memcpy(new, old, FLASH_SECTOR_SIZE);
+            known = true;
+            dev->pool.hits++;
+        } else if (known) {
+            ret = flash_cached_read(dev, FLASH_START_ADDR + sector * FLASH_SECTOR_SIZE,
+                                    old, FLASH_SECTOR_SIZE);
+            if (ret < 0)
+                return ret;
+            memcpy(new, old, FLASH_SECTOR_SIZE);
+        }
+        memcpy(new + soff, data, len);
+
+        /* Erase only if some bit has to go from 0 to 1 */
+        erase = !known;
+        for (i = 0; known && i < FLASH_SECTOR_SIZE; i++) {
+            if ((old[i] & new[i]) != new[i]) {
+                erase = true;
+                break;
+            }
+        }
+
+        if (erase) {
+            ret = flash_erase_sector(dev, sector);
             if (ret < 0) {
-                printk(KERN_ERR "flashblk: Flash write failed\n");
+                printk(KERN_ERR "flashblk: Failed to erase sector %u\n", sector);
                 return ret;
             }
+        } else {
+            dev->stats.erases_skipped++;
         }
-        return 0;
-    } else {
-        /* Write to Flash region */
-        uint32_t flash_offset = offset - RAM_DATA_SIZE;
-        if (flash_offset + bytes > FLASH_DATA_SIZE) {
-            printk(KERN_WARNING "flashblk: Write beyond Flash region\n");
-            bytes = FLASH_DATA_SIZE - flash_offset;
+
+        for (page = 0; page < FLASH_SECTOR_SIZE; page += FLASH_PAGE_SIZE) {
+            /* After an erase blank pages are done, otherwise unchanged ones */
+            if (erase ? !memchr_inv(new + page, 0xff, FLASH_PAGE_SIZE) :
+                        !memcmp(new + page, old + page, FLASH_PAGE_SIZE)) {
+                dev->stats.pages_skipped++;
+                continue;
+            }
+            ret = flash_write(dev, sector * FLASH_SECTOR_SIZE + page,
+                              new + page, FLASH_PAGE_SIZE);
+            if (ret < 0)
+                return ret;
+            dev->stats.pages_programmed++;
         }
-        ret = flash_write_with_erase(dev, flash_offset, data, bytes);
-        return ret;
+
+        offset += len;
+        data += len;
+        bytes -= len;
     }
+
+    return 0;
+}
+
+/*
+ * Flash translation layer
+ * Writes go out of place into the open sector, so a 512-byte write costs
+ * two page programs plus a 4-byte header program instead of an erase.
+ * Stale copies are reclaimed by greedy garbage collection, and the sector
+ * to open is always the free one with the lowest erase count.
+ */
+static inline uint32_t ftl_slot_addr(uint32_t phys)
+{
+    return (phys / FTL_SLOTS_PER_SECTOR) * FLASH_SECTOR_SIZE + FLASH_PAGE_SIZE +
+           (phys % FTL_SLOTS_PER_SECTOR) * FTL_SLOT_SIZE;
+}
+
+/* Drop the mapping of a logical block */
+static void ftl_unmap(struct flash_ftl *f, uint32_t lba)
+{
+    u16 old = f->l2p[lba];
+
+    if (old == FTL_UNMAPPED)
+        return;
+    f->p2l[old] = FTL_UNMAPPED;
+    f->sectors[old / FTL_SLOTS_PER_SECTOR].valid--;
+    f->l2p[lba] = FTL_UNMAPPED;
+}
+
+/* Erase a sector and stamp its new erase count */
+static int ftl_erase(struct myblk_device *dev, uint32_t sector)
+{
+    struct flash_ftl *f = dev->ftl;
+    struct ftl_sector *s = &f->sectors[sector];
+    __le32 hdr[2];
+    int ret;
+
+    ret = flash_erase_sector(dev, sector);
+    if (ret < 0)
+        return ret;
+    f->erases++;
+    s->erase_count++;
+
+    hdr[0] = cpu_to_le32(FTL_MAGIC);
+    hdr[1] = cpu_to_le32(s->erase_count);
+    ret = flash_write(dev, sector * FLASH_SECTOR_SIZE, (uint8_t *)hdr, sizeof(hdr));
+    if (ret < 0) {
+        /* Header unknown, erase again before use */
+        s->state = FTL_SEC_DIRTY;
+        return ret;
+    }
+    memset(&f->owner[sector * FTL_SLOTS_PER_SECTOR], 0xff,
+           FTL_SLOTS_PER_SECTOR * sizeof(f->owner[0]));
+    if (s->state != FTL_SEC_DIRTY)
+        f->nr_free++;
+    s->state = FTL_SEC_FREE;
+    s->valid = 0;
+    s->next_slot = 0;
+    return 0;
+}
+
+/* Open the least worn free sector for writing */
+static int ftl_open_sector(struct myblk_device *dev)
+{
+    struct flash_ftl *f = dev->ftl;
+    struct ftl_header hdr;
+    int best = -1;
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < FLASH_MAX_SECTORS; i++) {
+        struct ftl_sector *s = &f->sectors[i];
+
+        if (s->state != FTL_SEC_FREE && s->state != FTL_SEC_DIRTY)
+            continue;
+        /* Prefer already erased sectors, then lower wear */
+        if (best < 0 ||
+            (s->state == FTL_SEC_FREE && f->sectors[best].state == FTL_SEC_DIRTY) ||
+            (s->state == f->sectors[best].state &&
+             s->erase_count < f->sectors[best].erase_count))
+            best = i;
+    }
+    if (best < 0)
+        return -ENOSPC;
+
+    if (f->sectors[best].state == FTL_SEC_DIRTY) {
+        ret = ftl_erase(dev, best);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* Magic and erase count are rewritten with the same value, which NOR allows */
+    hdr.magic = cpu_to_le32(FTL_MAGIC);
+    hdr.erase_count = cpu_to_le32(f->sectors[best].erase_count);
+    hdr.seq = cpu_to_le32(f->next_seq);
+    ret = flash_write(dev, best * FLASH_SECTOR_SIZE, (uint8_t *)&hdr,
+                      offsetof(struct ftl_header, lba));
+    if (ret < 0) {
+        f->sectors[best].state = FTL_SEC_DIRTY;
+        return ret;
+    }
+
+    f->sectors[best].state = FTL_SEC_OPEN;
+    f->sectors[best].seq = f->next_seq++;
+    f->sectors[best].next_slot = 0;
+    f->sectors[best].valid = 0;
+    f->nr_free--;
+    f->active = best;
+    return 0;
+}
+
+/* Append one logical block to the open sector */
+static int ftl_append(struct myblk_device *dev, uint32_t lba, const uint8_t *data)
+{
+    struct flash_ftl *f = dev->ftl;
+    struct ftl_sector *s;
+    uint32_t phys, slot;
+    __le32 entry;
+    int ret;
+
+    if (f->active < 0 ||
+        f->sectors[f->active].next_slot == FTL_SLOTS_PER_SECTOR) {
+        if (f->active >= 0)
+            f->sectors[f->active].state = FTL_SEC_CLOSED;
+        f->active = -1;
+        ret = ftl_open_sector(dev);
+        if (ret < 0)
+            return ret;
+    }
+
+    s = &f->sectors[f->active];
+    slot = s->next_slot++;   /* Consumed even if programming fails */
+    phys = f->active * FTL_SLOTS_PER_SECTOR + slot;
+
+    ret = flash_write(dev, ftl_slot_addr(phys), data, FTL_SLOT_SIZE);
+    if (ret < 0)
+        return ret;
+
+    /* The slot only becomes valid once its header entry is programmed */
+    entry = cpu_to_le32(FTL_ENTRY_LIVE | lba);
+    ret = flash_write(dev, f->active * FLASH_SECTOR_SIZE +
+                      offsetof(struct ftl_header, lba) + slot * sizeof(entry),
+                      (uint8_t *)&entry, sizeof(entry));
+    if (ret < 0)
+        return ret;
+    f->slot_programs++;
+
+    ftl_unmap(f, lba);
+    f->l2p[lba] = phys;
+    f->p2l[phys] = lba;
+    f->owner[phys] = lba;
+    s->valid++;
+    return 0;
+}
+
+/*
+ * Discard logical blocks [first, end): clear the header entry of every
+ * slot still naming one of them, so neither the current copy nor a stale
+ * older one is mapped again by ftl_rebuild(). NOR programs the entry to 0
+ * without an erase.
+ */
+static void ftl_discard(struct myblk_device *dev, uint32_t first, uint32_t end)
+{
+    struct flash_ftl *f = dev->ftl;
+    __le32 entry = 0;
+    uint32_t phys, lba;
+    int ret;
+
+    for (phys = 0; phys < FTL_NR_SLOTS; phys++) {
+        lba = f->owner[phys];
+        if (lba < first || lba >= end)
+            continue;
+        ret = flash_write(dev, (phys / FTL_SLOTS_PER_SECTOR) * FLASH_SECTOR_SIZE +
+                          offsetof(struct ftl_header, lba) +
+                          (phys % FTL_SLOTS_PER_SECTOR) * sizeof(entry),
+                          (uint8_t *)&entry, sizeof(entry));
+        if (ret < 0) {
+            printk(KERN_WARNING "flashblk: FTL discard of slot %u not persisted: %d\n",
+                   phys, ret);
+            continue;
+        }
+        f->owner[phys] = FTL_UNMAPPED;
+        f->discards++;
+    }
+    for (lba = first; lba < end; lba++)
+        ftl_unmap(f, lba);
+}
+
+/*
+ * Garbage collection: move the live slots of a victim sector to the open
+ * sector and erase it. The victim is the closed sector with the fewest
+ * live slots, unless the erase count spread grew beyond FTL_WEAR_DELTA;
+ * then the least worn closed sector is recycled so its cold data moves
+ * and the sector rejoins the allocation pool.
+ */
+static int ftl_gc(struct myblk_device *dev)
+{
+    struct flash_ftl *f = dev->ftl;
+    int victim = -1, coldest = -1;
+    u32 max_ec = 0;
+    uint32_t i, phys;
+    int ret;
+
+    for (i = 0; i < FLASH_MAX_SECTORS; i++) {
+        struct ftl_sector *s = &f->sectors[i];
+
+        max_ec = max(max_ec, s->erase_count);
+        if (s->state != FTL_SEC_CLOSED)
+            continue;
+        if (s->valid < FTL_SLOTS_PER_SECTOR &&
+            (victim < 0 || s->valid < f->sectors[victim].valid))
+            victim = i;
+        if (coldest < 0 || s->erase_count < f->sectors[coldest].erase_count)
+            coldest = i;
+    }
+
+    if (coldest >= 0 && max_ec - f->sectors[coldest].erase_count > FTL_WEAR_DELTA &&
+        f->nr_free > 1) {
+        victim = coldest;
+        f->wear_moves++;
+    }
+    if (victim < 0)
+        return -ENOSPC;
+
+    f->in_gc = true;
+    for (i = 0; i < FTL_SLOTS_PER_SECTOR; i++) {
+        phys = victim * FTL_SLOTS_PER_SECTOR + i;
+        if (f->p2l[phys] == FTL_UNMAPPED)
+            continue;
+        ret = flash_cached_read(dev, FLASH_START_ADDR + ftl_slot_addr(phys),
+                                f->gc_buf, FTL_SLOT_SIZE);
+        if (ret < 0)
+            goto out;
+        ret = ftl_append(dev, f->p2l[phys], f->gc_buf);
+        if (ret < 0)
+            goto out;
+    }
+
+    f->sectors[victim].state = FTL_SEC_DIRTY;
+    f->nr_free++;
+    ret = ftl_erase(dev, victim);
+    f->gc_runs++;
+out:
+    f->in_gc = false;
+    return ret;
+}
+
+/* Read logical blocks, unmapped blocks read as zeroes */
+static int ftl_read(struct myblk_device *dev, uint32_t offset,
+    uint8_t *data, uint32_t bytes)
+{
+    struct flash_ftl *f = dev->ftl;
+    uint32_t lba = offset / FTL_SLOT_SIZE;
+    int ret;
+
+    for (; bytes >= FTL_SLOT_SIZE; bytes -= FTL_SLOT_SIZE, lba++, data += FTL_SLOT_SIZE) {
+        if (f->l2p[lba] == FTL_UNMAPPED) {
+            memset(data, 0, FTL_SLOT_SIZE);
+            continue;
+        }
+        ret = flash_cached_read(dev, FLASH_START_ADDR + ftl_slot_addr(f->l2p[lba]),
+                                data, FTL_SLOT_SIZE);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* Write logical blocks out of place */
+static int ftl_write(struct myblk_device *dev, uint32_t offset,
+    const uint8_t *data, uint32_t bytes)
+{
+    struct flash_ftl *f = dev->ftl;
+    uint32_t lba = offset / FTL_SLOT_SIZE;
+    int ret;
+
+    for (; bytes >= FTL_SLOT_SIZE; bytes -= FTL_SLOT_SIZE, lba++, data += FTL_SLOT_SIZE) {
+        while (f->nr_free < FTL_GC_FREE_SECTORS && !f->in_gc) {
+            ret = ftl_gc(dev);
+            if (ret < 0)
+                return ret;
+        }
+        ret = ftl_append(dev, lba, data);
+        if (ret < 0)
+            return ret;
+        f->host_writes++;
+    }
+    return 0;
+}
+
+/*
+ * Rebuild the logical-to-physical map from the sector headers.
+ * When a block was written several times, the copy in the sector with the
+ * higher sequence number wins, and within a sector the later slot.
+ */
+static int ftl_rebuild(struct myblk_device *dev)
+{
+    struct flash_ftl *f = dev->ftl;
+    struct ftl_header hdr;
+    uint32_t i, j, mapped = 0;
+    int ret;
+
+    memset(f->l2p, 0xff, sizeof(f->l2p));
+    memset(f->p2l, 0xff, sizeof(f->p2l));
+    memset(f->owner, 0xff, sizeof(f->owner));
+    f->active = -1;
+    f->next_seq = 1;
+    f->nr_free = 0;
+
+    for (i = 0; i < FLASH_MAX_SECTORS; i++) {
+        struct ftl_sector *s = &f->sectors[i];
+
+        ret = flash_cached_read(dev, FLASH_START_ADDR + i * FLASH_SECTOR_SIZE,
+                                (uint8_t *)&hdr, sizeof(hdr));
+        if (ret < 0)
+            return ret;
+
+        memset(s, 0, sizeof(*s));
+        if (le32_to_cpu(hdr.magic) != FTL_MAGIC) {
+            /* Erased but never stamped, or foreign data */
+            s->state = memchr_inv(&hdr, 0xff, sizeof(hdr)) ? FTL_SEC_DIRTY : FTL_SEC_FREE;
+            f->nr_free++;
+            continue;
+        }
+
+        s->erase_count = le32_to_cpu(hdr.erase_count);
+        if (le32_to_cpu(hdr.seq) == FTL_LBA_NONE) {
+            s->state = FTL_SEC_FREE;
+            f->nr_free++;
+            continue;
+        }
+
+        /* Partially written sectors are closed too, their free slots wait for GC */
+        s->state = FTL_SEC_CLOSED;
+        s->seq = le32_to_cpu(hdr.seq);
+        f->next_seq = max(f->next_seq, s->seq + 1);
+
+        for (j = 0; j < FTL_SLOTS_PER_SECTOR; j++) {
+            uint32_t entry = le32_to_cpu(hdr.lba[j]);
+            uint32_t lba = entry & ~FTL_ENTRY_LIVE;
+            uint32_t phys = i * FTL_SLOTS_PER_SECTOR + j;
+            u16 cur;
+
+            /* Unwritten (lba 0xFFFF) or discarded */
+            if ((entry & FTL_ENTRY_LIVE) != FTL_ENTRY_LIVE || lba >= FTL_NR_LBAS)
+                continue;
+            f->owner[phys] = lba;
+            cur = f->l2p[lba];
+            if (cur != FTL_UNMAPPED) {
+                struct ftl_sector *cs = &f->sectors[cur / FTL_SLOTS_PER_SECTOR];
+                if (cs->seq > s->seq)
+                    continue;
+                ftl_unmap(f, lba);
+            }
+            f->l2p[lba] = phys;
+            f->p2l[phys] = lba;
+            s->valid++;
+        }
+    }
+
+    for (i = 0; i < FTL_NR_LBAS; i++)
+        if (f->l2p[i] != FTL_UNMAPPED)
+            mapped++;
+
+    printk(KERN_INFO "flashblk: FTL rebuilt: %u/%u blocks mapped, %u free sectors\n",
+           mapped, FTL_NR_LBAS, f->nr_free);
+    return 0;
+}
+
+/*
+ * Flash backend below the write-back cache: FTL or 1:1 mapping
+ * offset is relative to the start of the flash region
+ */
+static int flash_backend_read(struct myblk_device *dev, uint32_t offset,
+    uint8_t *data, uint32_t bytes)
+{
+    if (dev->ftl)
+        return ftl_read(dev, offset, data, bytes);
+    return flash_cached_read(dev, FLASH_START_ADDR + offset, data, bytes);
+}
+
+static int flash_backend_write(struct myblk_device *dev, uint32_t offset,
+    const uint8_t *data, uint32_t bytes)
+{
+    if (dev->ftl)
+        return ftl_write(dev, offset, data, bytes);
+    return flash_write_with_erase(dev, offset, data, bytes);
+}
+
+/*
+ * Write-back cache
+ * Each entry caches one 4KB erase block. Host writes only update the
+ * entry and mark it dirty; chunks never written stay invalid and are read
+ * from flash once at write-back, so a partial write costs no extra read
+ * while it sits in the cache. All functions run under dev->lock.
+ */
+static struct wb_entry *wb_lookup(struct flash_wb *wb, uint32_t block)
+{
+    unsigned int i;
+
+    for (i = 0; i < wb->nr; i++)
+        if (wb->entries[i].block == block)
+            return &wb->entries[i];
+    return NULL;
+}
+
+/* Chunk mask covering [boff, boff + len) of a block */
+static inline u8 wb_chunk_mask(uint32_t boff, uint32_t len)
+{
+    uint32_t first = boff / MYBLK_SECTOR_SIZE;
+    uint32_t last = (boff + len - 1) / MYBLK_SECTOR_SIZE;
+
+    return ((1U << (last + 1)) - 1) & ~((1U << first) - 1);
+}
+
+/*
+ * Write one dirty block back with a single erase. With the FTL nothing is
+ * erased in place, so only the valid chunks are written, one ftl_write()
+ * per contiguous run; unwritten and discarded slots stay unmapped.
+ */
+static int wb_writeback(struct myblk_device *dev, struct wb_entry *e)
+{
+    struct flash_wb *wb = dev->wb;
+    unsigned int idx = e - wb->entries;
+    uint32_t offset = e->block * WB_BLOCK_SIZE;
+    unsigned int i, end;
+    int ret;
+
+    if (!test_bit(idx, wb->dirty))
+        return 0;
+
+    if (dev->ftl) {
+        for (i = 0; i < WB_CHUNKS; i = end) {
+            if (!(e->valid & (1U << i))) {
+                end = i + 1;
+                continue;
+            }
+            for (end = i + 1; end < WB_CHUNKS && (e->valid & (1U << end)); end++)
+                ;
+            ret = ftl_write(dev, offset + i * MYBLK_SECTOR_SIZE,
+                            e->data + i * MYBLK_SECTOR_SIZE,
+                            (end - i) * MYBLK_SECTOR_SIZE);
+            if (ret < 0)
+                return ret;
+        }
+        clear_bit(idx, wb->dirty);
+        wb->writebacks++;
+        return 0;
+    }
+
+    /* Complete the block with the flash contents it did not overwrite */
+    if (e->valid != WB_ALL_VALID) {
+        ret = flash_backend_read(dev, offset, wb->fill_buf, WB_BLOCK_SIZE);
+        if (ret < 0)
+            return ret;
+        for (i = 0; i < WB_CHUNKS; i++)
+            if (!(e->valid & (1U << i)))
+                memcpy(e->data + i * MYBLK_SECTOR_SIZE,
+                       wb->fill_buf + i * MYBLK_SECTOR_SIZE, MYBLK_SECTOR_SIZE);
+        e->valid = WB_ALL_VALID;
+    }
+
+    ret = flash_backend_write(dev, offset, e->data, WB_BLOCK_SIZE);
+    if (ret < 0)
+        return ret;
+    clear_bit(idx, wb->dirty);
+    wb->writebacks++;
+    return 0;
+}
+
+/* Write back all dirty blocks, keeps going after errors */
+static int wb_flush_all(struct myblk_device *dev)
+{
+    struct flash_wb *wb = dev->wb;
+    unsigned int i;
+    int ret, err = 0;
+
+    if (!wb)
+        return 0;
+    for_each_set_bit(i, wb->dirty, wb->nr) {
+        ret = wb_writeback(dev, &wb->entries[i]);
+        if (ret < 0 && !err)
+            err = ret;
+    }
+    return err;
+}
+
+/* Write back the dirty blocks overlapping a flash region range */
+static int wb_flush_range(struct myblk_device *dev, uint32_t offset, uint32_t bytes)
+{
+    struct flash_wb *wb = dev->wb;
+    uint32_t block;
+    struct wb_entry *e;
+    int ret;
+
+    if (!wb || !bytes)
+        return 0;
+    for (block = offset / WB_BLOCK_SIZE;
+         block <= (offset + bytes - 1) / WB_BLOCK_SIZE; block++) {
+        e = wb_lookup(wb, block);
+        if (e) {
+            ret = wb_writeback(dev, e);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+/* Drop cached blocks lying entirely inside a discarded range */
+static void wb_discard(struct myblk_device *dev, uint32_t offset, uint32_t bytes)
+{
+    struct flash_wb *wb = dev->wb;
+    unsigned int i;
+
+    if (!wb)
+        return;
+    for (i = 0; i < wb->nr; i++) {
+        struct wb_entry *e = &wb->entries[i];
+
+        if (e->block < 0 || e->block * WB_BLOCK_SIZE < offset ||
+            (e->block + 1) * WB_BLOCK_SIZE > offset + bytes)
+            continue;
+        clear_bit(i, wb->dirty);
+        e->block = -1;
+        e->valid = 0;
+    }
+}
+
+/* Get the entry for a block, evicting the least recently used one */
+static struct wb_entry *wb_get(struct myblk_device *dev, uint32_t block)
+{
+    struct flash_wb *wb = dev->wb;
+    struct wb_entry *e = wb_lookup(wb, block);
+    struct wb_entry *victim = NULL;
+    unsigned int i;
+    int ret;
+
+    if (e)
+        return e;
+
+    for (i = 0; i < wb->nr; i++) {
+        e = &wb->entries[i];
+        if (e->block < 0) {
+            victim = e;
+            break;
+        }
+        if (!victim || time_before(e->last_used, victim->last_used))
+            victim = e;
+    }
+
+    if (victim->block >= 0) {
+        ret = wb_writeback(dev, victim);
+        if (ret < 0)
+            return ERR_PTR(ret);
+        wb->evictions++;
+    }
+    victim->block = block;
+    victim->valid = 0;
+    return victim;
+}
+
+static int wb_read(struct myblk_device *dev, uint32_t offset,
+    uint8_t *data, uint32_t bytes)
+{
+    struct flash_wb *wb = dev->wb;
+    struct wb_entry *e;
+    uint32_t boff, len, i;
+    u8 mask;
+    int ret;
+
+    wb->last_io = jiffies;
+    while (bytes > 0) {
+        boff = offset % WB_BLOCK_SIZE;
+        len = min(bytes, WB_BLOCK_SIZE - boff);
+        mask = wb_chunk_mask(boff, len);
+        e = wb_lookup(wb, offset / WB_BLOCK_SIZE);
+
+        if (e && (e->valid & mask) == mask) {
+            memcpy(data, e->data + boff, len);
+            e->last_used = jiffies;
+            wb->read_hits++;
+        } else {
+            ret = flash_backend_read(dev, offset, data, len);
+            if (ret < 0)
+                return ret;
+            /* Overlay chunks that are newer in the cache */
+            for (i = 0; e && i < WB_CHUNKS; i++) {
+                uint32_t cs = i * MYBLK_SECTOR_SIZE;
+                uint32_t from = max(cs, boff);
+                uint32_t to = min(cs + MYBLK_SECTOR_SIZE, boff + len);
+
+                if ((mask & e->valid & (1U << i)) && from < to)
+                    memcpy(data + from - boff, e->data + from, to - from);
+            }
+        }
+
+        offset += len;
+        data += len;
+        bytes -= len;
+    }
+    return 0;
+}
+
+static int wb_write(struct myblk_device *dev, uint32_t offset,
+    const uint8_t *data, uint32_t bytes)
+{
+    struct flash_wb *wb = dev->wb;
+    struct wb_entry *e;
+    uint32_t boff, len;
+    unsigned int idx;
+
+    wb->last_io = jiffies;
+    while (bytes > 0) {
+        boff = offset % WB_BLOCK_SIZE;
+        len = min(bytes, WB_BLOCK_SIZE - boff);
+
+        if (wb_lookup(wb, offset / WB_BLOCK_SIZE))
+            wb->write_hits++;
+        else
+            wb->write_misses++;
+        e = wb_get(dev, offset / WB_BLOCK_SIZE);
+        if (IS_ERR(e))
+            return PTR_ERR(e);
+
+        idx = e - wb->entries;
+        memcpy(e->data + boff, data, len);
+        e->valid |= wb_chunk_mask(boff, len);
+        e->last_used = jiffies;
+        if (!test_and_set_bit(idx, wb->dirty))
+            e->dirty_since = jiffies;
+        wb->block_writes++;
+
+        offset += len;
+        data += len;
+        bytes -= len;
+    }
+    return 0;
+}
+
+/*
+ * Flusher thread: writes back one block per lock hold and backs off
+ * while host requests wait for the lock, so they get in between the
+ * erases. Expired blocks are picked up again on the next poll.
+ */
+static int wb_flusher_thread(void *arg)
+{
+    struct myblk_device *dev = arg;
+    struct flash_wb *wb = dev->wb;
+    struct wb_entry *e;
+    unsigned int i;
+    bool idle, again;
+    int ret;
+
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(msecs_to_jiffies(WB_POLL_MS));
+
+        do {
+            again = false;
+            if (atomic_read(&dev->io_waiting))
+                break;
+            mutex_lock(&dev->lock);
+            idle = time_after_eq(jiffies, wb->last_io + msecs_to_jiffies(wb_idle_ms));
+            for_each_set_bit(i, wb->dirty, wb->nr) {
+                e = &wb->entries[i];
+                if (!idle && time_before(jiffies,
+                        e->dirty_since + msecs_to_jiffies(wb_expire_ms)))
+                    continue;
+                ret = wb_writeback(dev, e);
+                if (ret < 0)
+                    printk(KERN_ERR "flashblk: Write-back of block %d failed: %d\n",
+                           e->block, ret);
+                else
+                    again = true;
+                break;
+            }
+            mutex_unlock(&dev->lock);
+        } while (again && !kthread_should_stop());
+    }
+    return 0;
+}
+
+static int wb_init(struct myblk_device *dev)
+{
+    struct flash_wb *wb;
+    unsigned int i;
+
+    wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+    if (!wb)
+        return -ENOMEM;
+    wb->nr = wb_blocks;
+    wb->entries = kcalloc(wb->nr, sizeof(*wb->entries), GFP_KERNEL);
+    wb->dirty = bitmap_zalloc(wb->nr, GFP_KERNEL);
+    wb->blocks = vmalloc(wb->nr * WB_BLOCK_SIZE);
+    wb->fill_buf = kmalloc(WB_BLOCK_SIZE, GFP_KERNEL);
+    if (!wb->entries || !wb->dirty || !wb->blocks || !wb->fill_buf)
+        goto err_free;
+
+    for (i = 0; i < wb->nr; i++) {
+        wb->entries[i].block = -1;
+        wb->entries[i].data = wb->blocks + i * WB_BLOCK_SIZE;
+    }
+    wb->last_io = jiffies;
+    dev->wb = wb;
+
+    wb->flusher = kthread_run(wb_flusher_thread, dev, "flashblk_wb");
+    if (IS_ERR(wb->flusher)) {
+        dev->wb = NULL;
+        goto err_free;
+    }
+    return 0;
+
+err_free:
+    kfree(wb->fill_buf);
+    vfree(wb->blocks);
+    bitmap_free(wb->dirty);
+    kfree(wb->entries);
+    kfree(wb);
+    return -ENOMEM;
+}
+
+/* Stop the flusher, write everything back and free the cache */
+static void wb_destroy(struct myblk_device *dev)
+{
+    struct flash_wb *wb = dev->wb;
+    int ret;
+
+    if (!wb)
+        return;
+    kthread_stop(wb->flusher);
+
+    mutex_lock(&dev->lock);
+    ret = wb_flush_all(dev);
+    mutex_unlock(&dev->lock);
+    if (ret < 0)
+        printk(KERN_ERR "flashblk: Write-back on unload failed: %d\n", ret);
+
+    dev->wb = NULL;
+    kfree(wb->fill_buf);
+    vfree(wb->blocks);
+    bitmap_free(wb->dirty);
+    kfree(wb->entries);
+    kfree(wb);
+}
+
+/*
+ * Take the flash mutex for host I/O, counted so the background threads
+ * yield to waiting requests
+ */
+static void flash_lock(struct myblk_device *dev)
+{
+    atomic_inc(&dev->io_waiting);
+    mutex_lock(&dev->lock);
+    atomic_dec(&dev->io_waiting);
+}
+
+/*
+ * Flash region access, offset relative to the start of the flash region
+ */
+static int flash_region_read(struct myblk_device *dev, uint32_t offset,
+    uint8_t *data, uint32_t bytes)
+{
+    dev->pool.last_io = jiffies;
+    if (dev->wb)
+        return wb_read(dev, offset, data, bytes);
+    return flash_backend_read(dev, offset, data, bytes);
+}
+
+static int flash_region_write(struct myblk_device *dev, uint32_t offset,
+    const uint8_t *data, uint32_t bytes)
+{
+    dev->pool.last_io = jiffies;
+    if (!dev->ftl && bytes)
+        bitmap_clear(dev->pool.free, offset / FLASH_SECTOR_SIZE,
+                     (offset + bytes - 1) / FLASH_SECTOR_SIZE - offset / FLASH_SECTOR_SIZE + 1);
+    if (dev->wb)
+        return wb_write(dev, offset, data, bytes);
+    return flash_backend_write(dev, offset, data, bytes);
+}
+
+/*
+ * Discard a flash region range. Only whole sectors (FTL: whole slots)
+ * are released; partially covered ones keep their data.
+ */
+static void flash_region_discard(struct myblk_device *dev, uint32_t offset,
+    uint32_t bytes)
+{
+    struct flash_pool *p = &dev->pool;
+    uint32_t first, end;
+
+    p->last_io = jiffies;
+    p->discards++;
+    wb_discard(dev, offset, bytes);
+
+    if (dev->ftl) {
+        first = DIV_ROUND_UP(offset, FTL_SLOT_SIZE);
+        end = (offset + bytes) / FTL_SLOT_SIZE;
+        if (end > first)
+            ftl_discard(dev, first, end);
+        return;
+    }
+    first = DIV_ROUND_UP(offset, FLASH_SECTOR_SIZE);
+    end = (offset + bytes) / FLASH_SECTOR_SIZE;
+    if (end > first)
+        bitmap_set(p->free, first, end - first);
+}
+
+/*
+ * Erase one sector for the pool: a discarded sector without the FTL, a
+ * dirty or fully invalidated sector with it.
+ * Returns 1 if a sector was erased, 0 if there is nothing to do.
+ */
+static int pool_erase_one(struct myblk_device *dev)
+{
+    struct flash_pool *p = &dev->pool;
+    struct flash_ftl *f = dev->ftl;
+    DECLARE_BITMAP(todo, FLASH_MAX_SECTORS);
+    uint32_t sector;
+    int ret;
+
+    if (f) {
+        for (sector = 0; sector < FLASH_MAX_SECTORS; sector++) {
+            struct ftl_sector *s = &f->sectors[sector];
+
+            if (s->state == FTL_SEC_DIRTY)
+                break;
+            if (s->state == FTL_SEC_CLOSED && !s->valid) {
+                s->state = FTL_SEC_DIRTY;
+                f->nr_free++;
+                break;
+            }
+        }
+        if (sector == FLASH_MAX_SECTORS)
+            return 0;
+        ret = ftl_erase(dev, sector);
+    } else {
+        bitmap_andnot(todo, p->free, p->erased, FLASH_MAX_SECTORS);
+        sector = find_first_bit(todo, FLASH_MAX_SECTORS);
+        if (sector >= FLASH_MAX_SECTORS)
+            return 0;
+        ret = flash_erase_sector(dev, sector);
+        /* Leave a failing sector to the write path */
+        if (ret < 0)
+            clear_bit(sector, p->free);
+    }
+    if (ret < 0) {
+        printk(KERN_ERR "flashblk: Pre-erase of sector %u failed: %d\n", sector, ret);
+        return ret;
+    }
+    p->pre_erases++;
+    return 1;
+}
+
+/*
+ * Eraser thread: runs at the lowest priority and erases one sector per
+ * lock hold once the flash region has been idle for pre_erase_idle_ms
+ */
+static int pool_eraser_thread(void *arg)
+{
+    struct myblk_device *dev = arg;
+    struct flash_pool *p = &dev->pool;
+    int ret;
+
+    set_user_nice(current, MAX_NICE);
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(msecs_to_jiffies(POOL_POLL_MS));
+
+        do {
+            if (atomic_read(&dev->io_waiting))
+                break;
+            ret = 0;
+            mutex_lock(&dev->lock);
+            if (time_after_eq(jiffies, p->last_io + msecs_to_jiffies(pre_erase_idle_ms)))
+                ret = pool_erase_one(dev);
+            mutex_unlock(&dev->lock);
+        } while (ret > 0 && !kthread_should_stop());
+    }
+    return 0;
+}
+
+/*
+ * RAM region snapshots
+ * Writes to the RAM region only set dirty bits, a checkpoint saves the
+ * dirty blocks as delta records so it costs what changed since the last
+ * one. On load the log is replayed into an index and the blocks stay in
+ * the file until the first access or until the snapshot thread gets to
+ * them; requests touching such blocks go through the flash worker, which
+ * may sleep.
+ */
+static void snap_set_range(unsigned long *map, loff_t offset, size_t bytes)
+{
+    unsigned long b;
+
+    for (b = offset / SNAP_BLOCK_SIZE; b <= (offset + bytes - 1) / SNAP_BLOCK_SIZE; b++)
+        set_bit(b, map);
+}
+
+/* Record a RAM region write, called after the data has been stored */
+static void snap_mark_dirty(struct myblk_device *dev, loff_t offset, size_t bytes)
+{
+    if (!dev->snap || !bytes)
+        return;
+    /* Pairs with test_and_clear_bit() in snap_save() */
+    smp_mb__before_atomic();
+    snap_set_range(dev->snap->dirty, offset, bytes);
+}
+
+/* True if part of the RAM region range has not been restored yet */
+static bool snap_pending(struct myblk_device *dev, loff_t offset, size_t bytes)
+{
+    struct ram_snap *s = dev->snap;
+    unsigned long first, last;
+
+    if (!s || offset >= RAM_DATA_SIZE || !bytes)
+        return false;
+    bytes = min_t(loff_t, bytes, RAM_DATA_SIZE - offset);
+    first = offset / SNAP_BLOCK_SIZE;
+    last = (offset + bytes - 1) / SNAP_BLOCK_SIZE;
+    return find_next_bit(s->pending, last + 1, first) <= last;
+}
+
+/* Read or write the whole buffer, -ENODATA on a short read */
+static int snap_io(struct ram_snap *s, void *buf, size_t len, loff_t pos, bool write)
+{
+    ssize_t ret;
+
+    if (write)
+        ret = kernel_write(s->file, buf, len, &pos);
+    else
+        ret = kernel_read(s->file, buf, len, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret != len)
+        return write ? -EIO : -ENODATA;
+    return 0;
+}
+
+/* Read one pending block back into the RAM region, snap->lock held */
+static int snap_restore_block(struct myblk_device *dev, unsigned long b)
+{
+    struct ram_snap *s = dev->snap;
+    u8 *dst = dev->ram_buf + b * SNAP_BLOCK_SIZE;
+    u32 len = s->len[b];
+    int ret;
+
+    if (!test_bit(b, s->pending))
+        return 0;
+    if (len == SNAP_BLOCK_SIZE) {
+        ret = snap_io(s, dst, len, s->off[b], false);
+    } else {
+        ret = snap_io(s, s->block_buf, len, s->off[b], false);
+        if (!ret && LZ4_decompress_safe((const char *)s->block_buf, (char *)dst,
+                                        len, SNAP_BLOCK_SIZE) != SNAP_BLOCK_SIZE)
+            ret = -EIO;
+    }
+    if (ret < 0) {
+        s->errors++;
+        printk(KERN_ERR "flashblk: Restoring RAM block %lu from snapshot failed: %d\n",
+               b, ret);
+        return ret;
+    }
+    /* The lockless RAM path may use the block from here on */
+    smp_mb__before_atomic();
+    clear_bit(b, s->pending);
+    s->restored++;
+    return 0;
+}
+
+/* Make sure a RAM region range is in memory, sleeps only if it is not */
+static int snap_restore_range(struct myblk_device *dev, loff_t offset, size_t bytes)
+{
+    struct ram_snap *s = dev->snap;
+    unsigned long b, last;
+    int ret = 0;
+
+    if (!s)
+        return 0;
+    if (!snap_pending(dev, offset, bytes)) {
+        /* Pairs with clear_bit() in snap_restore_block() */
+        smp_rmb();
+        return 0;
+    }
+    bytes = min_t(loff_t, bytes, RAM_DATA_SIZE - offset);
+    last = (offset + bytes - 1) / SNAP_BLOCK_SIZE;
+    mutex_lock(&s->lock);
+    for (b = offset / SNAP_BLOCK_SIZE; b <= last && !ret; b++)
+        ret = snap_restore_block(dev, b);
+    mutex_unlock(&s->lock);
+    return ret;
+}
+
+/*
+ * Add block b to the record in rec_buf at p, returns the bytes used.
+ * Zero blocks get an empty entry, or none with skip_zero. Blocks that
+ * do not compress are stored raw.
+ */
+static size_t snap_pack_block(struct myblk_device *dev, unsigned long b, u8 *p,
+    bool skip_zero)
+{
+    struct ram_snap *s = dev->snap;
+    struct snap_entry *e = (struct snap_entry *)p;
+    int len = 0;
+
+    /* Compress a stable copy, the RAM path may be writing to the block */
+    memcpy(s->block_buf, dev->ram_buf + b * SNAP_BLOCK_SIZE, SNAP_BLOCK_SIZE);
+    if (memchr_inv(s->block_buf, 0, SNAP_BLOCK_SIZE)) {
+        len = LZ4_compress_default((const char *)s->block_buf, (char *)(e + 1),
+                                   SNAP_BLOCK_SIZE, SNAP_BLOCK_SIZE - 1, s->lz4_wrk);
+        if (len <= 0) {
+            memcpy(e + 1, s->block_buf, SNAP_BLOCK_SIZE);
+            len = SNAP_BLOCK_SIZE;
+        }
+    } else if (skip_zero) {
+        return 0;
+    }
+    e->block = cpu_to_le32(b);
+    e->len = cpu_to_le32(len);
+    return sizeof(*e) + ALIGN(len, 4);
+}
+
+/* Write the record built in rec_buf at *pos and advance *pos */
+static int snap_write_record(struct ram_snap *s, loff_t *pos, u32 flags,
+    u32 nr, size_t bytes)
+{
+    struct snap_record *r = (struct snap_record *)s->rec_buf;
+    int ret;
+
+    r->magic = cpu_to_le32(SNAP_REC_MAGIC);
+    r->seq = cpu_to_le32(s->seq + 1);
+    r->flags = cpu_to_le32(flags);
+    r->nr = cpu_to_le32(nr);
+    r->bytes = cpu_to_le32(bytes);
+    r->crc = cpu_to_le32(crc32_le(~0, r + 1, bytes));
+    ret = snap_io(s, r, sizeof(*r) + bytes, *pos, true);
+    if (ret < 0)
+        return ret;
+    s->seq++;
+    *pos += sizeof(*r) + bytes;
+    s->blocks_saved += nr;
+    s->bytes_saved += sizeof(*r) + bytes;
+    return 0;
+}
+
+/*
+ * Save the dirty blocks as records starting at *pos, or every non-zero
+ * block as a new image with full. Blocks whose dirty bit got cleared
+ * are added to taken so a failed checkpoint can mark them again.
+ */
+static int snap_save(struct myblk_device *dev, loff_t *pos, bool full,
+    unsigned long *taken)
+{
+    struct ram_snap *s = dev->snap;
+    u8 *p = s->rec_buf + sizeof(struct snap_record);
+    u32 flags = full ? SNAP_REC_FULL : 0;
+    size_t bytes = 0, len;
+    unsigned long b;
+    u32 nr = 0;
+    int ret;
+
+    for (b = 0; b < SNAP_BLOCKS; b++) {
+        /* Pairs with smp_mb__before_atomic() in snap_mark_dirty() */
+        if (test_bit(b, s->dirty) && test_and_clear_bit(b, s->dirty))
+            __set_bit(b, taken);
+        else if (!full && !test_bit(b, s->mapped))
+            continue;
+        len = snap_pack_block(dev, b, p + bytes, full);
+        if (!len)
+            continue;
+        bytes += len;
+        if (++nr < SNAP_BATCH)
+            continue;
+        ret = snap_write_record(s, pos, flags, nr, bytes);
+        if (ret < 0)
+            return ret;
+        flags = 0;
+        nr = 0;
+        bytes = 0;
+    }
+    /* An image gets its first record even if the RAM region is all zero */
+    if (nr || flags)
+        return snap_write_record(s, pos, flags, nr, bytes);
+    return 0;
+}
+
+/* Point the header at the image starting at start and sync the file */
+static int snap_write_header(struct ram_snap *s, loff_t start, u32 seq)
+{
+    struct snap_header *h = (struct snap_header *)s->block_buf;
+    int ret;
+
+    memset(s->block_buf, 0, SNAP_HDR_SIZE);
+    h->magic = cpu_to_le32(SNAP_MAGIC);
+    h->version = cpu_to_le32(SNAP_VERSION);
+    h->block_size = cpu_to_le32(SNAP_BLOCK_SIZE);
+    h->nr_blocks = cpu_to_le32(SNAP_BLOCKS);
+    h->start = cpu_to_le64(start);
+    h->seq = cpu_to_le32(seq);
+    h->crc = cpu_to_le32(crc32_le(~0, h, offsetof(struct snap_header, crc)));
+    ret = snap_io(s, h, SNAP_HDR_SIZE, 0, true);
+    if (ret < 0)
+        return ret;
+    return vfs_fsync(s->file, 0);
+}
+
+/*
+ * Replace the log by a new image. It goes to the front of the file when
+ * the current image starts far enough in, else after the log. The old
+ * image stays valid until the header points at the new one.
+ */
+static int snap_compact(struct myblk_device *dev, unsigned long *taken)
+{
+    struct ram_snap *s = dev->snap;
+    u32 seq = s->seq + 1;
+    loff_t start, pos;
+    unsigned long b;
+    int ret;
+
+    /* The image is taken from RAM, read back what is still in the file */
+    for_each_set_bit(b, s->pending, SNAP_BLOCKS) {
+        ret = snap_restore_block(dev, b);
+        if (ret < 0)
+            return ret;
+    }
+
+    start = s->start >= SNAP_HDR_SIZE + SNAP_IMAGE_MAX ? SNAP_HDR_SIZE : s->end;
+    pos = start;
+    ret = snap_save(dev, &pos, true, taken);
+    if (!ret)
+        ret = vfs_fsync(s->file, 0);
+    if (!ret)
+        ret = snap_write_header(s, start, seq);
+    if (ret < 0)
+        return ret;
+    s->start = start;
+    s->end = pos;
+    s->compactions++;
+    /* The old log lies behind the new image, drop it */
+    if (start == SNAP_HDR_SIZE)
+        vfs_truncate(&s->file->f_path, pos);
+    return 0;
+}
+
+/* Save what changed since the last checkpoint, snap->lock held */
+static int snap_checkpoint_locked(struct myblk_device *dev)
+{
+    struct ram_snap *s = dev->snap;
+    DECLARE_BITMAP(taken, SNAP_BLOCKS);
+    ktime_t start = ktime_get();
+    u32 seq = s->seq;
+    loff_t pos = s->end;
+    unsigned long b;
+    int ret;
+
+    s->last_checkpoint = jiffies;
+    if (bitmap_empty(s->dirty, SNAP_BLOCKS) && bitmap_empty(s->mapped, SNAP_BLOCKS))
+        return 0;
+
+    bitmap_zero(taken, SNAP_BLOCKS);
+    if (s->end - s->start > SNAP_LOG_MAX) {
+        ret = snap_compact(dev, taken);
+    } else {
+        ret = snap_save(dev, &pos, false, taken);
+        if (!ret)
+            ret = vfs_fsync(s->file, 0);
+        if (!ret)
+            s->end = pos;
+    }
+    if (ret < 0) {
+        /* Records past the end are overwritten by the next attempt */
+        s->seq = seq;
+        for_each_set_bit(b, taken, SNAP_BLOCKS)
+            set_bit(b, s->dirty);
+        s->errors++;
+        printk(KERN_ERR "flashblk: RAM region checkpoint failed: %d\n", ret);
+        return ret;
+    }
+    s->checkpoints++;
+    s->last_ms = ktime_ms_delta(ktime_get(), start);
+    return 0;
+}
+
+static int snap_checkpoint(struct myblk_device *dev)
+{
+    int ret;
+
+    mutex_lock(&dev->snap->lock);
+    ret = snap_checkpoint_locked(dev);
+    mutex_unlock(&dev->snap->lock);
+    return ret;
+}
+
+/*
+ * Replay the log into the index: every block ends up with its newest
+ * copy, blocks holding data are marked pending. Replay stops at the
+ * first record that is torn, out of sequence or starts another image,
+ * a checkpoint or compaction cut short leaves nothing else behind.
+ */
+static int snap_load(struct myblk_device *dev)
+{
+    struct ram_snap *s = dev->snap;
+    struct snap_header *h = (struct snap_header *)s->block_buf;
+    struct snap_record *r = (struct snap_record *)s->rec_buf;
+    loff_t size = i_size_read(file_inode(s->file));
+    u32 seq, nr, bytes, i, b, len, records = 0;
+    struct snap_entry *e;
+    loff_t pos;
+    u8 *p;
+    int ret;
+
+    if (!size) {
+        s->start = s->end = SNAP_HDR_SIZE;
+        printk(KERN_INFO "flashblk: Created RAM region snapshot %s\n", snapshot);
+        return snap_write_header(s, SNAP_HDR_SIZE, 1);
+    }
+
+    ret = snap_io(s, h, sizeof(*h), 0, false);
+    if (ret < 0 || le32_to_cpu(h->magic) != SNAP_MAGIC ||
+        le32_to_cpu(h->crc) != crc32_le(~0, h, offsetof(struct snap_header, crc))) {
+        printk(KERN_ERR "flashblk: %s is not a RAM region snapshot\n", snapshot);
+        return ret < 0 && ret != -ENODATA ? ret : -EINVAL;
+    }
+    if (le32_to_cpu(h->version) != SNAP_VERSION ||
+        le32_to_cpu(h->block_size) != SNAP_BLOCK_SIZE ||
+        le32_to_cpu(h->nr_blocks) != SNAP_BLOCKS) {
+        printk(KERN_ERR "flashblk: Snapshot %s does not match this driver\n", snapshot);
+        return -EINVAL;
+    }
+
+    s->start = pos = le64_to_cpu(h->start);
+    seq = le32_to_cpu(h->seq);
+    for (;; seq++) {
+        ret = snap_io(s, r, sizeof(*r), pos, false);
+        if (ret < 0)
+            break;
+        nr = le32_to_cpu(r->nr);
+        bytes = le32_to_cpu(r->bytes);
+        if (le32_to_cpu(r->magic) != SNAP_REC_MAGIC || le32_to_cpu(r->seq) != seq ||
+            ((le32_to_cpu(r->flags) & SNAP_REC_FULL) && pos != s->start) ||
+            nr > SNAP_BATCH || bytes > SNAP_REC_MAX - sizeof(*r))
+            break;
+        ret = snap_io(s, r + 1, bytes, pos + sizeof(*r), false);
+        if (ret < 0)
+            break;
+        if (le32_to_cpu(r->crc) != crc32_le(~0, r + 1, bytes))
+            break;
+
+        if (le32_to_cpu(r->flags) & SNAP_REC_FULL)
+            bitmap_zero(s->pending, SNAP_BLOCKS);
+        p = (u8 *)(r + 1);
+        for (i = 0; i < nr; i++) {
+            e = (struct snap_entry *)p;
+            b = le32_to_cpu(e->block);
+            len = le32_to_cpu(e->len);
+            if (b >= SNAP_BLOCKS || len > SNAP_BLOCK_SIZE ||
+                p + sizeof(*e) + len > (u8 *)(r + 1) + bytes) {
+                printk(KERN_ERR "flashblk: Corrupt record %u in snapshot %s\n",
+                       seq, snapshot);
+                return -EINVAL;
+            }
+            s->off[b] = pos + sizeof(*r) + (p - (u8 *)(r + 1)) + sizeof(*e);
+            s->len[b] = len;
+            if (len)
+                set_bit(b, s->pending);
+            else
+                clear_bit(b, s->pending);
+            p += sizeof(*e) + ALIGN(len, 4);
+        }
+        pos += sizeof(*r) + bytes;
+        records++;
+    }
+    if (ret < 0 && ret != -ENODATA) {
+        printk(KERN_ERR "flashblk: Reading snapshot %s failed: %d\n", snapshot, ret);
+        return ret;
+    }
+
+    s->end = pos;
+    s->seq = seq - 1;
+    /* Drop a torn tail so it cannot line up with later records */
+    if (size > pos)
+        vfs_truncate(&s->file->f_path, pos);
+    printk(KERN_INFO "flashblk: Snapshot %s: %u records, %u blocks to restore\n",
+           snapshot, records, bitmap_weight(s->pending, SNAP_BLOCKS));
+    return 0;
+}
+
+/*
+ * Snapshot thread: restores the blocks still pending after load at the
+ * lowest priority, then checkpoints every snapshot_interval_ms
+ */
+static int snap_thread(void *arg)
+{
+    struct myblk_device *dev = arg;
+    struct ram_snap *s = dev->snap;
+    unsigned long b;
+    int ret;
+
+    set_user_nice(current, MAX_NICE);
+    while (!kthread_should_stop()) {
+        b = find_first_bit(s->pending, SNAP_BLOCKS);
+        if (b < SNAP_BLOCKS) {
+            mutex_lock(&s->lock);
+            ret = snap_restore_block(dev, b);
+            mutex_unlock(&s->lock);
+            if (!ret) {
+                cond_resched();
+                continue;
+            }
+        }
+
+        schedule_timeout_interruptible(msecs_to_jiffies(SNAP_POLL_MS));
+        if (snapshot_interval_ms &&
+            time_after_eq(jiffies, s->last_checkpoint + msecs_to_jiffies(snapshot_interval_ms)))
+            snap_checkpoint(dev);
+    }
+    return 0;
+}
+
+static void snap_destroy(struct myblk_device *dev)
+{
+    struct ram_snap *s = dev->snap;
+
+    if (!s)
+        return;
+    if (s->thread)
+        kthread_stop(s->thread);
+    if (s->wq)
+        destroy_workqueue(s->wq);
+    /* Final checkpoint, no requests are left */
+    if (s->file) {
+        snap_checkpoint(dev);
+        filp_close(s->file, NULL);
+    }
+    kfree(s->block_buf);
+    vfree(s->rec_buf);
+    vfree(s->lz4_wrk);
+    kfree(s);
+    dev->snap = NULL;
+}
+
+/* Open the snapshot file and replay its log, blocks are read lazily */
+static int snap_init(struct myblk_device *dev)
+{
+    struct ram_snap *s;
+    int ret;
+
+    s = kzalloc(sizeof(*s), GFP_KERNEL);
+    if (!s)
+        return -ENOMEM;
+    dev->snap = s;
+    mutex_init(&s->lock);
+    s->lz4_wrk = vmalloc(LZ4_MEM_COMPRESS);
+    s->rec_buf = vmalloc(SNAP_REC_MAX);
+    s->block_buf = kmalloc(SNAP_BLOCK_SIZE, GFP_KERNEL);
+    /* Unbound, so a RAM request waits for the file read only, never the flash */
+    s->wq = alloc_workqueue("flashblk_restore", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (!s->lz4_wrk || !s->rec_buf || !s->block_buf || !s->wq) {
+        ret = -ENOMEM;
+        goto out_destroy;
+    }
+
+    s->file = filp_open(snapshot, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(s->file)) {
+        ret = PTR_ERR(s->file);
+        s->file = NULL;
+        printk(KERN_ERR "flashblk: Failed to open snapshot %s: %d\n", snapshot, ret);
+        goto out_destroy;
+    }
+    ret = snap_load(dev);
+    if (ret < 0)
+        goto out_destroy;
+    s->last_checkpoint = jiffies;
+    return 0;
+
+out_destroy:
+    snap_destroy(dev);
+    return ret;
+}
+
+/*
+ * Flash part of a request, after the RAM part was copied by myblk_ram_copy()
+ * Device layout: [RAM: 0 - RAM_DATA_SIZE] [Flash: RAM_DATA_SIZE - MYBLK_TOTAL_SIZE]
+ * offset is relative to the start of the flash region, only this part takes dev->lock
+ */
+static int hybrid_read(struct myblk_device *dev, uint32_t offset,
+    uint8_t *data, uint32_t bytes)
+{
+    int ret;
+
+    if (offset + bytes > dev->flash_size) {
+        bytes = dev->flash_size - offset;
+    }
+    flash_lock(dev);
+    ret = flash_region_read(dev, offset, data, bytes);
+    mutex_unlock(&dev->lock);
+    return ret;
+}
+
+/*
+ * Flash part of a write, see hybrid_read()
+ * Flash region offsets, the write-back cache or the FTL handles erases
+ */
+static int hybrid_write(struct myblk_device *dev, uint32_t offset,
+    const uint8_t *data, uint32_t bytes)
+{
+    int ret;
+
+    if (offset + bytes > dev->flash_size) {
+        printk(KERN_WARNING "flashblk: Write beyond Flash region\n");
+        bytes = dev->flash_size - offset;
+    }
+    flash_lock(dev);
+    ret = flash_region_write(dev, offset, data, bytes);
+    mutex_unlock(&dev->lock);
+    return ret;
+}
+
+/*
+ * Copy the RAM region part of a read/write request directly between the
+ * bio pages and ram_buf. Returns the bytes handled, the remainder of the
+ * request lies in the flash region.
+ */
+static size_t myblk_ram_copy(struct myblk_device *dev, struct request *req, loff_t pos)
+{
+    struct bio_vec bvec;
+    struct req_iterator iter;
+    size_t done = 0;
+
+    rq_for_each_segment(bvec, req, iter) {
+        if (pos + done >= RAM_DATA_SIZE)
+            continue;
+        /* A segment straddling the boundary is only copied up to it */
+        bvec.bv_len = min_t(loff_t, bvec.bv_len, RAM_DATA_SIZE - pos - done);
+        if (req_op(req) == REQ_OP_WRITE) {
+            memcpy_from_bvec(dev->ram_buf + pos + done, &bvec);
+            snap_mark_dirty(dev, pos + done, bvec.bv_len);
+        } else
+            memcpy_to_bvec(&bvec, dev->ram_buf + pos + done);
+        done += bvec.bv_len;
+    }
+    return done;
+}
+
+/* Copy request bytes from skip onwards between the bio pages and buf */
+static void myblk_bounce_copy(struct request *req, u8 *buf, size_t skip, bool to_buf)
+{
+    struct bio_vec bvec;
+    struct req_iterator iter;
+    size_t off = 0, len;
+
+    rq_for_each_segment(bvec, req, iter) {
+        len = bvec.bv_len;
+        if (off + len > skip) {
+            if (off < skip) {
+                bvec.bv_offset += skip - off;
+                bvec.bv_len -= skip - off;
+            }
+            if (to_buf)
+                memcpy_from_bvec(buf + max(off, skip) - skip, &bvec);
+            else
+                memcpy_to_bvec(&bvec, buf + max(off, skip) - skip);
+        }
+        off += len;
+    }
+}
+
+/*
+ * Execute a request, called directly for the RAM region and from the
+ * flash worker otherwise
+ */
+static blk_status_t myblk_do_request(struct myblk_disk *disk, struct request *req)
+{
+    struct myblk_device *dev = disk->dev;
+    loff_t pos;
+    loff_t dev_size;
+    blk_status_t ret = BLK_STS_OK;
+    int io_ret;
+    u8 *temp_buf = NULL;
+    size_t total_len = blk_rq_bytes(req);
+    size_t ram_len, flash_len;
+
+    /* Cache flush: write back all dirty erase blocks */
+    if (req_op(req) == REQ_OP_FLUSH) {
+        flash_lock(dev);
+        io_ret = wb_flush_all(dev);
+        mutex_unlock(&dev->lock);
+        if (io_ret < 0) {
+            printk(KERN_ERR "flashblk: Cache flush failed: %d\n", io_ret);
+            ret = BLK_STS_IOERR;
+        }
+        goto out;
+    }
+
+    /* Offsets below are device offsets, the disk may start at the flash region */
+    pos = disk->base + blk_rq_pos(req) * MYBLK_SECTOR_SIZE;
+    dev_size = disk->base + disk->size;
+
+    /* Discard: release the flash part, the RAM part is left as is */
+    if (req_op(req) == REQ_OP_DISCARD) {
+        if (pos + total_len > dev_size) {
+            ret = BLK_STS_IOERR;
+            goto out;
+        }
+        if (pos + total_len > RAM_DATA_SIZE) {
+            loff_t start = max_t(loff_t, pos, RAM_DATA_SIZE);
+
+            flash_lock(dev);
+            flash_region_discard(dev, start - RAM_DATA_SIZE, pos + total_len - start);
+            mutex_unlock(&dev->lock);
+        }
+        goto out;
+    }
+
+    if (req_op(req) != REQ_OP_READ && req_op(req) != REQ_OP_WRITE) {
+        printk(KERN_WARNING "flashblk: Unsupported request operation\n");
+        ret = BLK_STS_NOTSUPP;
+        goto out;
+    }
+
+    if (pos + total_len > dev_size) {
+        printk(KERN_ERR "flashblk: Request beyond device size\n");
+        ret = BLK_STS_IOERR;
+        goto out;
+    }
+
+    /* RAM part: copied straight between the bio pages and ram_buf */
+    if (snap_restore_range(dev, pos, total_len) < 0) {
+        ret = BLK_STS_IOERR;
+        goto out;
+    }
+    ram_len = myblk_ram_copy(dev, req, pos);
+    if (ram_len == total_len)
+        goto out;
+
+    /* Flash part goes through a bounce buffer */
+    flash_len = total_len - ram_len;
+    temp_buf = kmalloc(flash_len, GFP_KERNEL);
+    if (!temp_buf) {
+        printk(KERN_ERR "flashblk: Failed to allocate temp buffer\n");
+        ret = BLK_STS_RESOURCE;
+        goto out;
+    }
+
+    if (req_op(req) == REQ_OP_WRITE) {
+        myblk_bounce_copy(req, temp_buf, ram_len, true);
+        io_ret = hybrid_write(dev, pos + ram_len - RAM_DATA_SIZE, temp_buf, flash_len);
+        /* Forced unit access: the flash part must not stay in the cache */
+        if (io_ret >= 0 && (req->cmd_flags & REQ_FUA)) {
+            flash_lock(dev);
+            io_ret = wb_flush_range(dev, pos + ram_len - RAM_DATA_SIZE, flash_len);
+            mutex_unlock(&dev->lock);
+        }
+        if (io_ret < 0) {
+            printk(KERN_WARNING "flashblk: hybrid write failed at 0x%llx\n", pos);
+            ret = BLK_STS_IOERR;
+        }
+    } else {
+        io_ret = hybrid_read(dev, pos + ram_len - RAM_DATA_SIZE, temp_buf, flash_len);
+        if (io_ret < 0) {
+            printk(KERN_ERR "flashblk: hybrid read failed at 0x%llx\n", pos);
+            ret = BLK_STS_IOERR;
+        } else {
+            myblk_bounce_copy(req, temp_buf, ram_len, false);
+        }
+    }
+
+    kfree(temp_buf);
+out:
+    return ret;
+}
+
+/* Runs a request punted off the hardware queue, on flash_wq or snap->wq */
+static void myblk_flash_work(struct work_struct *work)
+{
+    struct myblk_cmd *cmd = container_of(work, struct myblk_cmd, work);
+    struct request *req = blk_mq_rq_from_pdu(cmd);
+
+    blk_mq_end_request(req, myblk_do_request(req->q->queuedata, req));
 }
 
 /*
- * Handle an I/O request - Flash backend implementation
+ * Handle an I/O request: RAM-only requests complete right here without
+ * touching dev->lock, everything that needs the flash goes to the
+ * ordered flash worker so it cannot hold up RAM I/O. RAM requests for
+ * blocks not yet restored from the snapshot file go to the unbound
+ * restore queue instead, so they never wait behind flash operations.
+ * Runs on per-CPU hardware queues and must not sleep.
  */
 static blk_status_t myblk_request(struct blk_mq_hw_ctx *hctx,
                                    const struct blk_mq_queue_data *bd)
 {
     struct request *req = bd->rq;
-    struct myblk_device *dev = req->q->queuedata;
-    struct bio_vec bvec;
-    struct req_iterator iter;
+    struct myblk_disk *disk = req->q->queuedata;
+    struct myblk_device *dev = disk->dev;
+    struct myblk_cmd *cmd = blk_mq_rq_to_pdu(req);
     loff_t pos;
-    loff_t dev_size;
-    blk_status_t ret = BLK_STS_OK;
-    int io_ret;
-    u8 *temp_buf = NULL;
-    size_t total_len = blk_rq_bytes(req);
+    bool flash, restore = false;
 
     blk_mq_start_request(req);
 
-    pos = blk_rq_pos(req) * MYBLK_SECTOR_SIZE;
-    dev_size = dev->size;
-
-    temp_buf = kmalloc(total_len, GFP_KERNEL);
-    if (!temp_buf) {
-        printk(KERN_ERR "flashblk: Failed to allocate temp buffer\n");
-        ret = BLK_STS_RESOURCE;
-        goto out;
-    }
-
-    if (req_op(req) == REQ_OP_WRITE) {
-        size_t offset = 0;
-        rq_for_each_segment(bvec, req, iter) {
-            void *src = kmap_atomic(bvec.bv_page);
-            memcpy(temp_buf + offset, src + bvec.bv_offset, bvec.bv_len);
-            kunmap_atomic(src);
-            offset += bvec.bv_len;
-        }
-    }
-
-    if (pos + total_len > dev_size) {
-        printk(KERN_ERR "flashblk: Request beyond device size\n");
-        ret = BLK_STS_IOERR;
-        goto free_buf;
-    }
-
-    mutex_lock(&dev->lock);
-
-    switch (req_op(req)) {
-    case REQ_OP_READ:
-        io_ret = hybrid_read(dev, pos, temp_buf, total_len);
-        if (io_ret < 0) {
-            printk(KERN_ERR "flashblk: hybrid read failed at 0x%llx\n", pos);
-            ret = BLK_STS_IOERR;
-        }
-        break;
-    case REQ_OP_WRITE:
-        io_ret = hybrid_write(dev, pos, temp_buf, total_len);
-        if (io_ret < 0) {
-            printk(KERN_WARNING "flashblk: hybrid write failed at 0x%llx\n", pos);
-            ret = BLK_STS_IOERR;
+    if (req_op(req) == REQ_OP_FLUSH) {
+        /* Nothing is cached without the write-back cache */
+        if (!dev->wb) {
+            blk_mq_end_request(req, BLK_STS_OK);
+            return BLK_STS_OK;
         }
-        break;
-    default:
-        printk(KERN_WARNING "flashblk: Unsupported request operation\n");
-        ret = BLK_STS_NOTSUPP;
-        break;
+        flash = true;
+    } else {
+        pos = disk->base + blk_rq_pos(req) * MYBLK_SECTOR_SIZE;
+        flash = pos + blk_rq_bytes(req) > RAM_DATA_SIZE;
+        restore = !flash && snap_pending(dev, pos, blk_rq_bytes(req));
     }
 
-    mutex_unlock(&dev->lock);
-
-    if (ret == BLK_STS_OK && req_op(req) == REQ_OP_READ) {
-        size_t offset = 0;
-        rq_for_each_segment(bvec, req, iter) {
-            void *dst = kmap_atomic(bvec.bv_page);
-            memcpy(dst + bvec.bv_offset, temp_buf + offset, bvec.bv_len);
-            kunmap_atomic(dst);
-            offset += bvec.bv_len;
-        }
+    if (flash || restore) {
+        INIT_WORK(&cmd->work, myblk_flash_work);
+        queue_work(flash ? dev->flash_wq : dev->snap->wq, &cmd->work);
+        return BLK_STS_OK;
     }
 
-free_buf:
-    kfree(temp_buf);
-out:
-    blk_mq_end_request(req, ret);
-    return ret;
+    blk_mq_end_request(req, myblk_do_request(disk, req));
+    return BLK_STS_OK;
 }
 /*
  * Block device operations
@@ -657,11 +3153,9 @@ static int myblk_getgeo(struct block_device *bdev, struct hd_geometry *geo)
      * Return fake geometry for compatibility 
      * heads = 4, sectors = 16
      */
-    struct myblk_device *dev = bdev->bd_disk->private_data;
-    
     geo->heads = 4;
     geo->sectors = 16;
-    geo->cylinders = (dev->size / MYBLK_SECTOR_SIZE) / (geo->heads * geo->sectors);
+    geo->cylinders = get_capacity(bdev->bd_disk) / (geo->heads * geo->sectors);
     geo->start = 0;
     
     return 0;
@@ -682,48 +3176,646 @@ static struct blk_mq_ops myblk_mq_ops __maybe_unused = {
 };
 
 /*
- * Sysfs interface for direct flash access
+ * Sysfs attributes on the disk (/sys/block/flashblk/)
  */
 
-static struct attribute *flashblk_attrs[] = {
-    NULL,
-};
-static const struct attribute_group flashblk_attr_group = {
-    .attrs = flashblk_attrs,
-};
+/* Show statistics */
+static ssize_t stats_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct myblk_device *mydev = dev_to_disk(dev)->private_data;
+    struct flash_ftl *f = mydev->ftl;
+    struct flash_wb *wb = mydev->wb;
+    struct flash_mirror *m = mydev->mirror;
+    u32 min_ec = U32_MAX, max_ec = 0, mapped = 0;
+    ssize_t len = 0;
+    uint32_t i;
+
+    mutex_lock(&mydev->lock);
+    len += sprintf(buf + len, "provider:          %s\n", mydev->prov->name);
+    len += sprintf(buf + len,
+        "read_sessions:     %llu\n"
+        "read_bytes:        %llu\n"
+        "read_xfers:        %llu\n"
+        "read_kbps:         %llu\n"
+        "sessions:          %llu\n"
+        "session_ops:       %llu\n"
+        "i2c_transfers:     %llu\n"
+        "i2c_msgs:          %llu\n"
+        "erases:            %llu\n"
+        "erases_skipped:    %llu\n"
+        "pages_programmed:  %llu\n"
+        "pages_skipped:     %llu\n",
+        mydev->stats.read_sessions, mydev->stats.read_bytes, mydev->stats.read_xfers,
+        mydev->stats.read_ns ?
+            div64_u64(mydev->stats.read_bytes * 1000000ULL, mydev->stats.read_ns) : 0,
+        mydev->stats.sessions, mydev->stats.session_ops,
+        mydev->stats.i2c_transfers, mydev->stats.i2c_msgs,
+        mydev->stats.ops[FLASH_OP_ERASE].count, mydev->stats.erases_skipped,
+        mydev->stats.pages_programmed, mydev->stats.pages_skipped);
+
+    if (mydev->emul) {
+        struct flash_emul *e = mydev->emul;
+        u32 lo = U32_MAX, hi = 0;
+
+        for (i = 0; i < FLASH_MAX_SECTORS; i++) {
+            lo = min(lo, e->erase_count[i]);
+            hi = max(hi, e->erase_count[i]);
+        }
+        len += sprintf(buf + len,
+            "emul_bus_bytes:    %llu\n"
+            "emul_busy_ms:      %llu\n"
+            "emul_bit_conflicts: %llu\n"
+            "emul_protocol_errors: %llu\n"
+            "emul_erase_count:  %u-%u\n",
+            e->bus_bytes, div_u64(e->busy_us, 1000), e->bit_conflicts,
+            e->protocol_errors, lo, hi);
+    }
+
+    if (m)
+        len += sprintf(buf + len,
+            "mirror_pages:      %u/%u\n"
+            "mirror_hits:       %llu\n"
+            "mirror_fills:      %llu\n",
+            bitmap_weight(m->valid, MIRROR_PAGES), MIRROR_PAGES,
+            m->hits, m->fills);
+    else
+        len += sprintf(buf + len, "mirror: disabled\n");
+
+    len += sprintf(buf + len,
+        "pool_discards:     %llu\n"
+        "pool_pre_erases:   %llu\n"
+        "pool_hits:         %llu\n",
+        mydev->pool.discards, mydev->pool.pre_erases, mydev->pool.hits);
+    if (!f)
+        len += sprintf(buf + len,
+            "pool_sectors:      %u free, %u erased\n",
+            bitmap_weight(mydev->pool.free, FLASH_MAX_SECTORS),
+            bitmap_weight(mydev->pool.erased, FLASH_MAX_SECTORS));
+
+    if (wb)
+        len += sprintf(buf + len,
+            "wb_blocks:         %u/%u dirty\n"
+            "wb_read_hits:      %llu\n"
+            "wb_write_hits:     %llu\n"
+            "wb_write_misses:   %llu\n"
+            "wb_evictions:      %llu\n"
+            "wb_writebacks:     %llu\n"
+            "wb_erases_avoided: %llu\n",
+            bitmap_weight(wb->dirty, wb->nr), wb->nr,
+            wb->read_hits, wb->write_hits, wb->write_misses, wb->evictions,
+            wb->writebacks,
+            /* The FTL never erases in place, merged writes save slot programs only */
+            !f && wb->block_writes > wb->writebacks ? wb->block_writes - wb->writebacks : 0);
+    else
+        len += sprintf(buf + len, "wb: disabled\n");
+
+    if (!f) {
+        len += sprintf(buf + len, "ftl: disabled\n");
+        mutex_unlock(&mydev->lock);
+        return len;
+    }
+
+    for (i = 0; i < FLASH_MAX_SECTORS; i++) {
+        min_ec = min(min_ec, f->sectors[i].erase_count);
+        max_ec = max(max_ec, f->sectors[i].erase_count);
+    }
+    for (i = 0; i < FTL_NR_LBAS; i++)
+        if (f->l2p[i] != FTL_UNMAPPED)
+            mapped++;
+    len += sprintf(buf + len,
+        "ftl_mapped:        %u/%u\n"
+        "ftl_free_sectors:  %u\n"
+        "ftl_host_writes:   %llu\n"
+        "ftl_slot_programs: %llu\n"
+        "ftl_erases:        %llu\n"
+        "ftl_gc_runs:       %llu\n"
+        "ftl_wear_moves:    %llu\n"
+        "ftl_discards:      %llu\n"
+        "ftl_erase_count:   %u-%u\n",
+        mapped, FTL_NR_LBAS, f->nr_free,
+        f->host_writes, f->slot_programs, f->erases,
+        f->gc_runs, f->wear_moves, f->discards, min_ec, max_ec);
+    mutex_unlock(&mydev->lock);
+    return len;
+}
 
-/* Show flash address */
-static ssize_t flash_addr_show(struct device *dev,
+static DEVICE_ATTR_RO(stats);
+
+/* Show warm-up progress */
+static ssize_t warmup_show(struct device *dev,
     struct device_attribute *attr, char *buf)
-    __attribute__((unused));
+{
+    struct myblk_device *mydev = dev_to_disk(dev)->private_data;
+    struct flash_mirror *m = mydev->mirror;
+    unsigned int loaded;
+    s64 elapsed;
+
+    if (!m || !m->warmup)
+        return sprintf(buf, "state:      off\n");
+
+    mutex_lock(&mydev->lock);
+    loaded = bitmap_weight(m->valid, MIRROR_PAGES);
+    mutex_unlock(&mydev->lock);
+    elapsed = m->warm_ms >= 0 ? m->warm_ms : ktime_ms_delta(ktime_get(), m->warm_start);
+
+    return sprintf(buf,
+        "state:      %s\n"
+        "loaded:     %u/%u pages (%u%%)\n"
+        "elapsed_ms: %lld\n"
+        "errors:     %u\n",
+        m->warm_ms >= 0 ? "done" : "running",
+        loaded, MIRROR_PAGES, loaded * 100 / MIRROR_PAGES,
+        elapsed, m->warm_errors);
+}
+
+static DEVICE_ATTR_RO(warmup);
 
-static ssize_t flash_addr_show(struct device *dev,
+/* Show measured flash operation durations */
+static ssize_t latency_show(struct device *dev,
     struct device_attribute *attr, char *buf)
 {
-    struct myblk_device *mydev = dev_get_drvdata(dev);
-    return sprintf(buf, "0x%08X\n", mydev->debug_addr);
+    struct myblk_device *mydev = dev_to_disk(dev)->private_data;
+    struct flash_stats *fs = &mydev->stats;
+    ssize_t len = 0;
+    int op, b;
+
+    mutex_lock(&mydev->lock);
+    len += sprintf(buf + len, "mode: %s\n",
+        !status_poll ? "sleep" : fs->poll_broken ? "sleep (status not pollable)" : "poll");
+    for (op = 0; op < FLASH_OP_NR; op++) {
+        struct flash_op_stats *st = &fs->ops[op];
+
+        len += sprintf(buf + len,
+            "%s: count %llu avg %llu us max %u us timeouts %u\n",
+            flash_op_timing[op].name, st->count,
+            st->count ? div64_u64(st->total_us, st->count) : 0,
+            st->max_us, st->timeouts);
+        for (b = 0; b < FLASH_HIST_BUCKETS; b++) {
+            if (!st->hist[b])
+                continue;
+            if (b == FLASH_HIST_BUCKETS - 1)
+                len += sprintf(buf + len, "  >= %8u us: %llu\n",
+                               1U << (b - 1), st->hist[b]);
+            else
+                len += sprintf(buf + len, "  < %9u us: %llu\n",
+                               1U << b, st->hist[b]);
+        }
+    }
+    mutex_unlock(&mydev->lock);
+    return len;
 }
 
-/* Store flash address */
-static ssize_t flash_addr_store(struct device *dev,
-    struct device_attribute *attr, const char *buf, size_t count)
-    __attribute__((unused));
+static DEVICE_ATTR_RO(latency);
+
+/* Show RAM region snapshot state */
+static ssize_t snapshot_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct myblk_device *mydev = dev_to_disk(dev)->private_data;
+    struct ram_snap *s = mydev->snap;
+    ssize_t len;
+
+    if (!s)
+        return sprintf(buf, "state:        off\n");
+
+    mutex_lock(&s->lock);
+    len = sprintf(buf,
+        "file:         %s\n"
+        "log_bytes:    %lld\n"
+        "dirty_blocks: %u/%u\n"
+        "dax_blocks:   %u\n"
+        "pending:      %u\n"
+        "checkpoints:  %llu\n"
+        "blocks_saved: %llu\n"
+        "bytes_saved:  %llu\n"
+        "compactions:  %llu\n"
+        "restored:     %llu\n"
+        "errors:       %u\n"
+        "last_ms:      %lld\n",
+        snapshot, s->end - s->start,
+        bitmap_weight(s->dirty, SNAP_BLOCKS), SNAP_BLOCKS,
+        bitmap_weight(s->mapped, SNAP_BLOCKS),
+        bitmap_weight(s->pending, SNAP_BLOCKS),
+        s->checkpoints, s->blocks_saved, s->bytes_saved, s->compactions,
+        s->restored, s->errors, s->last_ms);
+    mutex_unlock(&s->lock);
+    return len;
+}
 
-static ssize_t flash_addr_store(struct device *dev,
+/* Write 1 to checkpoint now */
+static ssize_t snapshot_store(struct device *dev,
     struct device_attribute *attr, const char *buf, size_t count)
 {
-    struct myblk_device *mydev = dev_get_drvdata(dev);
-    uint32_t addr;
-    if (kstrtou32(buf, 0, &addr) != 0)
+    struct myblk_device *mydev = dev_to_disk(dev)->private_data;
+    bool now;
+    int ret;
+
+    if (!mydev->snap)
+        return -ENODEV;
+    if (kstrtobool(buf, &now) != 0 || !now)
+        return -EINVAL;
+    ret = snap_checkpoint(mydev);
+    return ret < 0 ? ret : count;
+}
+
+static DEVICE_ATTR_RW(snapshot);
+
+static struct attribute *flashblk_disk_attrs[] = {
+    &dev_attr_stats.attr,
+    &dev_attr_warmup.attr,
+    &dev_attr_latency.attr,
+    &dev_attr_snapshot.attr,
+    NULL,
+};
+
+static const struct attribute_group flashblk_disk_attr_group = {
+    .attrs = flashblk_disk_attrs,
+};
+
+static const struct attribute_group *flashblk_disk_groups[] = {
+    &flashblk_disk_attr_group,
+    NULL,
+};
+
+/* The RAM-only disk of split_regions has just the snapshot state */
+static struct attribute *flashblk_ram_disk_attrs[] = {
+    &dev_attr_snapshot.attr,
+    NULL,
+};
+
+static const struct attribute_group flashblk_ram_disk_attr_group = {
+    .attrs = flashblk_ram_disk_attrs,
+};
+
+static const struct attribute_group *flashblk_ram_disk_groups[] = {
+    &flashblk_ram_disk_attr_group,
+    NULL,
+};
+
+/*
+ * Raw flash reads: /dev/flashblk_flash maps file offsets to flash
+ * addresses over the whole chip, so any range can be read with one
+ * pread(). Pages held by the mirror are served from RAM, everything else
+ * is read from the provider a few pages per dev->lock hold, and like the
+ * warm-up thread the reader steps aside while requests are waiting for
+ * the lock, so block I/O is not held off by a long dump. This is the chip
+ * contents: data still in the write-back cache is not visible yet and
+ * the FTL region is in physical sector order.
+ */
+static int flash_dev_open(struct inode *inode, struct file *file)
+{
+    file->private_data = container_of(inode->i_cdev, struct myblk_device, flash_cdev);
+    return 0;
+}
+
+static ssize_t flash_dev_read(struct file *file, char __user *ubuf,
+    size_t count, loff_t *ppos)
+{
+    struct myblk_device *dev = file->private_data;
+    uint32_t size = dev->prov->size;
+    size_t done = 0, chunk;
+    u8 *buf;
+    int ret = 0;
+
+    if (*ppos < 0)
         return -EINVAL;
-    mydev->debug_addr = addr;
-    printk(KERN_INFO "flashblk: Debug address set to 0x%08X\n", addr);
-    return count;
+    if (*ppos >= size || !count)
+        return 0;
+    count = min_t(u64, count, size - *ppos);
+
+    buf = kmalloc(FLASH_DEV_CHUNK, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    while (done < count) {
+        /* Page aligned pieces after the first */
+        chunk = min_t(size_t, count - done,
+                      FLASH_DEV_CHUNK - (*ppos + done) % FLASH_PAGE_SIZE);
+        while (atomic_read(&dev->io_waiting) && !fatal_signal_pending(current))
+            usleep_range(1000, 2000);
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+        mutex_lock(&dev->lock);
+        ret = flash_cached_read(dev, *ppos + done, buf, chunk);
+        mutex_unlock(&dev->lock);
+        if (ret < 0)
+            break;
+        if (copy_to_user(ubuf + done, buf, chunk)) {
+            ret = -EFAULT;
+            break;
+        }
+        done += chunk;
+    }
+    kfree(buf);
+
+    *ppos += done;
+    return done ? done : ret;
+}
+
+static loff_t flash_dev_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct myblk_device *dev = file->private_data;
+
+    return fixed_size_llseek(file, offset, whence, dev->prov->size);
+}
+
+static const struct file_operations flash_dev_fops = {
+    .owner = THIS_MODULE,
+    .open = flash_dev_open,
+    .read = flash_dev_read,
+    .llseek = flash_dev_llseek,
+};
+
+/* Only a debugging aid, the block device works without it */
+static int flash_dev_create(struct myblk_device *dev)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&dev->flash_devt, 0, 1, DEVICE_NAME "_flash");
+    if (ret < 0)
+        return ret;
+    cdev_init(&dev->flash_cdev, &flash_dev_fops);
+    dev->flash_cdev.owner = THIS_MODULE;
+    ret = cdev_add(&dev->flash_cdev, dev->flash_devt, 1);
+    if (ret < 0)
+        goto out_unregister;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    dev->flash_class = class_create(DEVICE_NAME);
+#else
+    dev->flash_class = class_create(THIS_MODULE, DEVICE_NAME);
+#endif
+    if (IS_ERR(dev->flash_class)) {
+        ret = PTR_ERR(dev->flash_class);
+        goto out_del;
+    }
+    dev->flash_device = device_create(dev->flash_class, NULL, dev->flash_devt,
+                                      dev, DEVICE_NAME "_flash");
+    if (IS_ERR(dev->flash_device)) {
+        ret = PTR_ERR(dev->flash_device);
+        goto out_class;
+    }
+    return 0;
+
+out_class:
+    class_destroy(dev->flash_class);
+out_del:
+    cdev_del(&dev->flash_cdev);
+out_unregister:
+    unregister_chrdev_region(dev->flash_devt, 1);
+    dev->flash_class = NULL;
+    dev->flash_device = NULL;
+    return ret;
+}
+
+static void flash_dev_destroy(struct myblk_device *dev)
+{
+    if (!dev->flash_device)
+        return;
+    device_destroy(dev->flash_class, dev->flash_devt);
+    class_destroy(dev->flash_class);
+    cdev_del(&dev->flash_cdev);
+    unregister_chrdev_region(dev->flash_devt, 1);
+    dev->flash_device = NULL;
+    dev->flash_class = NULL;
 }
 
 /*
  * Initialize the device
  */
+/*
+ * RAM region backing store: individual zeroed pages so DAX can hand them
+ * out, mapped contiguously at ram_buf for the block I/O path
+ */
+static int ram_alloc(struct myblk_device *dev)
+{
+    unsigned int i;
+
+    dev->ram_pages = kvcalloc(RAM_PAGES, sizeof(*dev->ram_pages), GFP_KERNEL);
+    if (!dev->ram_pages)
+        return -ENOMEM;
+    for (i = 0; i < RAM_PAGES; i++) {
+        dev->ram_pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!dev->ram_pages[i])
+            goto err_free;
+    }
+    dev->ram_buf = vmap(dev->ram_pages, RAM_PAGES, VM_MAP, PAGE_KERNEL);
+    if (!dev->ram_buf)
+        goto err_free;
+    return 0;
+
+err_free:
+    while (i--)
+        __free_page(dev->ram_pages[i]);
+    kvfree(dev->ram_pages);
+    dev->ram_pages = NULL;
+    return -ENOMEM;
+}
+
+static void ram_free(struct myblk_device *dev)
+{
+    unsigned int i;
+
+    if (!dev->ram_pages)
+        return;
+    vunmap(dev->ram_buf);
+    for (i = 0; i < RAM_PAGES; i++)
+        __free_page(dev->ram_pages[i]);
+    kvfree(dev->ram_pages);
+    dev->ram_buf = NULL;
+    dev->ram_pages = NULL;
+}
+
+#if IS_ENABLED(CONFIG_DAX)
+/*
+ * DAX for the RAM-only disk: direct_access hands out the ram_buf pages,
+ * so ext4 -o dax maps them into user space without a page cache copy
+ */
+static long myblk_dax_direct_access(struct dax_device *dax_dev, pgoff_t pgoff,
+    long nr_pages, enum dax_access_mode mode, void **kaddr, pfn_t *pfn)
+{
+    struct myblk_device *dev = dax_get_private(dax_dev);
+
+    if (pgoff >= RAM_PAGES)
+        return -ERANGE;
+    if (snap_restore_range(dev, pgoff * PAGE_SIZE, PAGE_SIZE) < 0)
+        return -EIO;
+    /* Stores through the mapping are not seen, save it at every checkpoint */
+    if (dev->snap)
+        snap_set_range(dev->snap->mapped, pgoff * PAGE_SIZE, PAGE_SIZE);
+    if (kaddr)
+        *kaddr = dev->ram_buf + pgoff * PAGE_SIZE;
+    if (pfn)
+        *pfn = page_to_pfn_t(dev->ram_pages[pgoff]);
+    /* Pages are not physically contiguous, one at a time */
+    return 1;
+}
+
+static int myblk_dax_zero_page_range(struct dax_device *dax_dev, pgoff_t pgoff,
+    size_t nr_pages)
+{
+    struct myblk_device *dev = dax_get_private(dax_dev);
+
+    if (pgoff + nr_pages > RAM_PAGES)
+        return -ERANGE;
+    if (snap_restore_range(dev, pgoff * PAGE_SIZE, nr_pages * PAGE_SIZE) < 0)
+        return -EIO;
+    memset(dev->ram_buf + pgoff * PAGE_SIZE, 0, nr_pages * PAGE_SIZE);
+    snap_mark_dirty(dev, pgoff * PAGE_SIZE, nr_pages * PAGE_SIZE);
+    return 0;
+}
+
+static const struct dax_operations myblk_dax_ops = {
+    .direct_access = myblk_dax_direct_access,
+    .zero_page_range = myblk_dax_zero_page_range,
+};
+
+static int myblk_dax_add(struct myblk_disk *disk)
+{
+    struct dax_device *dax_dev;
+    int ret;
+
+    dax_dev = alloc_dax(disk->dev, &myblk_dax_ops);
+    if (IS_ERR(dax_dev))
+        return PTR_ERR(dax_dev);
+    ret = dax_add_host(dax_dev, disk->gd);
+    if (ret) {
+        kill_dax(dax_dev);
+        put_dax(dax_dev);
+        return ret;
+    }
+    blk_queue_flag_set(QUEUE_FLAG_DAX, disk->gd->queue);
+    disk->dax = dax_dev;
+    return 0;
+}
+
+static void myblk_dax_remove(struct myblk_disk *disk)
+{
+    if (!disk->dax)
+        return;
+    dax_remove_host(disk->gd);
+    kill_dax(disk->dax);
+    put_dax(disk->dax);
+    disk->dax = NULL;
+}
+#else
+static inline int myblk_dax_add(struct myblk_disk *disk)
+{
+    return -EOPNOTSUPP;
+}
+
+static inline void myblk_dax_remove(struct myblk_disk *disk)
+{
+}
+#endif
+
+/*
+ * Set up one disk covering [base, base + size) of the device with its own
+ * tag set. Limits follow the medium: the RAM region gets per-CPU queues,
+ * a disk holding only flash gets one queue and 4KB physical blocks.
+ */
+static int myblk_add_disk(struct myblk_device *dev, struct myblk_disk *disk,
+    const char *name, int minor, loff_t base, unsigned long size)
+{
+    bool has_ram = base < RAM_DATA_SIZE;
+    bool has_flash = base + size > RAM_DATA_SIZE;
+    struct request_queue *q;
+    int ret;
+
+    disk->dev = dev;
+    disk->base = base;
+    disk->size = size;
+
+    /* One hardware queue per CPU for RAM, flash requests are serialized by flash_wq */
+    disk->tag_set.ops = &myblk_mq_ops;
+    disk->tag_set.nr_hw_queues = has_ram ? num_online_cpus() : 1;
+    disk->tag_set.queue_depth = 128;
+    disk->tag_set.numa_node = NUMA_NO_NODE;
+    disk->tag_set.cmd_size = sizeof(struct myblk_cmd);
+    disk->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    disk->tag_set.driver_data = disk;
+
+    ret = blk_mq_alloc_tag_set(&disk->tag_set);
+    if (ret) {
+        printk(KERN_ERR "flashblk: Failed to allocate tag set\n");
+        return ret;
+    }
+
+    /* Allocate disk */
+    disk->gd = blk_mq_alloc_disk(&disk->tag_set, disk);
+    if (IS_ERR(disk->gd)) {
+        ret = PTR_ERR(disk->gd);
+        printk(KERN_ERR "flashblk: Failed to allocate disk\n");
+        goto out_free_tag_set;
+    }
+
+    disk->gd->major = myblk_major;
+    disk->gd->first_minor = minor;
+    disk->gd->minors = MYBLK_MINORS;
+    disk->gd->fops = &myblk_fops;
+    disk->gd->private_data = dev;
+    snprintf(disk->gd->disk_name, 32, "%s", name);
+
+    q = disk->gd->queue;
+    q->queuedata = disk;
+    blk_queue_logical_block_size(q, MYBLK_SECTOR_SIZE);
+    blk_queue_physical_block_size(q, has_ram ? MYBLK_SECTOR_SIZE : FLASH_SECTOR_SIZE);
+    if (!has_ram || !has_flash)
+        blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+    if (has_flash) {
+        /* Ask for FLUSH/FUA so the write-back cache is written out on sync */
+        if (dev->wb)
+            blk_queue_write_cache(q, true, true);
+        /* Discard releases whole erase sectors, or FTL slots */
+        q->limits.discard_granularity = dev->ftl ? FTL_SLOT_SIZE : FLASH_SECTOR_SIZE;
+        blk_queue_max_discard_sectors(q, size / MYBLK_SECTOR_SIZE);
+    }
+    if (!has_ram)
+        blk_queue_io_min(q, FLASH_SECTOR_SIZE);
+    /* Only a disk without flash is plain memory and can do DAX */
+    if (!has_flash && IS_ENABLED(CONFIG_DAX)) {
+        ret = myblk_dax_add(disk);
+        if (ret)
+            printk(KERN_WARNING "flashblk: DAX setup for %s failed: %d\n", name, ret);
+        else
+            printk(KERN_INFO "flashblk: %s supports DAX\n", name);
+    }
+
+    /* Set capacity AFTER setting block sizes */
+    set_capacity(disk->gd, size / MYBLK_SECTOR_SIZE);
+
+    /* Add disk, the flash statistics hang off the disk holding the flash */
+    ret = device_add_disk(NULL, disk->gd,
+                          has_flash ? flashblk_disk_groups : flashblk_ram_disk_groups);
+    if (ret) {
+        printk(KERN_ERR "flashblk: Failed to add disk %s\n", name);
+        goto out_cleanup_disk;
+    }
+    return 0;
+
+out_cleanup_disk:
+    myblk_dax_remove(disk);
+    put_disk(disk->gd);
+out_free_tag_set:
+    blk_mq_free_tag_set(&disk->tag_set);
+    disk->gd = NULL;
+    return ret;
+}
+
+static void myblk_del_disk(struct myblk_disk *disk)
+{
+    if (!disk->gd)
+        return;
+    myblk_dax_remove(disk);
+    del_gendisk(disk->gd);
+    put_disk(disk->gd);
+    blk_mq_free_tag_set(&disk->tag_set);
+    disk->gd = NULL;
+}
+
 static int __init myblk_init(void)
 {
     int ret = 0;
@@ -737,8 +3829,9 @@ static int __init myblk_init(void)
         return -ENOMEM;
     }
 
-    /* Set device size */
-    myblk_dev->size = MYBLK_TOTAL_SIZE;
+    /* Set device size, the FTL keeps spare sectors and exports less */
+    myblk_dev->flash_size = ftl ? FTL_DATA_SIZE : FLASH_DATA_SIZE;
+    myblk_dev->size = RAM_DATA_SIZE + myblk_dev->flash_size;
 
     /* Allocate cache buffer */
     myblk_dev->cache = vmalloc(MYBLK_SECTOR_SIZE);
@@ -749,73 +3842,99 @@ static int __init myblk_init(void)
     }
 
     /* Allocate RAM buffer */
-    myblk_dev->ram_buf = vmalloc(RAM_DATA_SIZE);
-    if (!myblk_dev->ram_buf) {
+    ret = ram_alloc(myblk_dev);
+    if (ret < 0) {
         printk(KERN_ERR "flashblk: Failed to allocate RAM buffer\n");
-        ret = -ENOMEM;
         goto out_free_cache;
     }
-    memset(myblk_dev->ram_buf, 0, RAM_DATA_SIZE);
+
+    /* Bring the RAM region back from its snapshot, blocks are read lazily */
+    if (snapshot && *snapshot) {
+        ret = snap_init(myblk_dev);
+        if (ret < 0)
+            goto out_free_ram;
+    }
 
     /* Initialize flash info */
-    myblk_dev->flash_info.bus_num = FLASH_I2C_BUS;
+    myblk_dev->flash_info.bus_num = i2c_bus;
     myblk_dev->flash_info.sensor_addr = FLASH_I2C_ADDR;
 
     /* Initialize mutex */
     mutex_init(&myblk_dev->lock);
+    atomic_set(&myblk_dev->io_waiting, 0);
+    myblk_dev->pool.last_io = jiffies;
+    INIT_DELAYED_WORK(&myblk_dev->session_work, flash_session_idle_work);
 
-    /* Register block device */
-    myblk_major = register_blkdev(0, DEVICE_NAME);
-    if (myblk_major < 0) {
-        printk(KERN_ERR "flashblk: Failed to register block device\n");
-        ret = myblk_major;
+    /* Bind the flash provider: the I2C hardware or the emulator */
+    ret = flash_bind(myblk_dev);
+    if (ret < 0)
         goto out_free_ram;
-    }
 
-    /* Initialize blk-mq tag set */
-    myblk_dev->tag_set.ops = &myblk_mq_ops;
-    myblk_dev->tag_set.nr_hw_queues = 1;
-    myblk_dev->tag_set.queue_depth = 128;
-    myblk_dev->tag_set.numa_node = NUMA_NO_NODE;
-    myblk_dev->tag_set.cmd_size = 0;
-    myblk_dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
-    myblk_dev->tag_set.driver_data = myblk_dev;
+    /* Flash mirror, filled lazily by reads */
+    if (mirror) {
+        myblk_dev->mirror = kzalloc(sizeof(*myblk_dev->mirror), GFP_KERNEL);
+        if (myblk_dev->mirror)
+            myblk_dev->mirror->data = vmalloc(FLASH_DATA_SIZE);
+        if (!myblk_dev->mirror || !myblk_dev->mirror->data) {
+            printk(KERN_ERR "flashblk: Failed to allocate flash mirror\n");
+            ret = -ENOMEM;
+            goto out_free_mirror;
+        }
+    }
 
-    ret = blk_mq_alloc_tag_set(&myblk_dev->tag_set);
-    if (ret) {
-        printk(KERN_ERR "flashblk: Failed to allocate tag set\n");
-        goto out_unregister;
+    /* Rebuild the FTL map before the disk becomes visible */
+    if (ftl) {
+        myblk_dev->ftl = kzalloc(sizeof(*myblk_dev->ftl), GFP_KERNEL);
+        if (!myblk_dev->ftl) {
+            ret = -ENOMEM;
+            goto out_free_mirror;
+        }
+        ret = ftl_rebuild(myblk_dev);
+        if (ret < 0) {
+            printk(KERN_ERR "flashblk: FTL rebuild failed: %d\n", ret);
+            goto out_free_ftl;
+        }
     }
 
-    /* Allocate disk */
-    myblk_dev->gd = blk_mq_alloc_disk(&myblk_dev->tag_set, myblk_dev);
-    if (IS_ERR(myblk_dev->gd)) {
-        ret = PTR_ERR(myblk_dev->gd);
-        printk(KERN_ERR "flashblk: Failed to allocate disk\n");
-        goto out_free_tag_set;
+    /* Write-back cache and its flusher thread */
+    if (wb_blocks) {
+        ret = wb_init(myblk_dev);
+        if (ret < 0) {
+            printk(KERN_ERR "flashblk: Failed to set up write-back cache\n");
+            goto out_free_ftl;
+        }
     }
 
-    myblk_dev->gd->major = myblk_major;
-    myblk_dev->gd->first_minor = 0;
-    myblk_dev->gd->minors = MYBLK_MINORS;
-    myblk_dev->gd->fops = &myblk_fops;
-    myblk_dev->gd->private_data = myblk_dev;
-    snprintf(myblk_dev->gd->disk_name, 32, DEVICE_NAME);
+    /* Flash worker, one request at a time in submission order */
+    myblk_dev->flash_wq = alloc_ordered_workqueue("flashblk_flash", WQ_MEM_RECLAIM);
+    if (!myblk_dev->flash_wq) {
+        printk(KERN_ERR "flashblk: Failed to allocate flash workqueue\n");
+        ret = -ENOMEM;
+        goto out_free_wb;
+    }
 
-    myblk_dev->queue = myblk_dev->gd->queue;
-    myblk_dev->queue->queuedata = myblk_dev;
-    blk_queue_logical_block_size(myblk_dev->queue, MYBLK_SECTOR_SIZE);
-    blk_queue_physical_block_size(myblk_dev->queue, MYBLK_SECTOR_SIZE);
-    
-    /* Set capacity AFTER setting block sizes */
-    set_capacity(myblk_dev->gd, myblk_dev->size / MYBLK_SECTOR_SIZE);
+    /* Register block device */
+    myblk_major = register_blkdev(0, DEVICE_NAME);
+    if (myblk_major < 0) {
+        printk(KERN_ERR "flashblk: Failed to register block device\n");
+        ret = myblk_major;
+        goto out_destroy_wq;
+    }
 
-    /* Add disk */
-    ret = add_disk(myblk_dev->gd);
-    if (ret) {
-        printk(KERN_ERR "flashblk: Failed to add disk\n");
-        goto out_cleanup_disk;
+    /* Add the hybrid disk, or one disk per region */
+    if (split_regions) {
+        ret = myblk_add_disk(myblk_dev, &myblk_dev->disks[0], DEVICE_NAME "_ram", 0,
+                             0, RAM_DATA_SIZE);
+        if (ret)
+            goto out_unregister;
+        ret = myblk_add_disk(myblk_dev, &myblk_dev->disks[1], DEVICE_NAME "_nor", 1,
+                             RAM_DATA_SIZE, myblk_dev->flash_size);
+    } else {
+        ret = myblk_add_disk(myblk_dev, &myblk_dev->disks[0], DEVICE_NAME, 0,
+                             0, myblk_dev->size);
     }
+    if (ret)
+        goto out_del_disks;
 
     printk(KERN_INFO "flashblk: Flash+RAM hybrid block device initialized successfully\n");
     printk(KERN_INFO "flashblk: Device size: %lu bytes (%lu sectors)\n",
@@ -823,17 +3942,75 @@ static int __init myblk_init(void)
     printk(KERN_INFO "flashblk: RAM region (read-write): 0 - %d bytes\n", RAM_DATA_SIZE);
     printk(KERN_INFO "flashblk: Flash region (read-write with erase): %d - %lu bytes\n", RAM_DATA_SIZE, myblk_dev->size);
     printk(KERN_INFO "flashblk: Flash sector size: %d bytes\n", FLASH_SECTOR_SIZE);
+    if (split_regions)
+        printk(KERN_INFO "flashblk: Regions exported as %s_ram and %s_nor\n",
+               DEVICE_NAME, DEVICE_NAME);
+    if (myblk_dev->ftl)
+        printk(KERN_INFO "flashblk: Flash region uses the FTL (%d spare sectors)\n",
+               FTL_SPARE_SECTORS);
+    if (myblk_dev->mirror)
+        printk(KERN_INFO "flashblk: Flash mirror enabled (%d bytes)\n", FLASH_DATA_SIZE);
+    if (myblk_dev->wb)
+        printk(KERN_INFO "flashblk: Write-back cache: %u erase blocks\n", wb_blocks);
+
+    ret = flash_dev_create(myblk_dev);
+    if (ret < 0)
+        printk(KERN_WARNING "flashblk: Failed to create %s_flash: %d\n", DEVICE_NAME, ret);
+
+    /* Warm the mirror up in the background, the disk is usable meanwhile */
+    if (warmup && !myblk_dev->mirror)
+        printk(KERN_WARNING "flashblk: warmup needs mirror=1, ignored\n");
+    if (warmup && myblk_dev->mirror) {
+        struct flash_mirror *m = myblk_dev->mirror;
+
+        m->warm_start = ktime_get();
+        m->warm_ms = -1;
+        m->warmup = kthread_run(mirror_warmup_thread, myblk_dev, "flashblk_warm");
+        if (IS_ERR(m->warmup)) {
+            printk(KERN_WARNING "flashblk: Failed to start warm-up thread\n");
+            m->warmup = NULL;
+        }
+    }
+
+    /* Erase discarded sectors while the flash is idle */
+    if (pre_erase) {
+        myblk_dev->pool.eraser = kthread_run(pool_eraser_thread, myblk_dev, "flashblk_erase");
+        if (IS_ERR(myblk_dev->pool.eraser)) {
+            printk(KERN_WARNING "flashblk: Failed to start pre-erase thread\n");
+            myblk_dev->pool.eraser = NULL;
+        }
+    }
+
+    /* Restore the rest of the RAM region and checkpoint periodically */
+    if (myblk_dev->snap) {
+        myblk_dev->snap->thread = kthread_run(snap_thread, myblk_dev, "flashblk_snap");
+        if (IS_ERR(myblk_dev->snap->thread)) {
+            printk(KERN_WARNING "flashblk: Failed to start snapshot thread\n");
+            myblk_dev->snap->thread = NULL;
+        }
+    }
 
     return 0;
 
-out_cleanup_disk:
-    put_disk(myblk_dev->gd);
-out_free_tag_set:
-    blk_mq_free_tag_set(&myblk_dev->tag_set);
+out_del_disks:
+    myblk_del_disk(&myblk_dev->disks[0]);
 out_unregister:
     unregister_blkdev(myblk_major, DEVICE_NAME);
+out_destroy_wq:
+    destroy_workqueue(myblk_dev->flash_wq);
+out_free_wb:
+    wb_destroy(myblk_dev);
+out_free_ftl:
+    flash_session_close(myblk_dev);
+    kfree(myblk_dev->ftl);
+out_free_mirror:
+    if (myblk_dev->mirror)
+        vfree(myblk_dev->mirror->data);
+    kfree(myblk_dev->mirror);
+    flash_unbind(myblk_dev);
 out_free_ram:
-    vfree(myblk_dev->ram_buf);
+    snap_destroy(myblk_dev);
+    ram_free(myblk_dev);
 out_free_cache:
     vfree(myblk_dev->cache);
 out_free_dev:
@@ -847,30 +4024,35 @@ out_free_dev:
  */
 static void __exit myblk_exit(void)
 {
+    unsigned int i;
+
     printk(KERN_INFO "flashblk: Cleaning up Flash+RAM hybrid block device driver\n");
 
     if (myblk_dev) {
-        if (myblk_dev->flash_device) {
-            sysfs_remove_group(&myblk_dev->flash_device->kobj, &flashblk_attr_group);
-            device_destroy(myblk_dev->flash_class, MKDEV(0, 0));
-        }
-        if (myblk_dev->flash_class) {
-            class_destroy(myblk_dev->flash_class);
-        }
-        if (myblk_dev->debug_buf) {
-            kfree(myblk_dev->debug_buf);
-        }
-        if (myblk_dev->gd) {
-            del_gendisk(myblk_dev->gd);
-            put_disk(myblk_dev->gd);
-        }
-        blk_mq_free_tag_set(&myblk_dev->tag_set);
+        if (myblk_dev->mirror && myblk_dev->mirror->warmup)
+            kthread_stop(myblk_dev->mirror->warmup);
+        if (myblk_dev->pool.eraser)
+            kthread_stop(myblk_dev->pool.eraser);
+        flash_dev_destroy(myblk_dev);
+        for (i = 0; i < MYBLK_MAX_DISKS; i++)
+            myblk_del_disk(&myblk_dev->disks[i]);
+        if (myblk_dev->flash_wq)
+            destroy_workqueue(myblk_dev->flash_wq);
+        /* No more requests, save the RAM region before freeing it */
+        snap_destroy(myblk_dev);
+        /* No more requests, write the cache back before freeing */
+        wb_destroy(myblk_dev);
+        flash_session_close(myblk_dev);
+        flash_unbind(myblk_dev);
         if (myblk_major > 0)
             unregister_blkdev(myblk_major, DEVICE_NAME);
         if (myblk_dev->cache)
             vfree(myblk_dev->cache);
-        if (myblk_dev->ram_buf)
-            vfree(myblk_dev->ram_buf);
+        ram_free(myblk_dev);
+        kfree(myblk_dev->ftl);
+        if (myblk_dev->mirror)
+            vfree(myblk_dev->mirror->data);
+        kfree(myblk_dev->mirror);
         kfree(myblk_dev);
     }
 
@@ -0,0 +1,433 @@
+/*
+ * Flash I2C Device Model
+ *
+ * Registers a virtual I2C adapter with a serial NOR flash behind the
+ * same command protocol as the sensor module's flash bridge, so
+ * flashblk (provider=i2c) runs its real I2C command sequences without
+ * the hardware:
+ *
+ *   0xFFFF <- F4 / F7 / F5           unlock, access mode, lock
+ *   0x8000 <- 01 a3 a2 a1 a0 5a      load 256 bytes at a into the window
+ *   0x8000 <- 02 00 a2 a1 a0 5a      program the filled window bytes at a
+ *   0x8000 <- 03 00 a2 a1 a0 5a      erase the 4KB sector at a
+ *   0x8005 -> 5a while busy          subcommand completion
+ *   0x00xx <-> data                  buffer window at offset xx
+ *
+ * Features:
+ * - NOR semantics: erase sets 0xFF, program only clears bits and stays
+ *   within one 256-byte page, subcommands need unlock + access mode
+ * - Latency injection: every transfer takes the bus time of its bytes,
+ *   every subcommand keeps the flash busy for its latency
+ * - Optional adapter quirks to exercise the transfer size limits
+ * - Device side counters in /sys/bus/i2c/devices/i2c-<bus>/flash_stats
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/i2c.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+
+#define DRIVER_NAME "flash_i2c_model"
+#define MODEL_SECTOR_SIZE 4096
+#define MODEL_WINDOW_SIZE 256  /* Buffer window and program page */
+#define MODEL_REG_MODE 0xFFFF
+#define MODEL_REG_SUBCMD 0x8000
+#define MODEL_REG_EXEC 0x8005
+#define MODEL_EXEC_BUSY 0x5a
+#define MODEL_CMD_READ 0x01
+#define MODEL_CMD_PROGRAM 0x02
+#define MODEL_CMD_ERASE 0x03
+
+static int bus = 4;
+module_param(bus, int, 0444);
+MODULE_PARM_DESC(bus, "I2C bus number of the virtual adapter");
+
+static unsigned short addr = 0x11;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "I2C address of the flash");
+
+static unsigned int size_kb = 512;
+module_param(size_kb, uint, 0444);
+MODULE_PARM_DESC(size_kb, "Flash size in KB");
+
+/* Defaults follow the latencies measured on the ADCU */
+static unsigned int byte_ns = 22500;
+module_param(byte_ns, uint, 0644);
+MODULE_PARM_DESC(byte_ns, "Bus time per byte incl. address bytes in ns (22500 = 400kHz)");
+
+static unsigned int read_us = 1800;
+module_param(read_us, uint, 0644);
+MODULE_PARM_DESC(read_us, "Busy time of the read subcommand");
+
+static unsigned int program_us = 700;
+module_param(program_us, uint, 0644);
+MODULE_PARM_DESC(program_us, "Busy time of the program subcommand");
+
+static unsigned int erase_us = 31000;
+module_param(erase_us, uint, 0644);
+MODULE_PARM_DESC(erase_us, "Busy time of the erase subcommand");
+
+static unsigned int max_read_len;
+module_param(max_read_len, uint, 0444);
+MODULE_PARM_DESC(max_read_len, "Adapter quirk: max read message length (0 = no limit)");
+
+static unsigned int max_num_msgs;
+module_param(max_num_msgs, uint, 0444);
+MODULE_PARM_DESC(max_num_msgs, "Adapter quirk: max messages per transfer (0 = no limit)");
+
+enum model_mode {
+    MODEL_LOCKED,
+    MODEL_UNLOCKED,                      /* After F4 */
+    MODEL_ACCESS,                        /* After F4 F7, subcommands allowed */
+};
+
+/* Model state, protected by lock */
+struct flash_model {
+    struct i2c_adapter adap;
+    struct i2c_adapter_quirks quirks;
+    struct mutex lock;
+    u8 *data;
+    u32 size;
+    u8 window[MODEL_WINDOW_SIZE];
+    u32 fill_end;                        /* Window bytes written since the last program */
+    enum model_mode mode;
+    ktime_t busy_until;                  /* End of the running subcommand */
+    /* Statistics */
+    u64 transfers;
+    u64 msgs;
+    u64 bus_bytes;
+    u64 unlocks;
+    u64 reads;
+    u64 programs;
+    u64 erases;
+    u64 status_polls;
+    u64 window_reads;                    /* Read messages on the buffer window */
+    u64 window_writes;
+    u64 busy_errors;                     /* Accesses while a subcommand was running */
+    u64 bit_conflicts;                   /* Programs that needed an erase first */
+    u64 protocol_errors;
+};
+
+static struct flash_model *model = NULL;
+
+static int model_error(struct flash_model *m, const char *what, u16 reg)
+{
+    m->protocol_errors++;
+    printk_ratelimited(KERN_WARNING "flash_i2c_model: %s (reg 0x%04x, mode %d)\n",
+                       what, reg, m->mode);
+    return -EIO;
+}
+
+static bool model_busy(struct flash_model *m)
+{
+    return ktime_before(ktime_get(), m->busy_until);
+}
+
+/* 0xFFFF mode commands */
+static int model_mode_cmd(struct flash_model *m, u8 cmd)
+{
+    switch (cmd) {
+    case 0xF4:
+        m->mode = MODEL_UNLOCKED;
+        m->unlocks++;
+        return 0;
+    case 0xF7:
+        if (m->mode == MODEL_LOCKED)
+            return model_error(m, "Access mode while locked", MODEL_REG_MODE);
+        m->mode = MODEL_ACCESS;
+        return 0;
+    case 0xF5:
+        m->mode = MODEL_LOCKED;
+        return 0;
+    }
+    return model_error(m, "Unknown mode command", MODEL_REG_MODE);
+}
+
+/* 0x8000 subcommands: p holds the 6 bytes after the register address */
+static int model_subcmd(struct flash_model *m, const u8 *p)
+{
+    u32 a = p[2] << 16 | p[3] << 8 | p[4];
+    u32 i, n, us;
+    bool conflict = false;
+
+    if (m->mode != MODEL_ACCESS)
+        return model_error(m, "Subcommand while locked", MODEL_REG_SUBCMD);
+    if (model_busy(m)) {
+        m->busy_errors++;
+        return model_error(m, "Subcommand while busy", MODEL_REG_SUBCMD);
+    }
+
+    switch (p[0]) {
+    case MODEL_CMD_READ:
+        a |= p[1] << 24;
+        if (a >= m->size)
+            return model_error(m, "Read beyond the flash", MODEL_REG_SUBCMD);
+        n = min_t(u32, MODEL_WINDOW_SIZE, m->size - a);
+        memcpy(m->window, m->data + a, n);
+        memset(m->window + n, 0xff, MODEL_WINDOW_SIZE - n);
+        m->reads++;
+        us = read_us;
+        break;
+    case MODEL_CMD_PROGRAM:
+        n = m->fill_end;
+        if (!n || a % MODEL_WINDOW_SIZE + n > MODEL_WINDOW_SIZE || a + n > m->size)
+            return model_error(m, "Program outside one page", MODEL_REG_SUBCMD);
+        /* Programming only clears bits */
+        for (i = 0; i < n; i++) {
+            if (m->window[i] & ~m->data[a + i])
+                conflict = true;
+            m->data[a + i] &= m->window[i];
+        }
+        if (conflict)
+            m->bit_conflicts++;
+        m->fill_end = 0;
+        m->programs++;
+        us = program_us;
+        break;
+    case MODEL_CMD_ERASE:
+        if (a % MODEL_SECTOR_SIZE || a >= m->size)
+            return model_error(m, "Erase of an invalid sector", MODEL_REG_SUBCMD);
+        memset(m->data + a, 0xff, MODEL_SECTOR_SIZE);
+        m->erases++;
+        us = erase_us;
+        break;
+    default:
+        return model_error(m, "Unknown subcommand", MODEL_REG_SUBCMD);
+    }
+    m->busy_until = ktime_add_us(ktime_get(), us);
+    return 0;
+}
+
+/* Write message: 16-bit register address plus data */
+static int model_write(struct flash_model *m, const u8 *buf, u16 len)
+{
+    u16 reg;
+    u32 off, n;
+
+    if (len < 2)
+        return model_error(m, "Write without register address", 0);
+    reg = buf[0] << 8 | buf[1];
+    buf += 2;
+    n = len - 2;
+
+    if (reg == MODEL_REG_MODE && n == 1)
+        return model_mode_cmd(m, buf[0]);
+    if (reg == MODEL_REG_SUBCMD && n == 6 && buf[5] == MODEL_EXEC_BUSY)
+        return model_subcmd(m, buf);
+    if (reg >> 8 == 0x00) {
+        off = reg & 0xff;
+        if (off + n > MODEL_WINDOW_SIZE)
+            return model_error(m, "Window write overruns the buffer", reg);
+        if (model_busy(m))
+            m->busy_errors++;
+        memcpy(m->window + off, buf, n);
+        m->fill_end = max(m->fill_end, off + n);
+        m->window_writes++;
+        return 0;
+    }
+    return model_error(m, "Write to unknown register", reg);
+}
+
+/* Read message following a register address write */
+static int model_read(struct flash_model *m, const struct i2c_msg *ra, u8 *buf, u16 len)
+{
+    u16 reg;
+    u32 off;
+
+    if (ra->len != 2)
+        return model_error(m, "Read needs a 16-bit register address", 0);
+    reg = ra->buf[0] << 8 | ra->buf[1];
+
+    if (reg == MODEL_REG_EXEC && len == 1) {
+        buf[0] = model_busy(m) ? MODEL_EXEC_BUSY : 0x00;
+        m->status_polls++;
+        return 0;
+    }
+    if (reg >> 8 == 0x00) {
+        off = reg & 0xff;
+        if (off + len > MODEL_WINDOW_SIZE)
+            return model_error(m, "Window read overruns the buffer", reg);
+        /* The window is still being loaded */
+        if (model_busy(m))
+            m->busy_errors++;
+        memcpy(buf, m->window + off, len);
+        m->window_reads++;
+        return 0;
+    }
+    return model_error(m, "Read of unknown register", reg);
+}
+
+/*
+ * A write immediately followed by a read is the register address of
+ * that read, every other write is a command or window fill. The bus
+ * time of the whole transfer is spent after it has been processed.
+ */
+static int model_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+    struct flash_model *m = i2c_get_adapdata(adap);
+    u64 bytes = 0;
+    int i, ret = 0;
+
+    mutex_lock(&m->lock);
+    m->transfers++;
+    for (i = 0; i < num && !ret; i++) {
+        struct i2c_msg *msg = &msgs[i];
+
+        bytes += 1 + msg->len;           /* Address byte plus payload */
+        if (msg->addr != addr) {
+            ret = -ENXIO;                /* Nobody acknowledges */
+            break;
+        }
+        if (msg->flags & I2C_M_RD) {
+            if (i == 0 || (msgs[i - 1].flags & I2C_M_RD))
+                ret = model_error(m, "Read without register address", 0);
+            else
+                ret = model_read(m, &msgs[i - 1], msg->buf, msg->len);
+        } else if (i + 1 < num && (msgs[i + 1].flags & I2C_M_RD)) {
+            continue;
+        } else {
+            ret = model_write(m, msg->buf, msg->len);
+        }
+    }
+    m->msgs += i;
+    m->bus_bytes += bytes;
+    mutex_unlock(&m->lock);
+
+    if (byte_ns)
+        fsleep(div_u64(bytes * byte_ns, 1000));
+    return ret < 0 ? ret : num;
+}
+
+static u32 model_functionality(struct i2c_adapter *adap)
+{
+    return I2C_FUNC_I2C;
+}
+
+static const struct i2c_algorithm model_algo = {
+    .master_xfer = model_xfer,
+    .functionality = model_functionality,
+};
+
+/* Show device side counters */
+static ssize_t flash_stats_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct flash_model *m = container_of(to_i2c_adapter(dev), struct flash_model, adap);
+    ssize_t len;
+
+    mutex_lock(&m->lock);
+    len = sprintf(buf,
+        "transfers:       %llu\n"
+        "msgs:            %llu\n"
+        "bus_bytes:       %llu\n"
+        "unlocks:         %llu\n"
+        "reads:           %llu\n"
+        "programs:        %llu\n"
+        "erases:          %llu\n"
+        "status_polls:    %llu\n"
+        "window_reads:    %llu\n"
+        "window_writes:   %llu\n"
+        "busy_errors:     %llu\n"
+        "bit_conflicts:   %llu\n"
+        "protocol_errors: %llu\n",
+        m->transfers, m->msgs, m->bus_bytes, m->unlocks,
+        m->reads, m->programs, m->erases, m->status_polls,
+        m->window_reads, m->window_writes,
+        m->busy_errors, m->bit_conflicts, m->protocol_errors);
+    mutex_unlock(&m->lock);
+    return len;
+}
+
+static DEVICE_ATTR_RO(flash_stats);
+
+static struct attribute *model_attrs[] = {
+    &dev_attr_flash_stats.attr,
+    NULL,
+};
+
+static const struct attribute_group model_attr_group = {
+    .attrs = model_attrs,
+};
+
+static int __init model_init(void)
+{
+    struct flash_model *m;
+    int ret;
+
+    if (!size_kb || size_kb * 1024 % MODEL_SECTOR_SIZE) {
+        printk(KERN_ERR "flash_i2c_model: size_kb must be a multiple of 4\n");
+        return -EINVAL;
+    }
+
+    m = kzalloc(sizeof(*m), GFP_KERNEL);
+    if (!m)
+        return -ENOMEM;
+    m->size = size_kb * 1024;
+    m->data = vmalloc(m->size);
+    if (!m->data) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+    /* A new part comes erased */
+    memset(m->data, 0xff, m->size);
+    mutex_init(&m->lock);
+
+    m->adap.owner = THIS_MODULE;
+    m->adap.algo = &model_algo;
+    m->adap.nr = bus;
+    snprintf(m->adap.name, sizeof(m->adap.name), "flash model 0x%02x", addr);
+    if (max_read_len || max_num_msgs) {
+        m->quirks.max_read_len = max_read_len;
+        m->quirks.max_comb_2nd_msg_len = max_read_len;
+        m->quirks.max_num_msgs = max_num_msgs;
+        m->adap.quirks = &m->quirks;
+    }
+    i2c_set_adapdata(&m->adap, m);
+
+    ret = i2c_add_numbered_adapter(&m->adap);
+    if (ret) {
+        printk(KERN_ERR "flash_i2c_model: Failed to add adapter i2c-%d: %d\n", bus, ret);
+        goto out_free_data;
+    }
+    ret = sysfs_create_group(&m->adap.dev.kobj, &model_attr_group);
+    if (ret)
+        printk(KERN_WARNING "flash_i2c_model: Failed to create sysfs group: %d\n", ret);
+
+    model = m;
+    printk(KERN_INFO "flash_i2c_model: %u KB flash at 0x%02x on i2c-%d\n",
+           size_kb, addr, m->adap.nr);
+    return 0;
+
+out_free_data:
+    vfree(m->data);
+out_free:
+    kfree(m);
+    return ret;
+}
+
+static void __exit model_exit(void)
+{
+    if (model) {
+        sysfs_remove_group(&model->adap.dev.kobj, &model_attr_group);
+        i2c_del_adapter(&model->adap);
+        vfree(model->data);
+        kfree(model);
+        model = NULL;
+    }
+    printk(KERN_INFO "flash_i2c_model: Unloaded\n");
+}
+
+module_init(model_init);
+module_exit(model_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Huaizhen.lv");
+MODULE_DESCRIPTION("I2C device model of the serial NOR flash used by flashblk");
+MODULE_VERSION("1.0");
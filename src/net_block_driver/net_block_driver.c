@@ -10,15 +10,25 @@
  * - Read/Write operations over network
  * - Automatic reconnection on network failure
  * - Configurable via sysfs
+ * - Batched dispatch: consecutive requests are corked into MSG_MORE sends
+ *   and their responses are collected in order
  * 
  * Protocol:
  * Request format: [CMD(1byte)][SECTOR(8bytes)][LENGTH(4bytes)][DATA(variable)]
  * Response format: [STATUS(1byte)][DATA(variable)]
  * 
+ * Vectored commands reuse the header with SECTOR = extent count and
+ * LENGTH = total data bytes, followed by the extent list
+ * [SECTOR(8bytes)][LENGTH(4bytes)] x count and, for WRITEV, the data of
+ * every extent in list order. READV returns one status and the data of
+ * every extent in list order.
+ * 
  * Commands:
  * 0x01 - READ
  * 0x02 - WRITE
  * 0x03 - DISCONNECT
+ * 0x04 - READV
+ * 0x05 - WRITEV
  */
 
 #include <linux/module.h>
@@ -48,11 +58,15 @@
 #define NETBLK_DEFAULT_SIZE (100 * 1024 * 1024)  /* 100MB default */
 #define MAX_RETRIES 3
 #define CONNECT_TIMEOUT 5000  /* ms */
+#define NETBLK_BATCH_BYTES (32 * 1024)  /* Max read data in flight per batch */
+#define NETBLK_MAX_EXTENTS 64           /* Max requests per READV/WRITEV */
 
 /* Network protocol commands */
 #define NET_CMD_READ       0x01
 #define NET_CMD_WRITE      0x02
 #define NET_CMD_DISCONNECT 0x03
+#define NET_CMD_READV      0x04
+#define NET_CMD_WRITEV     0x05
 
 /* Network protocol responses */
 #define NET_STATUS_OK      0x00
@@ -66,12 +80,28 @@ struct net_request_packet {
     /* followed by data for write operations */
 } __packed;
 
+/* Extent descriptor of a vectored request */
+struct net_extent {
+    u64 sector;
+    u32 length;
+} __packed;
+
 /* Response packet structure */
 struct net_response_packet {
     u8 status;
     /* followed by data for read operations */
 } __packed;
 
+/* Per-request driver data (blk-mq pdu) */
+struct netblk_cmd {
+    struct list_head list;           /* Link in pending/in-flight list */
+    struct net_request_packet hdr;   /* Wire header (network byte order) */
+    struct net_extent ext;           /* Same range as extent of a READV/WRITEV */
+    void *buf;                       /* Payload bounce buffer */
+    u32 len;                         /* Payload length in bytes */
+    u16 nr_group;                    /* Commands sharing this one's message */
+};
+
 /* Network connection state */
 enum netblk_state {
     NETBLK_DISCONNECTED = 0,
@@ -83,7 +113,7 @@ enum netblk_state {
 /* Device structure */
 struct netblk_device {
     unsigned long size;              /* Device size in bytes */
-    struct mutex lock;               /* Mutex for I/O operations */
+    struct mutex lock;               /* Mutex for socket I/O */
     struct gendisk *gd;              /* Generic disk structure */
     struct blk_mq_tag_set tag_set;   /* blk-mq tag set */
     struct request_queue *queue;     /* Request queue */
@@ -95,6 +125,15 @@ struct netblk_device {
     u16 server_port;                 /* Server port */
     enum netblk_state state;         /* Connection state */
     
+    /* Requests queued by queue_rq, sent on bd->last or commit_rqs */
+    spinlock_t pending_lock;
+    struct list_head pending;
+    
+    /* Vectored READV/WRITEV, scratch space protected by lock */
+    bool vectored;                   /* Group same-direction requests */
+    struct net_request_packet vhdr;
+    struct kvec viov[1 + 2 * NETBLK_MAX_EXTENTS];
+    
     /* Connection thread */
     struct task_struct *conn_thread; /* Connection management thread */
     atomic_t should_stop;            /* Flag to stop connection thread */
@@ -103,6 +142,9 @@ struct netblk_device {
     atomic64_t read_bytes;
     atomic64_t write_bytes;
     atomic64_t errors;
+    atomic64_t batches;              /* Corked send bursts */
+    atomic64_t batched_rqs;          /* Requests sent in those bursts */
+    atomic64_t vectored_rqs;         /* Requests sent inside READV/WRITEV */
 };
 
 static struct netblk_device *netblk_dev = NULL;
@@ -112,18 +154,17 @@ static int netblk_major = 0;
  * Network helper functions
  */
 
-/* Send data over socket */
-static int netblk_send(struct socket *sock, void *buf, size_t len)
+/* Send a vector of buffers over socket, MSG_MORE in flags corks the segment */
+static int netblk_sendv(struct socket *sock, struct kvec *iov, size_t nr,
+                        size_t len, int flags)
 {
     struct msghdr msg;
-    struct kvec iov;
     int ret;
     
     memset(&msg, 0, sizeof(msg));
-    iov.iov_base = buf;
-    iov.iov_len = len;
+    msg.msg_flags = flags;
     
-    ret = kernel_sendmsg(sock, &msg, &iov, 1, len);
+    ret = kernel_sendmsg(sock, &msg, iov, nr, len);
     if (ret < 0) {
         printk(KERN_ERR "netblk: Send failed: %d\n", ret);
         return ret;
@@ -137,6 +178,17 @@ static int netblk_send(struct socket *sock, void *buf, size_t len)
     return 0;
 }
 
+/* Send data over socket */
+static int netblk_send(struct socket *sock, void *buf, size_t len)
+{
+    struct kvec iov;
+    
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    
+    return netblk_sendv(sock, &iov, 1, len, 0);
+}
+
 /* Receive data from socket */
 static int netblk_recv(struct socket *sock, void *buf, size_t len)
 {
@@ -240,229 +292,341 @@ static void netblk_disconnect(struct netblk_device *dev)
     printk(KERN_INFO "netblk: Disconnected\n");
 }
 
-/* Network read operation */
-static int netblk_net_read(struct netblk_device *dev, u64 sector,
-                          void *buf, u32 len)
+/* Copy payload between the request's bio pages and the bounce buffer */
+static void netblk_copy_bio(struct request *req, void *buf, bool to_buf)
+{
+    struct bio_vec bvec;
+    struct req_iterator iter;
+    size_t offset = 0;
+    
+    rq_for_each_segment(bvec, req, iter) {
+        void *p = kmap_atomic(bvec.bv_page);
+        if (to_buf)
+            memcpy(buf + offset, p + bvec.bv_offset, bvec.bv_len);
+        else
+            memcpy(p + bvec.bv_offset, buf + offset, bvec.bv_len);
+        kunmap_atomic(p);
+        offset += bvec.bv_len;
+    }
+}
+
+/* Finish a command and hand the request back to blk-mq */
+static void netblk_complete(struct netblk_device *dev, struct netblk_cmd *cmd,
+                            blk_status_t status)
+{
+    struct request *req = blk_mq_rq_from_pdu(cmd);
+    
+    if (status == BLK_STS_OK) {
+        if (req_op(req) == REQ_OP_READ) {
+            netblk_copy_bio(req, cmd->buf, false);
+            atomic64_add(cmd->len, &dev->read_bytes);
+        } else {
+            atomic64_add(cmd->len, &dev->write_bytes);
+        }
+    } else {
+        printk(KERN_ERR "netblk: %s failed at sector %llu\n",
+               req_op(req) == REQ_OP_READ ? "Read" : "Write",
+               (unsigned long long)blk_rq_pos(req));
+        atomic64_inc(&dev->errors);
+    }
+    
+    vfree(cmd->buf);
+    cmd->buf = NULL;
+    blk_mq_end_request(req, status);
+}
+
+/* Send one command: header and write payload go out in a single sendmsg */
+static int netblk_send_cmd(struct netblk_device *dev, struct netblk_cmd *cmd,
+                           bool more)
+{
+    struct kvec iov[2];
+    size_t nr = 1;
+    size_t len = sizeof(cmd->hdr);
+    
+    iov[0].iov_base = &cmd->hdr;
+    iov[0].iov_len = sizeof(cmd->hdr);
+    
+    if (cmd->hdr.cmd == NET_CMD_WRITE) {
+        iov[1].iov_base = cmd->buf;
+        iov[1].iov_len = cmd->len;
+        len += cmd->len;
+        nr = 2;
+    }
+    
+    return netblk_sendv(dev->sock, iov, nr, len, more ? MSG_MORE : 0);
+}
+
+/*
+ * Send @nr commands starting at @head as one READV/WRITEV message:
+ * header, extent list and (for writes) all payloads in a single sendmsg
+ */
+static int netblk_send_group(struct netblk_device *dev, struct netblk_cmd *head,
+                             u16 nr, bool more)
 {
-    struct net_request_packet req;
+    struct netblk_cmd *cmd = head;
+    bool write = head->hdr.cmd == NET_CMD_WRITE;
+    struct kvec *iov = dev->viov;
+    size_t len = sizeof(dev->vhdr);
+    u32 data_len = 0;
+    size_t n = 1;
+    u16 i;
+    
+    for (i = 0; i < nr; i++, cmd = list_next_entry(cmd, list)) {
+        iov[n].iov_base = &cmd->ext;
+        iov[n].iov_len = sizeof(cmd->ext);
+        len += sizeof(cmd->ext);
+        n++;
+        data_len += cmd->len;
+    }
+    
+    if (write) {
+        for (i = 0, cmd = head; i < nr; i++, cmd = list_next_entry(cmd, list)) {
+            iov[n].iov_base = cmd->buf;
+            iov[n].iov_len = cmd->len;
+            len += cmd->len;
+            n++;
+        }
+    }
+    
+    dev->vhdr.cmd = write ? NET_CMD_WRITEV : NET_CMD_READV;
+    dev->vhdr.sector = cpu_to_be64(nr);
+    dev->vhdr.length = cpu_to_be32(data_len);
+    iov[0].iov_base = &dev->vhdr;
+    iov[0].iov_len = sizeof(dev->vhdr);
+    
+    return netblk_sendv(dev->sock, iov, n, len, more ? MSG_MORE : 0);
+}
+
+/*
+ * Move the next message's commands from @batch to @inflight.
+ * With vectored mode on, consecutive same-direction requests are grouped
+ * into one READV/WRITEV; the group size is stored in the head command.
+ */
+static struct netblk_cmd *netblk_take_group(struct netblk_device *dev,
+    struct list_head *batch, struct list_head *inflight, u32 *read_bytes)
+{
+    struct netblk_cmd *head, *cmd;
+    u8 op;
+    
+    head = list_first_entry(batch, struct netblk_cmd, list);
+    op = head->hdr.cmd;
+    list_move_tail(&head->list, inflight);
+    head->nr_group = 1;
+    if (op == NET_CMD_READ)
+        *read_bytes += head->len;
+    
+    while (dev->vectored && !list_empty(batch) &&
+           head->nr_group < NETBLK_MAX_EXTENTS) {
+        cmd = list_first_entry(batch, struct netblk_cmd, list);
+        if (cmd->hdr.cmd != op)
+            break;
+        if (op == NET_CMD_READ && *read_bytes + cmd->len > NETBLK_BATCH_BYTES)
+            break;
+        
+        list_move_tail(&cmd->list, inflight);
+        head->nr_group++;
+        if (op == NET_CMD_READ)
+            *read_bytes += cmd->len;
+    }
+    
+    return head;
+}
+
+/*
+ * Send as many queued commands as fit in one corked burst, then collect
+ * their responses in order. The burst stops once NETBLK_BATCH_BYTES of
+ * read data is outstanding so the server never blocks sending a response
+ * while we are still blocked sending to it.
+ * Completed commands are removed from @batch; on a socket error the
+ * unanswered ones are put back at its head and regrouped on retry.
+ */
+static int netblk_xmit_batch(struct netblk_device *dev, struct list_head *batch)
+{
+    struct netblk_cmd *cmd;
     struct net_response_packet resp;
+    LIST_HEAD(inflight);
+    u32 read_bytes = 0;
+    u64 nr = 0;
+    bool more;
     int ret;
-    int retry;
     
-    for (retry = 0; retry < MAX_RETRIES; retry++) {
-        mutex_lock(&dev->lock);
+    /* Send phase */
+    while (!list_empty(batch) && read_bytes < NETBLK_BATCH_BYTES) {
+        cmd = netblk_take_group(dev, batch, &inflight, &read_bytes);
+        more = !list_empty(batch) && read_bytes < NETBLK_BATCH_BYTES;
         
-        /* Ensure connected */
-        if (dev->state != NETBLK_CONNECTED) {
-            ret = netblk_connect(dev);
-            if (ret < 0) {
-                mutex_unlock(&dev->lock);
-                msleep(1000);
-                continue;
-            }
+        if (cmd->nr_group > 1) {
+            ret = netblk_send_group(dev, cmd, cmd->nr_group, more);
+            atomic64_add(cmd->nr_group, &dev->vectored_rqs);
+        } else {
+            ret = netblk_send_cmd(dev, cmd, more);
         }
-        
-        /* Send read request */
-        req.cmd = NET_CMD_READ;
-        req.sector = cpu_to_be64(sector);
-        req.length = cpu_to_be32(len);
-        
-        ret = netblk_send(dev->sock, &req, sizeof(req));
         if (ret < 0) {
-            printk(KERN_WARNING "netblk: Send request failed, retry %d\n", retry);
-            netblk_disconnect(dev);
-            mutex_unlock(&dev->lock);
-            msleep(1000);
-            continue;
+            printk(KERN_WARNING "netblk: Send request failed\n");
+            goto requeue;
         }
+        nr += cmd->nr_group;
+    }
+    
+    atomic64_inc(&dev->batches);
+    atomic64_add(nr, &dev->batched_rqs);
+    
+    /* Receive phase - the server answers strictly in request order */
+    while (!list_empty(&inflight)) {
+        u16 group;
+        
+        cmd = list_first_entry(&inflight, struct netblk_cmd, list);
+        group = cmd->nr_group;
         
-        /* Receive response status */
         ret = netblk_recv(dev->sock, &resp, sizeof(resp));
         if (ret < 0) {
-            printk(KERN_WARNING "netblk: Recv response failed, retry %d\n", retry);
-            netblk_disconnect(dev);
-            mutex_unlock(&dev->lock);
-            msleep(1000);
-            continue;
+            printk(KERN_WARNING "netblk: Recv response failed\n");
+            goto requeue;
         }
         
         if (resp.status != NET_STATUS_OK) {
             printk(KERN_ERR "netblk: Server returned error status\n");
-            mutex_unlock(&dev->lock);
-            atomic64_inc(&dev->errors);
-            return -EIO;
-        }
-        
-        /* Receive data */
-        ret = netblk_recv(dev->sock, buf, len);
-        if (ret < 0) {
-            printk(KERN_WARNING "netblk: Recv data failed, retry %d\n", retry);
-            netblk_disconnect(dev);
-            mutex_unlock(&dev->lock);
-            msleep(1000);
+            while (group--) {
+                cmd = list_first_entry(&inflight, struct netblk_cmd, list);
+                list_del(&cmd->list);
+                netblk_complete(dev, cmd, BLK_STS_IOERR);
+            }
             continue;
         }
         
-        mutex_unlock(&dev->lock);
-        atomic64_add(len, &dev->read_bytes);
-        return 0;
+        /* READV data arrives in extent order, one command after another */
+        while (group--) {
+            cmd = list_first_entry(&inflight, struct netblk_cmd, list);
+            if (cmd->hdr.cmd == NET_CMD_READ) {
+                ret = netblk_recv(dev->sock, cmd->buf, cmd->len);
+                if (ret < 0) {
+                    printk(KERN_WARNING "netblk: Recv data failed\n");
+                    goto requeue;
+                }
+            }
+            list_del(&cmd->list);
+            netblk_complete(dev, cmd, BLK_STS_OK);
+        }
     }
     
-    atomic64_inc(&dev->errors);
-    return -EIO;
+    return 0;
+    
+requeue:
+    list_splice(&inflight, batch);
+    return ret;
 }
 
-/* Network write operation */
-static int netblk_net_write(struct netblk_device *dev, u64 sector,
-                           const void *buf, u32 len)
+/*
+ * Push every pending command to the server.
+ * Called for the last request of a dispatch batch and from commit_rqs.
+ */
+static void netblk_flush(struct netblk_device *dev)
 {
-    struct net_request_packet req;
-    struct net_response_packet resp;
+    struct netblk_cmd *cmd, *tmp;
+    LIST_HEAD(batch);
+    int retry = 0;
     int ret;
-    int retry;
     
-    for (retry = 0; retry < MAX_RETRIES; retry++) {
-        mutex_lock(&dev->lock);
-        
+    spin_lock(&dev->pending_lock);
+    list_splice_tail_init(&dev->pending, &batch);
+    spin_unlock(&dev->pending_lock);
+    
+    if (list_empty(&batch))
+        return;
+    
+    mutex_lock(&dev->lock);
+    
+    while (!list_empty(&batch)) {
         /* Ensure connected */
         if (dev->state != NETBLK_CONNECTED) {
             ret = netblk_connect(dev);
-            if (ret < 0) {
-                mutex_unlock(&dev->lock);
-                msleep(1000);
-                continue;
-            }
-        }
-        
-        /* Send write request */
-        req.cmd = NET_CMD_WRITE;
-        req.sector = cpu_to_be64(sector);
-        req.length = cpu_to_be32(len);
-        
-        ret = netblk_send(dev->sock, &req, sizeof(req));
-        if (ret < 0) {
-            printk(KERN_WARNING "netblk: Send request failed, retry %d\n", retry);
-            netblk_disconnect(dev);
-            mutex_unlock(&dev->lock);
-            msleep(1000);
-            continue;
+        } else {
+            ret = netblk_xmit_batch(dev, &batch);
+            if (ret < 0)
+                netblk_disconnect(dev);
         }
         
-        /* Send data */
-        ret = netblk_send(dev->sock, (void *)buf, len);
         if (ret < 0) {
-            printk(KERN_WARNING "netblk: Send data failed, retry %d\n", retry);
-            netblk_disconnect(dev);
+            if (++retry >= MAX_RETRIES)
+                break;
+            printk(KERN_WARNING "netblk: I/O failed, retry %d\n", retry);
             mutex_unlock(&dev->lock);
             msleep(1000);
-            continue;
+            mutex_lock(&dev->lock);
         }
-        
-        /* Receive response status */
-        ret = netblk_recv(dev->sock, &resp, sizeof(resp));
-        if (ret < 0) {
-            printk(KERN_WARNING "netblk: Recv response failed, retry %d\n", retry);
-            netblk_disconnect(dev);
-            mutex_unlock(&dev->lock);
-            msleep(1000);
-            continue;
-        }
-        
-        if (resp.status != NET_STATUS_OK) {
-            printk(KERN_ERR "netblk: Server returned error status\n");
-            mutex_unlock(&dev->lock);
-            atomic64_inc(&dev->errors);
-            return -EIO;
-        }
-        
-        mutex_unlock(&dev->lock);
-        atomic64_add(len, &dev->write_bytes);
-        return 0;
     }
     
-    atomic64_inc(&dev->errors);
-    return -EIO;
+    mutex_unlock(&dev->lock);
+    
+    /* Fail whatever could not be delivered */
+    list_for_each_entry_safe(cmd, tmp, &batch, list) {
+        list_del(&cmd->list);
+        netblk_complete(dev, cmd, BLK_STS_IOERR);
+    }
 }
 
 /*
  * Handle an I/O request
+ * Requests are only queued here; the socket work happens in netblk_flush()
+ * once blk-mq signals the end of the dispatch batch.
  */
 static blk_status_t netblk_request(struct blk_mq_hw_ctx *hctx,
                                    const struct blk_mq_queue_data *bd)
 {
     struct request *req = bd->rq;
     struct netblk_device *dev = req->q->queuedata;
-    struct bio_vec bvec;
-    struct req_iterator iter;
-    u64 sector;
-    blk_status_t ret = BLK_STS_OK;
-    int io_ret;
-    void *temp_buf = NULL;
-    size_t total_len = blk_rq_bytes(req);
-    
-    blk_mq_start_request(req);
-    
-    sector = blk_rq_pos(req);
-    
-    /* Allocate temporary buffer */
-    temp_buf = vmalloc(total_len);
-    if (!temp_buf) {
-        printk(KERN_ERR "netblk: Failed to allocate temp buffer\n");
-        ret = BLK_STS_RESOURCE;
-        goto out;
-    }
+    struct netblk_cmd *cmd = blk_mq_rq_to_pdu(req);
+    u8 op;
     
-    /* For write, copy data from bio to temp buffer */
-    if (req_op(req) == REQ_OP_WRITE) {
-        size_t offset = 0;
-        rq_for_each_segment(bvec, req, iter) {
-            void *src = kmap_atomic(bvec.bv_page);
-            memcpy(temp_buf + offset, src + bvec.bv_offset, bvec.bv_len);
-            kunmap_atomic(src);
-            offset += bvec.bv_len;
-        }
-    }
-    
-    /* Perform network I/O */
     switch (req_op(req)) {
     case REQ_OP_READ:
-        io_ret = netblk_net_read(dev, sector, temp_buf, total_len);
-        if (io_ret < 0) {
-            printk(KERN_ERR "netblk: Read failed at sector %llu\n", sector);
-            ret = BLK_STS_IOERR;
-        }
+        op = NET_CMD_READ;
         break;
-        
     case REQ_OP_WRITE:
-        io_ret = netblk_net_write(dev, sector, temp_buf, total_len);
-        if (io_ret < 0) {
-            printk(KERN_ERR "netblk: Write failed at sector %llu\n", sector);
-            ret = BLK_STS_IOERR;
-        }
+        op = NET_CMD_WRITE;
         break;
-        
     default:
         printk(KERN_WARNING "netblk: Unsupported request operation\n");
-        ret = BLK_STS_NOTSUPP;
-        break;
+        return BLK_STS_NOTSUPP;
     }
     
-    /* For read, copy data from temp buffer to bio */
-    if (ret == BLK_STS_OK && req_op(req) == REQ_OP_READ) {
-        size_t offset = 0;
-        rq_for_each_segment(bvec, req, iter) {
-            void *dst = kmap_atomic(bvec.bv_page);
-            memcpy(dst + bvec.bv_offset, temp_buf + offset, bvec.bv_len);
-            kunmap_atomic(dst);
-            offset += bvec.bv_len;
-        }
+    cmd->len = blk_rq_bytes(req);
+    
+    /* Allocate temporary buffer */
+    cmd->buf = vmalloc(cmd->len);
+    if (!cmd->buf) {
+        printk(KERN_ERR "netblk: Failed to allocate temp buffer\n");
+        return BLK_STS_RESOURCE;
     }
     
-    vfree(temp_buf);
+    blk_mq_start_request(req);
     
-out:
-    blk_mq_end_request(req, ret);
-    return ret;
+    /* For write, copy data from bio to temp buffer */
+    if (op == NET_CMD_WRITE)
+        netblk_copy_bio(req, cmd->buf, true);
+    
+    cmd->hdr.cmd = op;
+    cmd->hdr.sector = cpu_to_be64(blk_rq_pos(req));
+    cmd->hdr.length = cpu_to_be32(cmd->len);
+    cmd->ext.sector = cmd->hdr.sector;
+    cmd->ext.length = cmd->hdr.length;
+    
+    spin_lock(&dev->pending_lock);
+    list_add_tail(&cmd->list, &dev->pending);
+    spin_unlock(&dev->pending_lock);
+    
+    if (bd->last)
+        netblk_flush(dev);
+    
+    return BLK_STS_OK;
+}
+
+/* Dispatch ended without bd->last, send what was queued */
+static void netblk_commit_rqs(struct blk_mq_hw_ctx *hctx)
+{
+    struct netblk_device *dev = hctx->queue->queuedata;
+    
+    netblk_flush(dev);
 }
 
 /*
@@ -503,6 +667,7 @@ static const struct block_device_operations netblk_fops = {
  */
 static struct blk_mq_ops netblk_mq_ops = {
     .queue_rq = netblk_request,
+    .commit_rqs = netblk_commit_rqs,
 };
 
 /*
@@ -570,10 +735,40 @@ static ssize_t stats_show(struct device *dev,
     return sprintf(buf,
         "read_bytes:  %llu\n"
         "write_bytes: %llu\n"
-        "errors:      %llu\n",
+        "errors:      %llu\n"
+        "batches:     %llu\n"
+        "batched_rqs: %llu\n"
+        "vectored_rqs: %llu\n",
         atomic64_read(&netblk_dev->read_bytes),
         atomic64_read(&netblk_dev->write_bytes),
-        atomic64_read(&netblk_dev->errors));
+        atomic64_read(&netblk_dev->errors),
+        atomic64_read(&netblk_dev->batches),
+        atomic64_read(&netblk_dev->batched_rqs),
+        atomic64_read(&netblk_dev->vectored_rqs));
+}
+
+/* Show vectored mode */
+static ssize_t vectored_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", netblk_dev->vectored);
+}
+
+/* Enable/disable READV/WRITEV grouping (needs a server that supports it) */
+static ssize_t vectored_store(struct device *dev,
+    struct device_attribute *attr, const char *buf, size_t count)
+{
+    bool enable;
+    if (kstrtobool(buf, &enable) != 0)
+        return -EINVAL;
+    
+    mutex_lock(&netblk_dev->lock);
+    netblk_dev->vectored = enable;
+    mutex_unlock(&netblk_dev->lock);
+    printk(KERN_INFO "netblk: Vectored commands %s\n",
+           enable ? "enabled" : "disabled");
+    
+    return count;
 }
 
 /* Manual connect */
@@ -600,6 +795,7 @@ static DEVICE_ATTR_RW(server_ip);
 static DEVICE_ATTR_RW(server_port);
 static DEVICE_ATTR_RO(state);
 static DEVICE_ATTR_RO(stats);
+static DEVICE_ATTR_RW(vectored);
 static DEVICE_ATTR_WO(connect);
 static DEVICE_ATTR_WO(disconnect);
 
@@ -608,6 +804,7 @@ static struct attribute *netblk_attrs[] = {
     &dev_attr_server_port.attr,
     &dev_attr_state.attr,
     &dev_attr_stats.attr,
+    &dev_attr_vectored.attr,
     &dev_attr_connect.attr,
     &dev_attr_disconnect.attr,
     NULL,
@@ -639,12 +836,18 @@ static int __init netblk_init(void)
     netblk_dev->server_port = 10809;
     netblk_dev->state = NETBLK_DISCONNECTED;
     netblk_dev->sock = NULL;
+    netblk_dev->vectored = true;
     
-    /* Initialize mutex and statistics */
+    /* Initialize locks, pending list and statistics */
     mutex_init(&netblk_dev->lock);
+    spin_lock_init(&netblk_dev->pending_lock);
+    INIT_LIST_HEAD(&netblk_dev->pending);
     atomic64_set(&netblk_dev->read_bytes, 0);
     atomic64_set(&netblk_dev->write_bytes, 0);
     atomic64_set(&netblk_dev->errors, 0);
+    atomic64_set(&netblk_dev->batches, 0);
+    atomic64_set(&netblk_dev->batched_rqs, 0);
+    atomic64_set(&netblk_dev->vectored_rqs, 0);
     atomic_set(&netblk_dev->should_stop, 0);
     
     /* Register block device */
@@ -660,8 +863,9 @@ static int __init netblk_init(void)
     netblk_dev->tag_set.nr_hw_queues = 1;
     netblk_dev->tag_set.queue_depth = 128;
     netblk_dev->tag_set.numa_node = NUMA_NO_NODE;
-    netblk_dev->tag_set.cmd_size = 0;
-    netblk_dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    netblk_dev->tag_set.cmd_size = sizeof(struct netblk_cmd);
+    /* Socket I/O sleeps inside queue_rq */
+    netblk_dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
     netblk_dev->tag_set.driver_data = netblk_dev;
     
     ret = blk_mq_alloc_tag_set(&netblk_dev->tag_set);
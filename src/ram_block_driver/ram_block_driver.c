@@ -0,0 +1,483 @@
+/*
+ * Sparse RAM Block Device Driver
+ *
+ * Implements the device described by include/block_driver.h: a RAM disk
+ * named MYBLK_DEVICE_NAME whose backing pages are allocated on the first
+ * write to them and kept in an xarray, so a 512MB device only costs the
+ * memory actually written. Unwritten ranges read as zeroes.
+ *
+ * Features:
+ * - Size set at load time (size_mb, default MYBLK_DEVICE_SIZE)
+ * - One blk-mq hardware queue per CPU, requests complete in queue_rq
+ * - DISCARD and WRITE_ZEROES free whole pages
+ * - MYBLK_IOCTL_GET_SIZE returns the size in bytes,
+ *   MYBLK_IOCTL_CLEAR frees all pages
+ * - Memory usage in /sys/block/myblkdev/stats
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/fs.h>
+#include <linux/hdreg.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/ioctl.h>
+
+#include "block_driver.h"
+
+#define DEVICE_NAME MYBLK_DEVICE_NAME
+#define PAGE_SECTORS_SHIFT (PAGE_SHIFT - SECTOR_SHIFT)
+#define PAGE_SECTORS (1 << PAGE_SECTORS_SHIFT)
+
+static unsigned int size_mb = MYBLK_DEVICE_SIZE >> 20;
+module_param(size_mb, uint, 0444);
+MODULE_PARM_DESC(size_mb, "Device size in MB, backing memory is only allocated when written");
+
+/* Device structure */
+struct ramblk_device {
+    unsigned long size;              /* Device size in bytes */
+    struct xarray pages;             /* Page index -> backing page */
+    struct gendisk *gd;              /* Generic disk structure */
+    struct blk_mq_tag_set tag_set;   /* blk-mq tag set */
+    struct request_queue *queue;     /* Request queue */
+
+    /* Statistics */
+    atomic_long_t nr_pages;          /* Backing pages allocated */
+    atomic64_t read_bytes;
+    atomic64_t write_bytes;
+    atomic64_t freed_pages;          /* Pages released by DISCARD/WRITE_ZEROES/CLEAR */
+    atomic64_t alloc_failures;       /* Writes requeued for lack of memory */
+};
+
+static struct ramblk_device *ramblk_dev = NULL;
+static int ramblk_major = 0;
+
+/*
+ * Backing pages
+ * Lookups run under rcu_read_lock() without any lock; removed pages are
+ * freed after a grace period so a concurrent copy never touches a page
+ * that went back to the allocator.
+ */
+static void ramblk_free_page_rcu(struct rcu_head *head)
+{
+    __free_page(container_of(head, struct page, rcu_head));
+}
+
+static void ramblk_remove_page(struct ramblk_device *dev, pgoff_t idx)
+{
+    struct page *page = xa_erase(&dev->pages, idx);
+
+    if (!page)
+        return;
+    atomic_long_dec(&dev->nr_pages);
+    atomic64_inc(&dev->freed_pages);
+    call_rcu(&page->rcu_head, ramblk_free_page_rcu);
+}
+
+/*
+ * Make sure every page under a write exists. queue_rq must not sleep, so
+ * pages are allocated with GFP_NOWAIT and the request is retried by
+ * blk-mq when that fails.
+ */
+static int ramblk_alloc_range(struct ramblk_device *dev, sector_t sector, u32 bytes)
+{
+    pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+    pgoff_t last = (sector + (bytes >> SECTOR_SHIFT) - 1) >> PAGE_SECTORS_SHIFT;
+    const gfp_t gfp = GFP_NOWAIT | __GFP_NOWARN;
+    struct page *page, *cur;
+
+    for (; idx <= last; idx++) {
+        if (xa_load(&dev->pages, idx))
+            continue;
+        page = alloc_page(gfp | __GFP_ZERO | __GFP_HIGHMEM);
+        if (!page)
+            return -ENOMEM;
+        /* Another CPU may have inserted the page meanwhile */
+        cur = xa_cmpxchg(&dev->pages, idx, NULL, page, gfp);
+        if (cur) {
+            __free_page(page);
+            if (xa_is_err(cur))
+                return xa_err(cur);
+            continue;
+        }
+        atomic_long_inc(&dev->nr_pages);
+    }
+    return 0;
+}
+
+/*
+ * Free the pages lying entirely inside a range. With zero set, the
+ * partially covered pages at either end are zeroed as well.
+ */
+static void ramblk_free_range(struct ramblk_device *dev, sector_t sector,
+    u32 bytes, bool zero)
+{
+    u64 start = (u64)sector << SECTOR_SHIFT;
+    u64 end = start + bytes;
+    u64 pos = start;
+    struct page *page;
+    u32 off, len;
+
+    while (pos < end) {
+        off = offset_in_page(pos);
+        len = min_t(u64, PAGE_SIZE - off, end - pos);
+        if (len == PAGE_SIZE) {
+            ramblk_remove_page(dev, pos >> PAGE_SHIFT);
+        } else if (zero) {
+            rcu_read_lock();
+            page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+            if (page)
+                memzero_page(page, off, len);
+            rcu_read_unlock();
+        }
+        pos += len;
+    }
+}
+
+/* Free every page, used by MYBLK_IOCTL_CLEAR */
+static void ramblk_free_all(struct ramblk_device *dev)
+{
+    struct page *page;
+    unsigned long idx;
+
+    xa_for_each(&dev->pages, idx, page)
+        ramblk_remove_page(dev, idx);
+}
+
+/* Copy one bio segment to or from the backing pages, caller holds RCU */
+static void ramblk_copy(struct ramblk_device *dev, struct bio_vec *bvec,
+    sector_t sector, bool write)
+{
+    void *mem = bvec_kmap_local(bvec);
+    struct page *page;
+    u32 done = 0, off, len;
+
+    while (done < bvec->bv_len) {
+        off = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+        len = min_t(u32, bvec->bv_len - done, PAGE_SIZE - off);
+        page = xa_load(&dev->pages, sector >> PAGE_SECTORS_SHIFT);
+        if (write) {
+            /* NULL only if a DISCARD of the same range raced with us */
+            if (page)
+                memcpy_to_page(page, off, mem + done, len);
+        } else if (page) {
+            memcpy_from_page(mem + done, page, off, len);
+        } else {
+            memset(mem + done, 0, len);
+        }
+        done += len;
+        sector += len >> SECTOR_SHIFT;
+    }
+    kunmap_local(mem);
+}
+
+/*
+ * Handle an I/O request
+ * Data is copied between the bio pages and the backing pages directly,
+ * the request completes before queue_rq returns.
+ */
+static blk_status_t ramblk_request(struct blk_mq_hw_ctx *hctx,
+                                   const struct blk_mq_queue_data *bd)
+{
+    struct request *req = bd->rq;
+    struct ramblk_device *dev = req->q->queuedata;
+    sector_t sector = blk_rq_pos(req);
+    u32 bytes = blk_rq_bytes(req);
+    struct bio_vec bvec;
+    struct req_iterator iter;
+    bool write = false;
+
+    if (sector + (bytes >> SECTOR_SHIFT) > get_capacity(dev->gd)) {
+        printk(KERN_ERR "myblkdev: Request beyond device size\n");
+        return BLK_STS_IOERR;
+    }
+
+    switch (req_op(req)) {
+    case REQ_OP_READ:
+        break;
+    case REQ_OP_WRITE:
+        if (ramblk_alloc_range(dev, sector, bytes) < 0) {
+            atomic64_inc(&dev->alloc_failures);
+            return BLK_STS_RESOURCE;
+        }
+        write = true;
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        blk_mq_start_request(req);
+        ramblk_free_range(dev, sector, bytes, req_op(req) == REQ_OP_WRITE_ZEROES);
+        blk_mq_end_request(req, BLK_STS_OK);
+        return BLK_STS_OK;
+    default:
+        printk(KERN_WARNING "myblkdev: Unsupported request operation\n");
+        return BLK_STS_NOTSUPP;
+    }
+
+    blk_mq_start_request(req);
+
+    rcu_read_lock();
+    rq_for_each_segment(bvec, req, iter) {
+        ramblk_copy(dev, &bvec, sector, write);
+        sector += bvec.bv_len >> SECTOR_SHIFT;
+    }
+    rcu_read_unlock();
+
+    if (write)
+        atomic64_add(bytes, &dev->write_bytes);
+    else
+        atomic64_add(bytes, &dev->read_bytes);
+
+    blk_mq_end_request(req, BLK_STS_OK);
+    return BLK_STS_OK;
+}
+
+/*
+ * Block device operations
+ */
+static int ramblk_open(struct block_device *bdev, fmode_t mode)
+{
+    printk(KERN_INFO "myblkdev: Device opened\n");
+    return 0;
+}
+
+static void ramblk_release(struct gendisk *gd, fmode_t mode)
+{
+    printk(KERN_INFO "myblkdev: Device closed\n");
+}
+
+static int ramblk_getgeo(struct block_device *bdev, struct hd_geometry *geo)
+{
+    struct ramblk_device *dev = bdev->bd_disk->private_data;
+
+    geo->heads = 4;
+    geo->sectors = 16;
+    geo->cylinders = (dev->size / MYBLK_SECTOR_SIZE) / (geo->heads * geo->sectors);
+    geo->start = 0;
+
+    return 0;
+}
+
+static int ramblk_ioctl(struct block_device *bdev, fmode_t mode,
+    unsigned int cmd, unsigned long arg)
+{
+    struct ramblk_device *dev = bdev->bd_disk->private_data;
+
+    switch (cmd) {
+    case MYBLK_IOCTL_GET_SIZE:
+        return put_user(dev->size, (unsigned long __user *)arg);
+    case MYBLK_IOCTL_CLEAR:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        ramblk_free_all(dev);
+        /* Drop cached copies of the old contents */
+        invalidate_bdev(bdev);
+        printk(KERN_INFO "myblkdev: Device cleared\n");
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct block_device_operations ramblk_fops = {
+    .owner = THIS_MODULE,
+    .open = ramblk_open,
+    .release = ramblk_release,
+    .getgeo = ramblk_getgeo,
+    .ioctl = ramblk_ioctl,
+};
+
+/*
+ * blk-mq operations
+ */
+static struct blk_mq_ops ramblk_mq_ops = {
+    .queue_rq = ramblk_request,
+};
+
+/*
+ * Sysfs attributes
+ */
+
+/* Show memory usage and traffic */
+static ssize_t stats_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct ramblk_device *rdev = dev_to_disk(dev)->private_data;
+    long pages = atomic_long_read(&rdev->nr_pages);
+
+    return sprintf(buf,
+        "size:           %lu\n"
+        "pages:          %ld\n"
+        "used_bytes:     %lu\n"
+        "read_bytes:     %llu\n"
+        "write_bytes:    %llu\n"
+        "freed_pages:    %llu\n"
+        "alloc_failures: %llu\n",
+        rdev->size, pages, (unsigned long)pages * PAGE_SIZE,
+        atomic64_read(&rdev->read_bytes),
+        atomic64_read(&rdev->write_bytes),
+        atomic64_read(&rdev->freed_pages),
+        atomic64_read(&rdev->alloc_failures));
+}
+
+static DEVICE_ATTR_RO(stats);
+
+static struct attribute *ramblk_attrs[] = {
+    &dev_attr_stats.attr,
+    NULL,
+};
+
+static const struct attribute_group ramblk_attr_group = {
+    .attrs = ramblk_attrs,
+};
+
+static const struct attribute_group *ramblk_attr_groups[] = {
+    &ramblk_attr_group,
+    NULL,
+};
+
+/*
+ * Initialize the device
+ */
+static int __init ramblk_init(void)
+{
+    int ret = 0;
+
+    printk(KERN_INFO "myblkdev: Initializing sparse RAM block device driver\n");
+
+    if (!size_mb) {
+        printk(KERN_ERR "myblkdev: size_mb must not be 0\n");
+        return -EINVAL;
+    }
+
+    /* Allocate device structure */
+    ramblk_dev = kzalloc(sizeof(struct ramblk_device), GFP_KERNEL);
+    if (!ramblk_dev) {
+        printk(KERN_ERR "myblkdev: Failed to allocate device structure\n");
+        return -ENOMEM;
+    }
+
+    ramblk_dev->size = (unsigned long)size_mb << 20;
+    xa_init(&ramblk_dev->pages);
+    atomic_long_set(&ramblk_dev->nr_pages, 0);
+    atomic64_set(&ramblk_dev->read_bytes, 0);
+    atomic64_set(&ramblk_dev->write_bytes, 0);
+    atomic64_set(&ramblk_dev->freed_pages, 0);
+    atomic64_set(&ramblk_dev->alloc_failures, 0);
+
+    /* Register block device */
+    ramblk_major = register_blkdev(0, DEVICE_NAME);
+    if (ramblk_major < 0) {
+        printk(KERN_ERR "myblkdev: Failed to register block device\n");
+        ret = ramblk_major;
+        goto out_free_dev;
+    }
+
+    /* Initialize blk-mq tag set, one hardware queue per CPU */
+    ramblk_dev->tag_set.ops = &ramblk_mq_ops;
+    ramblk_dev->tag_set.nr_hw_queues = num_online_cpus();
+    ramblk_dev->tag_set.queue_depth = 128;
+    ramblk_dev->tag_set.numa_node = NUMA_NO_NODE;
+    ramblk_dev->tag_set.cmd_size = 0;
+    ramblk_dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    ramblk_dev->tag_set.driver_data = ramblk_dev;
+
+    ret = blk_mq_alloc_tag_set(&ramblk_dev->tag_set);
+    if (ret) {
+        printk(KERN_ERR "myblkdev: Failed to allocate tag set\n");
+        goto out_unregister;
+    }
+
+    /* Allocate disk */
+    ramblk_dev->gd = blk_mq_alloc_disk(&ramblk_dev->tag_set, ramblk_dev);
+    if (IS_ERR(ramblk_dev->gd)) {
+        ret = PTR_ERR(ramblk_dev->gd);
+        printk(KERN_ERR "myblkdev: Failed to allocate disk\n");
+        goto out_free_tag_set;
+    }
+
+    ramblk_dev->gd->major = ramblk_major;
+    ramblk_dev->gd->first_minor = 0;
+    ramblk_dev->gd->minors = MYBLK_MINORS;
+    ramblk_dev->gd->fops = &ramblk_fops;
+    ramblk_dev->gd->private_data = ramblk_dev;
+    snprintf(ramblk_dev->gd->disk_name, 32, DEVICE_NAME);
+
+    ramblk_dev->queue = ramblk_dev->gd->queue;
+    ramblk_dev->queue->queuedata = ramblk_dev;
+    blk_queue_logical_block_size(ramblk_dev->queue, MYBLK_SECTOR_SIZE);
+    blk_queue_physical_block_size(ramblk_dev->queue, PAGE_SIZE);
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, ramblk_dev->queue);
+    /* Whole pages are freed, smaller ranges are ignored (DISCARD) or zeroed */
+    ramblk_dev->queue->limits.discard_granularity = PAGE_SIZE;
+    blk_queue_max_discard_sectors(ramblk_dev->queue, UINT_MAX >> SECTOR_SHIFT);
+    blk_queue_max_write_zeroes_sectors(ramblk_dev->queue, UINT_MAX >> SECTOR_SHIFT);
+
+    /* Set capacity */
+    set_capacity(ramblk_dev->gd, ramblk_dev->size / MYBLK_SECTOR_SIZE);
+
+    /* Add disk together with its sysfs attributes */
+    ret = device_add_disk(NULL, ramblk_dev->gd, ramblk_attr_groups);
+    if (ret) {
+        printk(KERN_ERR "myblkdev: Failed to add disk\n");
+        goto out_cleanup_disk;
+    }
+
+    printk(KERN_INFO "myblkdev: Sparse RAM block device initialized successfully\n");
+    printk(KERN_INFO "myblkdev: Device size: %lu bytes (%lu sectors), %u hardware queues\n",
+           ramblk_dev->size, ramblk_dev->size / MYBLK_SECTOR_SIZE,
+           ramblk_dev->tag_set.nr_hw_queues);
+
+    return 0;
+
+out_cleanup_disk:
+    put_disk(ramblk_dev->gd);
+out_free_tag_set:
+    blk_mq_free_tag_set(&ramblk_dev->tag_set);
+out_unregister:
+    unregister_blkdev(ramblk_major, DEVICE_NAME);
+out_free_dev:
+    kfree(ramblk_dev);
+    ramblk_dev = NULL;
+    return ret;
+}
+
+/*
+ * Cleanup the device
+ */
+static void __exit ramblk_exit(void)
+{
+    printk(KERN_INFO "myblkdev: Cleaning up sparse RAM block device driver\n");
+
+    if (ramblk_dev) {
+        if (ramblk_dev->gd) {
+            del_gendisk(ramblk_dev->gd);
+            put_disk(ramblk_dev->gd);
+        }
+
+        blk_mq_free_tag_set(&ramblk_dev->tag_set);
+
+        if (ramblk_major > 0)
+            unregister_blkdev(ramblk_major, DEVICE_NAME);
+
+        ramblk_free_all(ramblk_dev);
+        /* Wait for the RCU callbacks freeing the pages */
+        rcu_barrier();
+        xa_destroy(&ramblk_dev->pages);
+        kfree(ramblk_dev);
+    }
+
+    printk(KERN_INFO "myblkdev: Sparse RAM block device driver unloaded\n");
+}
+
+module_init(ramblk_init);
+module_exit(ramblk_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Huaizhen.Lv");
+MODULE_DESCRIPTION("Sparse page-backed RAM Block Device Driver with blk-mq");
+MODULE_VERSION("1.0");